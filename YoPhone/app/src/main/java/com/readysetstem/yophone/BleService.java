@@ -32,6 +32,8 @@ import android.os.Binder;
 import android.os.IBinder;
 import android.util.Log;
 
+import java.io.ByteArrayOutputStream;
+import java.util.Calendar;
 import java.util.List;
 import java.util.UUID;
 
@@ -59,6 +61,17 @@ public class BleService extends Service {
 
     private int mRxPackets = 0;
 
+    // Mic audio compressed by the watch (debug command packets): a 4 byte header, then IMA-ADPCM
+    // blocks.  Decoded to 16-bit PCM here, before the audio goes anywhere else.
+    public static final int MIC_ADPCM_COMMAND = 6;
+    public static final int MIC_PACKET_HEADER_BYTES = 4;
+    private final AdpcmDecoder mAdpcmDecoder = new AdpcmDecoder();
+
+    // Debug command setting the watch's clock: the command byte, the local time of day in seconds
+    // since midnight (uint32, little endian), then the local date in days since 1970-01-01
+    // (uint16, little endian).
+    public static final int SET_TIME_COMMAND = 7;
+
     private String[] characteristicsWithNotifications = {
             GattAttributes.CHARACTERISTIC_VOICE_DATA,
             GattAttributes.CHARACTERISTIC_DEBUG_COMMAND,
@@ -103,6 +116,13 @@ public class BleService extends Service {
             }
         }
 
+        @Override
+        public void onMtuChanged(BluetoothGatt gatt, int mtu, int status) {
+            Log.d(TAG, "Entering: " + Thread.currentThread().getStackTrace()[2].getMethodName() + "()");
+            // The MTU exchange is the last step of connecting, so the watch is ready for the time
+            writeTimeOfDay();
+        }
+
         @Override
         public void onCharacteristicRead(BluetoothGatt gatt,
                                          BluetoothGattCharacteristic characteristic,
@@ -145,7 +165,12 @@ public class BleService extends Service {
         final Intent intent = new Intent(action);
 
         Log.i(TAG, "broadcastUpdate()");
-        final byte[] data = characteristic.getValue();
+        byte[] data = characteristic.getValue();
+        if (data != null && data.length > 0 && data[0] == MIC_ADPCM_COMMAND
+                && characteristic.getUuid().equals(
+                        UUID.fromString(GattAttributes.CHARACTERISTIC_DEBUG_COMMAND))) {
+            data = mAdpcmDecoder.decodePacket(data, MIC_PACKET_HEADER_BYTES);
+        }
         intent.putExtra(EXTRA_CHARACTERISTIC, characteristic.getUuid().toString());
         if (data != null && data.length > 0) {
             intent.putExtra(EXTRA_DATA, data);
@@ -153,6 +178,105 @@ public class BleService extends Service {
         sendBroadcast(intent);
     }
 
+    /**
+     * IMA-ADPCM decoder, for the blocks encoded by the watch (see adpcm.h in YoWatch).  Each
+     * block is an 8 byte header, then 4-bit codes for BLOCK_SAMPLES samples, first sample in the
+     * low nibble.  The header (little endian) is:
+     *
+     *      bytes 0-2   samples dropped by the watch just before this block
+     *      byte 3      BLOCK_MAGIC
+     *      bytes 4-5   predictor at the start of the block
+     *      byte 6      step index at the start of the block
+     *      byte 7      0
+     *
+     * As every block starts with the decoder state, decoding resyncs at each block.
+     */
+    static class AdpcmDecoder {
+        static final int BLOCK_HEADER_BYTES = 8;
+        static final int BLOCK_SAMPLES = 126;
+        static final int BLOCK_BYTES = BLOCK_HEADER_BYTES + BLOCK_SAMPLES / 2;
+        static final int BLOCK_MAGIC = 0xAD;
+        static final int MAX_INDEX = 88;
+        // Longest gap filled with silence: 1 second at 16 kHz.  A longer gap means the watch
+        // stalled (or the stream restarted), and is just a resync - padding it in full could
+        // mean megabytes of silence.
+        static final int MAX_GAP_SAMPLES = 16000;
+
+        private static final int[] STEP_TABLE = {
+                7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+                19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+                50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+                130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+                337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+                876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+                2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+                5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+                15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+        };
+        private static final int[] INDEX_TABLE = {
+                -1, -1, -1, -1, 2, 4, 6, 8,
+                -1, -1, -1, -1, 2, 4, 6, 8
+        };
+
+        private int mPredictor;
+        private int mIndex;
+
+        private int decode(int code) {
+            int step = STEP_TABLE[mIndex];
+            int delta = step >> 3;
+            if ((code & 4) != 0) delta += step;
+            if ((code & 2) != 0) delta += step >> 1;
+            if ((code & 1) != 0) delta += step >> 2;
+            mPredictor += (code & 8) != 0 ? -delta : delta;
+            mPredictor = Math.min(Math.max(mPredictor, -32768), 32767);
+            mIndex = Math.min(Math.max(mIndex + INDEX_TABLE[code], 0), MAX_INDEX);
+            return mPredictor;
+        }
+
+        private static void writeSample(ByteArrayOutputStream out, int sample) {
+            out.write(sample);
+            out.write(sample >> 8);
+        }
+
+        /**
+         * Decodes the ADPCM blocks in a packet to 16-bit little endian PCM, with the samples the
+         * watch dropped filled in with silence (up to MAX_GAP_SAMPLES).  Blocks with a bad
+         * header, and anything after them, are skipped.
+         *
+         * @param packet Packet, header then ADPCM blocks
+         * @param headerBytes Bytes of packet header, copied as is to the decoded packet
+         * @return Decoded packet: the header, then PCM
+         */
+        byte[] decodePacket(byte[] packet, int headerBytes) {
+            ByteArrayOutputStream out = new ByteArrayOutputStream();
+            out.write(packet, 0, Math.min(headerBytes, packet.length));
+
+            for (int b = headerBytes; b + BLOCK_BYTES <= packet.length; b += BLOCK_BYTES) {
+                if ((packet[b + 3] & 0xFF) != BLOCK_MAGIC || (packet[b + 6] & 0xFF) > MAX_INDEX) {
+                    Log.w(TAG, "decodePacket: bad ADPCM block header");
+                    break;
+                }
+                int gap = (packet[b] & 0xFF) | ((packet[b + 1] & 0xFF) << 8)
+                        | ((packet[b + 2] & 0xFF) << 16);
+                if (gap > MAX_GAP_SAMPLES) {
+                    Log.w(TAG, "decodePacket: " + gap + " samples dropped, resyncing");
+                    gap = MAX_GAP_SAMPLES;
+                }
+                for (int i = 0; i < gap; i++) {
+                    writeSample(out, 0);
+                }
+
+                mPredictor = (short) ((packet[b + 4] & 0xFF) | ((packet[b + 5] & 0xFF) << 8));
+                mIndex = packet[b + 6] & 0xFF;
+                for (int i = b + BLOCK_HEADER_BYTES; i < b + BLOCK_BYTES; i++) {
+                    writeSample(out, decode(packet[i] & 0xF));
+                    writeSample(out, decode((packet[i] >> 4) & 0xF));
+                }
+            }
+            return out.toByteArray();
+        }
+    }
+
     public class LocalBinder extends Binder {
         BleService getService() {
             return BleService.this;
@@ -298,6 +422,25 @@ return START_STICKY;
         mBluetoothGatt.writeCharacteristic(characteristic);
     }
 
+    /**
+     * Sets the watch's clock to the local time of day and date (see SET_TIME_COMMAND).
+     */
+    public void writeTimeOfDay() {
+        Calendar now = Calendar.getInstance();
+        int seconds = now.get(Calendar.HOUR_OF_DAY) * 60 * 60 + now.get(Calendar.MINUTE) * 60
+                + now.get(Calendar.SECOND);
+        long localMillis = now.getTimeInMillis() + now.get(Calendar.ZONE_OFFSET)
+                + now.get(Calendar.DST_OFFSET);
+        int days = (int) (localMillis / (24L * 60 * 60 * 1000));
+        BluetoothGattCharacteristic characteristic = getCharacteristic(
+                GattAttributes.SERVICE_SMARTWATCH, GattAttributes.CHARACTERISTIC_DEBUG_COMMAND);
+        characteristic.setValue(new byte[] {
+                SET_TIME_COMMAND,
+                (byte) seconds, (byte) (seconds >> 8), (byte) (seconds >> 16), (byte) (seconds >> 24),
+                (byte) days, (byte) (days >> 8)
+        });
+        writeCharacteristic(characteristic);
+    }
 
     /**
      * Gets a characteristic given the service and characteristic attr strings
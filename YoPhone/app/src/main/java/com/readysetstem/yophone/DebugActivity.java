@@ -31,7 +31,6 @@ import java.io.ByteArrayOutputStream;
 import java.io.FileOutputStream;
 import java.io.IOException;
 import java.io.OutputStream;
-import java.util.Arrays;
 import java.util.UUID;
 
 /**
@@ -43,6 +42,16 @@ import java.util.UUID;
 public class DebugActivity extends BleServiceConnectionActivity {
     private final static String TAG = DebugActivity.class.getSimpleName();
 
+    // Mic audio stream blocks (see i2s.h in YoWatch): a 4 byte header (24-bit
+    // little endian count of samples dropped before the block, then a magic
+    // byte), then 16-bit samples.
+    private final static int MIC_BLOCK_BYTES = 256;
+    private final static int MIC_BLOCK_HEADER_BYTES = 4;
+    private final static int MIC_BLOCK_MAGIC = 0xA5;
+    private final static int MIC_BYTES_PER_SAMPLE = 2;
+    // Longest gap recorded as silence (1 second at 16 kHz), see BleService.AdpcmDecoder
+    private final static int MIC_MAX_GAP_SAMPLES = 16000;
+
     private ActionBar mActionBar;
     private TextView mTvSpeedtestKbps;
     private ImageView mIvSpeedtestPlay;
@@ -50,6 +59,9 @@ public class DebugActivity extends BleServiceConnectionActivity {
     private ImageView mIvMicStop;
     private ImageView mIvMicRecord;
     ByteArrayOutputStream mMicRecording;
+    private byte[] mMicBlock = new byte[MIC_BLOCK_BYTES];
+    private int mMicBlockLen;
+    private int mMicGapSamples;
     private int mLen;
     private int mSpeedtestPackets;
     private long mStartTime;
@@ -82,7 +94,7 @@ public class DebugActivity extends BleServiceConnectionActivity {
         BluetoothGattCharacteristic characteristic = mBleService.getCharacteristic(
                 GattAttributes.SERVICE_SMARTWATCH, GattAttributes.CHARACTERISTIC_DEBUG_COMMAND);
         Log.i(TAG, characteristic.getUuid().toString());
-        characteristic.setValue(1, BluetoothGattCharacteristic.FORMAT_UINT8, 0);
+        characteristic.setValue(new byte[] {1});
         mBleService.writeCharacteristic(characteristic);
     }
 
@@ -112,17 +124,77 @@ public class DebugActivity extends BleServiceConnectionActivity {
                             break;
                         case 5:
                             try {
-                                mMicRecording.write(Arrays.copyOfRange(data, 4, data.length));
+                                writeMicData(data, 4);
                             } catch (IOException e) {
                                 e.printStackTrace();
                             }
                             break;
+                        case BleService.MIC_ADPCM_COMMAND:
+                            // Already decoded to PCM by BleService
+                            mMicRecording.write(data, BleService.MIC_PACKET_HEADER_BYTES,
+                                    data.length - BleService.MIC_PACKET_HEADER_BYTES);
+                            break;
                     }
                 }
             }
         });
     }
 
+    /**
+     * Add mic stream bytes to the recording, a block at a time.  Blocks are split across
+     * notifications, so a partial block is kept until the rest arrives.  Dropped samples are
+     * recorded as silence, so the recording keeps time.
+     *
+     * If a block has a bad header (e.g. a notification was lost mid block), the stream is
+     * resynced: the bytes are scanned for the next header magic, and block collection
+     * restarts at that header.
+     */
+    private void writeMicData(byte[] data, int offset) throws IOException {
+        while (offset < data.length) {
+            int n = Math.min(data.length - offset, MIC_BLOCK_BYTES - mMicBlockLen);
+            System.arraycopy(data, offset, mMicBlock, mMicBlockLen, n);
+            mMicBlockLen += n;
+            offset += n;
+            if (mMicBlockLen < MIC_BLOCK_BYTES) break;
+
+            if ((mMicBlock[3] & 0xFF) != MIC_BLOCK_MAGIC) {
+                Log.w(TAG, "writeMicData: bad block header, resyncing");
+                mMicBlockLen = resyncMicBlock();
+                continue;
+            }
+            mMicBlockLen = 0;
+            int gap = (mMicBlock[0] & 0xFF) | ((mMicBlock[1] & 0xFF) << 8)
+                    | ((mMicBlock[2] & 0xFF) << 16);
+            if (gap > MIC_MAX_GAP_SAMPLES) {
+                Log.w(TAG, "writeMicData: " + gap + " samples dropped, resyncing");
+                gap = MIC_MAX_GAP_SAMPLES;
+            }
+            if (gap > 0) {
+                Log.i(TAG, "writeMicData: " + gap + " samples dropped");
+                mMicGapSamples += gap;
+                mMicRecording.write(new byte[gap * MIC_BYTES_PER_SAMPLE]);
+            }
+            mMicRecording.write(mMicBlock, MIC_BLOCK_HEADER_BYTES,
+                    MIC_BLOCK_BYTES - MIC_BLOCK_HEADER_BYTES);
+        }
+    }
+
+    /**
+     * Move the first possible block header after the start of mMicBlock (the next header magic
+     * byte) to the start.  If there is none, the last bytes that could still be the start of a
+     * header are kept.
+     *
+     * @return Bytes of mMicBlock still collected
+     */
+    private int resyncMicBlock() {
+        int start = 1;
+        while (start + 3 < MIC_BLOCK_BYTES && (mMicBlock[start + 3] & 0xFF) != MIC_BLOCK_MAGIC) {
+            start++;
+        }
+        System.arraycopy(mMicBlock, start, mMicBlock, 0, MIC_BLOCK_BYTES - start);
+        return MIC_BLOCK_BYTES - start;
+    }
+
     public void onConnectionState() {
         super.onConnectionState();
         mActionBar.setTitle(getString(R.string.debug_title) + " (" + getString(mConnectionStateRid) + ")");
@@ -158,10 +230,13 @@ public class DebugActivity extends BleServiceConnectionActivity {
         BluetoothGattCharacteristic characteristic = mBleService.getCharacteristic(
                 GattAttributes.SERVICE_SMARTWATCH, GattAttributes.CHARACTERISTIC_DEBUG_COMMAND);
         // TODO Do not use hardcoded constants
-        characteristic.setValue(3, BluetoothGattCharacteristic.FORMAT_UINT8, 0);
+        // The whole value, so no bytes are left over from a longer command
+        characteristic.setValue(new byte[] {3});
         mBleService.writeCharacteristic(characteristic);
 
         mMicRecording = new ByteArrayOutputStream();
+        mMicBlockLen = 0;
+        mMicGapSamples = 0;
         mIvMicRecord.setEnabled(false);
         mIvMicRecord.setColorFilter(Color.argb(150,200,200,200));
     }
@@ -170,6 +245,7 @@ public class DebugActivity extends BleServiceConnectionActivity {
         String name = Environment.getExternalStorageDirectory().getAbsolutePath()+"/yourfilename";
         try (OutputStream outputStream = new FileOutputStream(name)) {
             mMicRecording.writeTo(outputStream);
+            Log.i(TAG, "onClickMicStop: " + mMicGapSamples + " samples dropped in total");
         } catch (IOException e) {
             e.printStackTrace();
         }
@@ -178,7 +254,7 @@ public class DebugActivity extends BleServiceConnectionActivity {
         BluetoothGattCharacteristic characteristic = mBleService.getCharacteristic(
                 GattAttributes.SERVICE_SMARTWATCH, GattAttributes.CHARACTERISTIC_DEBUG_COMMAND);
         // TODO Do not use hardcoded constants
-        characteristic.setValue(4, BluetoothGattCharacteristic.FORMAT_UINT8, 0);
+        characteristic.setValue(new byte[] {4});
         mBleService.writeCharacteristic(characteristic);
 
         mIvMicRecord.setEnabled(true);
@@ -0,0 +1,193 @@
+/*
+ * adpcm.c
+ *
+ * IMA-ADPCM audio compression, 16-bit samples to 4 bits
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <errno.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "i2s.h"
+#include "adpcm.h"
+
+//
+// Standard IMA-ADPCM: each sample is coded as the 4-bit quantized difference
+// from the predicted (last decoded) sample, with a step size that adapts to
+// the signal.  All fixed point, shifts and adds only - the Cortex-M0 has no
+// divide.
+//
+// The encoder tracks what the decoder will decode, so errors don't build up.
+//
+// YoPhone's BleService has the matching decoder.  AdpcmDecodeBlock() is here
+// for testing the encoder.
+//
+#define ADPCM_MAX_INDEX 88
+
+static const int16 stepTable[ADPCM_MAX_INDEX + 1] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8 indexTable[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+//
+// Update /state/ for /code/, as both encoder and decoder do.
+//
+static void Decode(
+    struct ADPCM_STATE * state,
+    uint8 code
+    )
+{
+    int step = stepTable[state->index];
+    int delta = step >> 3;
+    int predictor;
+    int index;
+
+    if (code & 4) delta += step;
+    if (code & 2) delta += step >> 1;
+    if (code & 1) delta += step >> 2;
+
+    predictor = state->predictor + ((code & 8) ? -delta : delta);
+    state->predictor = MIN(MAX(predictor, -32768), 32767);
+
+    index = state->index + indexTable[code];
+    state->index = MIN(MAX(index, 0), ADPCM_MAX_INDEX);
+}
+
+static uint8 Encode(
+    struct ADPCM_STATE * state,
+    int16 sample
+    )
+{
+    int step = stepTable[state->index];
+    int diff = sample - state->predictor;
+    uint8 code = 0;
+
+    if (diff < 0) {
+        code = 8;
+        diff = -diff;
+    }
+    if (diff >= step) {
+        code |= 4;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 2;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        code |= 1;
+    }
+
+    Decode(state, code);
+    return code;
+}
+
+//
+// Start a new stream.
+//
+void AdpcmInit(
+    struct ADPCM_STATE * state
+    )
+{
+    state->predictor = 0;
+    state->index = 0;
+}
+
+//
+// Encode an I2S stream block (see i2s.h) into an ADPCM block (see adpcm.h).
+// /state/ carries over from block to block.
+//
+// @param state         encoder state
+// @param i2sBlock      I2S stream block, SERIAL_RAM_BUFSIZE bytes
+// @param adpcmBlock    ADPCM block, ADPCM_BLOCK_BYTES
+//
+// @return ADPCM_BLOCK_BYTES, or -EINVAL if /i2sBlock/ has a bad header
+//
+int AdpcmEncodeBlock(
+    struct ADPCM_STATE * state,
+    const uint8 * i2sBlock,
+    uint8 * adpcmBlock
+    )
+{
+    const uint8 * in = &i2sBlock[I2S_BLOCK_HEADER_BYTES];
+    uint8 * out = &adpcmBlock[ADPCM_BLOCK_HEADER_BYTES];
+    int i;
+
+    if (i2sBlock[3] != I2S_BLOCK_MAGIC) return -EINVAL;
+
+    // Gap is passed through as is
+    adpcmBlock[0] = i2sBlock[0];
+    adpcmBlock[1] = i2sBlock[1];
+    adpcmBlock[2] = i2sBlock[2];
+    adpcmBlock[3] = ADPCM_BLOCK_MAGIC;
+    adpcmBlock[4] = state->predictor;
+    adpcmBlock[5] = state->predictor >> 8;
+    adpcmBlock[6] = state->index;
+    adpcmBlock[7] = 0;
+
+    for (i = 0; i < I2S_BLOCK_SAMPLES; i += 2) {
+        uint8 lo = Encode(state, (int16) (in[0] | (in[1] << 8)));
+        uint8 hi = Encode(state, (int16) (in[2] | (in[3] << 8)));
+        *out++ = lo | (hi << 4);
+        in += 2 * I2S_BYTES_PER_SAMPLE;
+    }
+
+    return ADPCM_BLOCK_BYTES;
+}
+
+//
+// Decode an ADPCM block.
+//
+// @param adpcmBlock    ADPCM block, ADPCM_BLOCK_BYTES
+// @param samples       decoded samples, I2S_BLOCK_SAMPLES of them
+// @param pGapSamples   set to the samples dropped just before this block
+//
+// @return I2S_BLOCK_SAMPLES, or -EINVAL if /adpcmBlock/ has a bad header
+//
+int AdpcmDecodeBlock(
+    const uint8 * adpcmBlock,
+    int16 * samples,
+    uint32 * pGapSamples
+    )
+{
+    const uint8 * in = &adpcmBlock[ADPCM_BLOCK_HEADER_BYTES];
+    struct ADPCM_STATE state;
+    int i;
+
+    if (adpcmBlock[3] != ADPCM_BLOCK_MAGIC) return -EINVAL;
+    if (adpcmBlock[6] > ADPCM_MAX_INDEX) return -EINVAL;
+
+    *pGapSamples = adpcmBlock[0] | (adpcmBlock[1] << 8) | (adpcmBlock[2] << 16);
+    state.predictor = (int16) (adpcmBlock[4] | (adpcmBlock[5] << 8));
+    state.index = adpcmBlock[6];
+
+    for (i = 0; i < I2S_BLOCK_SAMPLES; i += 2) {
+        Decode(&state, *in & 0xF);
+        samples[i] = state.predictor;
+        Decode(&state, *in >> 4);
+        samples[i + 1] = state.predictor;
+        in++;
+    }
+
+    return I2S_BLOCK_SAMPLES;
+}
@@ -0,0 +1,51 @@
+#ifndef _ADPCM_H_
+#define _ADPCM_H_
+
+#include <project.h>
+#include "i2s.h"
+
+//
+// IMA-ADPCM codec state: the predicted sample, and the index of the
+// quantizer step size.
+//
+struct ADPCM_STATE {
+    int16 predictor;
+    uint8 index;
+};
+
+//
+// ADPCM block, encoded from one I2S stream block (see i2s.h), 4 bits per
+// sample.  The header is 8 bytes, little endian:
+//
+//      bytes 0-2   samples dropped just before this block (from the I2S
+//                  block header)
+//      byte 3      ADPCM_BLOCK_MAGIC
+//      bytes 4-5   predictor at the start of the block
+//      byte 6      step index at the start of the block
+//      byte 7      0
+//
+// Then I2S_BLOCK_SAMPLES 4-bit codes, first sample in the low nibble.  As
+// each block starts with the codec state, a decoder can start (or resync
+// after a lost packet) at any block.
+//
+#define ADPCM_BLOCK_HEADER_BYTES    8
+#define ADPCM_BLOCK_MAGIC           0xAD
+#define ADPCM_BLOCK_BYTES           (ADPCM_BLOCK_HEADER_BYTES + I2S_BLOCK_SAMPLES / 2)
+
+void AdpcmInit(
+    struct ADPCM_STATE * state
+    );
+
+int AdpcmEncodeBlock(
+    struct ADPCM_STATE * state,
+    const uint8 * i2sBlock,
+    uint8 * adpcmBlock
+    );
+
+int AdpcmDecodeBlock(
+    const uint8 * adpcmBlock,
+    int16 * samples,
+    uint32 * pGapSamples
+    );
+
+#endif
@@ -4,5 +4,12 @@
 #define SCREEN_WIDTH    128
 #define SCREEN_HEIGHT   96
 
+//
+// The OLED RAM has more rows than are shown.  The rows past SCREEN_HEIGHT are
+// off screen, and are used for hardware scrolling (see DisplayScrollStart()).
+//
+#define DISPLAY_RAM_HEIGHT  128
+#define DISPLAY_SPARE_ROWS  (DISPLAY_RAM_HEIGHT - SCREEN_HEIGHT)
+
 #endif
 
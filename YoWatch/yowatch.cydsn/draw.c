@@ -10,6 +10,8 @@
  * published by the Free Software Foundation.
  */
 #include <project.h>
+#include <errno.h>
+#include <string.h>
 #include "printf.h"
 #include "assert.h"
 #include "fonts.h"
@@ -18,6 +20,8 @@
 #include "fonts.h"
 #include "util.h"
 #include "draw.h"
+#include "framebuf.h"
+#include "images.h"
 
 #define SCREEN_WIDTH    128
 #define SCREEN_HEIGHT   96
@@ -28,29 +32,375 @@ extern uint8 displayBuf[DISPLAY_BUF_SIZE];
 RECT SCREEN_BOUNDS = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
 
 //
-// Copy the character pixel image /p/ into the destination, bounded by /bound/.
+// If set, drawing goes to the shadow framebuffer (see framebuf.c), and only
+// shows up on the OLED on FramebufFlush().  Otherwise it goes straight to the
+// OLED.
+//
+static int drawToFramebuf = 0;
+
+//
+// Draw to the framebuffer (/enable/ true), or straight to the OLED.  The
+// framebuffer is only used if it exists.
+//
+void DrawToFramebuf(
+    int enable
+    )
+{
+    drawToFramebuf = enable && FramebufExists();
+}
+
+//
+// All drawing is output via these two, to whichever target is selected.
+//
+static void TargetRect(
+    uint32 x,
+    uint32 y,
+    uint32 width,
+    uint32 height,
+    uint16 color
+    )
+{
+    if (drawToFramebuf) {
+        FramebufRect((RECT) {x, y, width, height}, color);
+    } else {
+        DisplayRect(x, y, width, height, color);
+    }
+}
+
+static void TargetBitmap(
+    uint8 * buf,
+    uint32 x1,
+    uint32 y1,
+    uint32 x2,
+    uint32 y2
+    )
+{
+    if (drawToFramebuf) {
+        FramebufBitmap(buf, (RECT) {x1, y1, x2 - x1 + 1, y2 - y1 + 1});
+    } else {
+        DisplayBitmap(buf, x1, y1, x2, y2);
+    }
+}
+
+//
+// Display list
+//
+// Between DrawListBegin() and DrawListEnd(), draw functions don't output
+// anything - they just record the primitive.  DrawListEnd() then rasterizes
+// the list one tile (a full width band of rows that fits in displayBuf) at a
+// time, and sends each tile in one TargetBitmap() transfer.  Overlapping
+// draws cost no extra SPI bytes.
+//
+// Only the bounding box of the list is sent.  Pixels within it that no
+// primitive covers are set to the list's background color.
+//
+// Text is recorded by reference, so it must stay valid until DrawListEnd().
+//
+#define DRAW_LIST_MAX_OPS   48
+#define TILE_HEIGHT         (DISPLAY_BUF_SIZE / (SCREEN_WIDTH * sizeof(uint16)))
+
+enum {
+    DRAW_OP_RECT,
+    DRAW_OP_TEXT,
+    DRAW_OP_LINE,
+    DRAW_OP_THICK_LINE,
+    DRAW_OP_CIRCLE,
+    DRAW_OP_ARC,
+    DRAW_OP_POLYGON,
+    DRAW_OP_IMAGE,
+};
+
+struct DRAW_OP {
+    uint8 type;
+    uint8 font;
+    uint16 color;
+    uint16 bgColor;
+    int16 x1, y1;   // Line start, text/image origin, or circle/arc center
+    int16 x2, y2;   // Line end, or circle/arc radius (x2) and thickness (y2)
+    int16 a, b;     // Line thickness (a), or arc start/end angles
+    RECT bbox;      // Area covered, cropped to screen
+    union {
+        char * text;
+        POINT * points;
+        const struct IMAGE * image;
+    };
+};
+
+static struct {
+    struct DRAW_OP ops[DRAW_LIST_MAX_OPS];
+    int num;
+    RECT bbox;
+    uint16 bgColor;
+} drawList;
+static int drawListActive = 0;
+
+static int DrawListSend();
+
+static void DrawTextStrip(
+    char * text,
+    int x,
+    int y,
+    RECT strip,
+    int font,
+    int fgColor,
+    int bgColor
+    );
+
+//
+// Spans (thin solid rects) from the line and shape rasterizers are batched,
+// and sent together by DisplaySpans(), which packs many of them into each
+// bus transfer.  SpansFlush() must be called once a shape is done.
+//
+#define MAX_SPANS 16
+
+static struct {
+    RECT r[MAX_SPANS];
+    int num;
+    uint16 color;
+} spans;
+
+static void SpansFlush()
+{
+    if (spans.num == 0) return;
+
+    if (drawToFramebuf) {
+        for (int i = 0; i < spans.num; i++) {
+            FramebufRect(spans.r[i], spans.color);
+        }
+    } else {
+        DisplaySpans(spans.r, spans.num, spans.color);
+    }
+    spans.num = 0;
+}
+
+static void SpanAdd(
+    RECT r,
+    int color
+    )
+{
+    if (!DoRectsIntersect(r, SCREEN_BOUNDS)) return;
+    r = RectIntersection(r, SCREEN_BOUNDS);
+
+    if (spans.num == MAX_SPANS || (spans.num > 0 && spans.color != color)) {
+        SpansFlush();
+    }
+    spans.r[spans.num++] = r;
+    spans.color = color;
+}
+
+//
+// @return a new op in the display list covering /bbox/, or NULL if the op
+// is not visible.  If the list is full, it is sent now, and the rest of
+// the primitives until DrawListEnd() are drawn directly (NULL is returned).
+//
+static struct DRAW_OP * DrawListAdd(
+    int type,
+    RECT bbox
+    )
+{
+    struct DRAW_OP * op;
+
+    if (!DoRectsIntersect(bbox, SCREEN_BOUNDS)) return NULL;
+    bbox = RectIntersection(bbox, SCREEN_BOUNDS);
+
+    if (drawList.num == DRAW_LIST_MAX_OPS) {
+        DrawListSend();
+        drawListActive = 0;
+        return NULL;
+    }
+
+    if (drawList.num == 0) {
+        drawList.bbox = bbox;
+    } else {
+        RECT u = drawList.bbox;
+        drawList.bbox.x = MIN(u.x, bbox.x);
+        drawList.bbox.y = MIN(u.y, bbox.y);
+        drawList.bbox.width = MAX(u.x + u.width, bbox.x + bbox.width) - drawList.bbox.x;
+        drawList.bbox.height = MAX(u.y + u.height, bbox.y + bbox.height) - drawList.bbox.y;
+    }
+
+    op = &drawList.ops[drawList.num++];
+    op->type = type;
+    op->bbox = bbox;
+    return op;
+}
+
+//
+// Build the lookup table used by ExpandBits(): for each 2-bit pair of pixel
+// bits, the two RGB565 pixels as one 32-bit word (first pixel in the low
+// half).
+//
+static void ColorLut(
+    uint32 lut[4],
+    int fgColor,
+    int bgColor
+    )
+{
+    lut[0] = ((uint32) bgColor << 16) | (uint16) bgColor;
+    lut[1] = ((uint32) bgColor << 16) | (uint16) fgColor;
+    lut[2] = ((uint32) fgColor << 16) | (uint16) bgColor;
+    lut[3] = ((uint32) fgColor << 16) | (uint16) fgColor;
+}
+
+//
+// Expand 1bpp pixels into RGB565, two pixels per 32-bit store.  An unaligned
+// leading/trailing pixel is written as a single uint16.
+//
+// @param dest      destination pixels
+// @param bits      pixel bits, first pixel in bit 0.  Bits past 32 are 0 (bg).
+// @param n         number of pixels to write
+// @param lut       lookup table from ColorLut()
+//
+// @return dest, advanced past the written pixels
+//
+static uint16 * ExpandBits(
+    uint16 * dest,
+    uint32 bits,
+    int n,
+    const uint32 lut[4]
+    )
+{
+    uint32 * d;
+
+    if (n <= 0) return dest;
+
+    if ((uint32) dest & 2) {
+        *dest++ = lut[bits & 1];
+        bits >>= 1;
+        n--;
+    }
+
+    d = (uint32 *) dest;
+    for (; n >= 8; n -= 8) {
+        d[0] = lut[bits & 3];
+        d[1] = lut[(bits >> 2) & 3];
+        d[2] = lut[(bits >> 4) & 3];
+        d[3] = lut[(bits >> 6) & 3];
+        d += 4;
+        bits >>= 8;
+    }
+    for (; n >= 2; n -= 2) {
+        *d++ = lut[bits & 3];
+        bits >>= 2;
+    }
+
+    dest = (uint16 *) d;
+    if (n) {
+        *dest++ = lut[bits & 1];
+    }
+    return dest;
+}
+
+//
+// @return the pixel bits of column /col/ of char /p/, top pixel in bit 0
+//
+static uint32 CharColumnBits(
+    const struct FONT_CHAR * p,
+    int col
+    )
+{
+    int columnBytes = FONT_COLUMN_BYTES(p->height);
+    const uint8 * src = &p->image[col * columnBytes];
+    uint32 bits = 0;
+
+    for (int i = columnBytes - 1; i >= 0; i--) {
+        bits = (bits << 8) | src[i];
+    }
+    return bits;
+}
+
+//
+// Colored glyph cache
+//
+// Most text is a few chars redrawn over and over in the same colors (clock
+// digits, the status bar, highlighted rows), so the most recently used glyphs
+// are kept fully colored, and just copied.
+//
+// Slots are free when lastUsed is 0 (glyphCacheTime starts at 1).
+//
+static struct {
+    uint32 colors;      // lut[1] from ColorLut(), which is bg << 16 | fg
+    uint32 lastUsed;
+    uint8 font;
+    uint8 c;
+    uint32 pixels[(GLYPH_CACHE_MAX_PIXELS + 1) / 2];   // uint32 for alignment
+} glyphCache[GLYPH_CACHE_SLOTS];
+static uint32 glyphCacheTime = 0;
+int glyphCacheHits = 0;
+int glyphCacheMisses = 0;
+
+//
+// Get the colored image of char /c/ of /font/ from the cache - colorizing it
+// into the least recently used slot if it's not there.
+//
+// @return column-major RGB565 image of the char (without spacing), or NULL if
+// the char is too big to cache.
+//
+static const uint16 * GlyphCacheGet(
+    int font,
+    int c,
+    const uint32 lut[4]
+    )
+{
+    const struct FONT_CHAR * p = &fonts[font][c];
+    int i, lru = 0;
+    uint16 * dest;
+
+    if (p->width * p->height > GLYPH_CACHE_MAX_PIXELS) return NULL;
+
+    glyphCacheTime++;
+    for (i = 0; i < GLYPH_CACHE_SLOTS; i++) {
+        if (glyphCache[i].lastUsed && glyphCache[i].colors == lut[1]
+            && glyphCache[i].font == font && glyphCache[i].c == c)
+        {
+            glyphCache[i].lastUsed = glyphCacheTime;
+            glyphCacheHits++;
+            return (uint16 *) glyphCache[i].pixels;
+        }
+        if (glyphCache[i].lastUsed < glyphCache[lru].lastUsed) {
+            lru = i;
+        }
+    }
+
+    glyphCacheMisses++;
+    glyphCache[lru].colors = lut[1];
+    glyphCache[lru].lastUsed = glyphCacheTime;
+    glyphCache[lru].font = font;
+    glyphCache[lru].c = c;
+    dest = (uint16 *) glyphCache[lru].pixels;
+    for (int col = 0; col < p->width; col++) {
+        dest = ExpandBits(dest, CharColumnBits(p, col), p->height, lut);
+    }
+    return (uint16 *) glyphCache[lru].pixels;
+}
+
+//
+// Copy the image of char /c/ of /font/ into the destination, bounded by
+// /bound/.
 //
 // @param dest      destination pixels
-// @param p         character image to copy
+// @param font      font of char
+// @param c         char to copy
 // @param bound     Relative bounds rectangle of character.  That is, specifies
 //                  a rectangle within the character image that is to be
 //                  copied.  The bounds may be larger in width to the right of
 //                  the character - if so, this indicates a blank "spacing"
 //                  area to be filled by the bacground color.
-// @param fgColor   foreground color
-// @param bgColor   background color
+// @param lut       fg/bg colors, from ColorLut()
 //
 // @return the number of pixels written
 //
 static int CharImageCopy(
     uint16 * dest,
-    const struct FONT_CHAR * p,
+    int font,
+    int c,
     RECT bound,
-    int fgColor,
-    int bgColor
+    const uint32 lut[4]
     )
 {
-    int pixels = 0;
+    const struct FONT_CHAR * p = &fonts[font][c];
+    const uint16 * cached = NULL;
+    uint16 * start = dest;
 
     // Spacing width to the right of character
     int charSpacing = bound.x + bound.width - p->width;
@@ -59,51 +409,30 @@ static int CharImageCopy(
     if (bound.height <= 0 || bound.width <= 0 ) return 0;
 
     //
-    // Optimization: if bound indicates full char is to be copied, and char is
-    // WHITE on BLACK (which is the default sorted in the image), then just
-    // memcpy() it.
+    // If the whole char is to be copied, copy it from the glyph cache.
+    // Otherwise, copy only the bounding area of the image, a column at a time.
     //
-    if (bound.width >= p->width && bound.height >= p->height && bound.x == 0 && bound.y == 0
-        && fgColor == WHITE && bgColor == BLACK)
-    {
-        pixels = (p->width * p->height);
-        memcpy(dest, p->image, pixels * 2);
+    if (bound.x == 0 && bound.y == 0 && bound.width >= p->width && bound.height >= p->height) {
+        cached = GlyphCacheGet(font, c, lut);
+    }
+    if (cached) {
+        memcpy(dest, cached, p->width * p->height * sizeof(uint16));
+        dest += p->width * p->height;
     } else {
-        //
-        // General case - copy the only the bounding area of the image.
-        //
-        int destIndex = 0;
-        int srcIndex = bound.x * p->height + bound.y;
-        int xSkip = p->height - bound.height;
         int w = MIN(p->width - bound.x, bound.width);
-        int h = bound.height;
-        for (int i = 0; i < w; i++) {
-            for (int j = 0; j < h; j++) {
-                dest[destIndex++] = p->image[srcIndex++] ? fgColor : bgColor;
-                pixels++;
-            }
-            srcIndex += xSkip;
+        for (int col = bound.x; col < bound.x + w; col++) {
+            dest = ExpandBits(dest, CharColumnBits(p, col) >> bound.y, bound.height, lut);
         }
     }
 
     //
-    // Now, copy the blank spacing area to the right of the character.
+    // Now, fill the blank spacing area to the right of the character.
     //
-    dest += pixels;
     if (charSpacing > 0) {
-        int spacingPixels = bound.height * charSpacing;
-
-        if (bgColor == BLACK) {  // TODO or if high/low byte equal
-            memset(dest, bgColor, spacingPixels * 2);
-        } else {
-            for (int i = 0; i < spacingPixels; i++) {
-                dest[i++] = bgColor;
-            }
-        }
-        pixels += spacingPixels;
+        dest = ExpandBits(dest, 0, bound.height * charSpacing, lut);
     }
 
-    return pixels;
+    return dest - start;
 }
 
 //
@@ -146,6 +475,7 @@ int DoRectsIntersect(
     RECT r2
     )
 {
+    if (r1.width <= 0 || r1.height <= 0 || r2.width <= 0 || r2.height <= 0) return 0;
     if (r1.x >= r2.x + r2.width || r2.x >= r1.x + r1.width ) return 0;
     if (r1.y >= r2.y + r2.height || r2.y >= r1.y + r1.height) return 0;
     return 1;
@@ -161,8 +491,17 @@ void DrawRect(
 {
     if (!DoRectsIntersect(r, SCREEN_BOUNDS)) return;
 
+    if (drawListActive) {
+        struct DRAW_OP * op = DrawListAdd(DRAW_OP_RECT, r);
+        if (op) {
+            op->color = color;
+            return;
+        }
+        if (drawListActive) return;
+    }
+
     RECT cropped = RectIntersection(r, SCREEN_BOUNDS);
-    DisplayRect(cropped.x, cropped.y, cropped.width, cropped.height, color);
+    TargetRect(cropped.x, cropped.y, cropped.width, cropped.height, color);
 }
 
 //
@@ -215,6 +554,20 @@ void DrawTextBounded(
     //
     RECT boundedTextRect = RectIntersection(bound, textRect);
 
+    if (drawListActive) {
+        struct DRAW_OP * op = DrawListAdd(DRAW_OP_TEXT, boundedTextRect);
+        if (op) {
+            op->font = font;
+            op->color = fgColor;
+            op->bgColor = bgColor;
+            op->x1 = x;
+            op->y1 = y;
+            op->text = text;
+            return;
+        }
+        if (drawListActive) return;
+    }
+
     //
     // For each char in string, create a rectangle that is the bounds of the
     // char to be printed.  Convert that rectangle to relative coordinates, as
@@ -222,6 +575,8 @@ void DrawTextBounded(
     //
     uint16 * dest = (uint16 *) displayBuf;
     int charX = x;
+    uint32 lut[4];
+    ColorLut(lut, fgColor, bgColor);
     for (char * t = text; *t != '\0'; t++) {
         assert(*t >= 0 && *t < MAX_CHARS);
         const struct FONT_CHAR * p = &pfont[(int) *t];
@@ -231,7 +586,7 @@ void DrawTextBounded(
         boundedCharRect.x -= charX;
         boundedCharRect.y -= y;
 
-        dest += CharImageCopy(dest, p, boundedCharRect, fgColor, bgColor);
+        dest += CharImageCopy(dest, font, *t, boundedCharRect, lut);
 
         charX += p->width + INTER_CHAR_SPACING;
     }
@@ -242,7 +597,7 @@ void DrawTextBounded(
     // should be identical to the area of the boundedTextRect - assert this.
     //
     assert(dest - (uint16 *) displayBuf == boundedTextRect.width * boundedTextRect.height);
-    DisplayBitmap(
+    TargetBitmap(
         displayBuf,
         boundedTextRect.x,
         boundedTextRect.y,
@@ -292,76 +647,119 @@ void DrawTextBox(
     int bgColor
     )
 {
-    RECT r, r2;
+    RECT r;
     int lineX = box.x;
     int lineY = box.y - shiftUp;
+    int lineHeight = FONT_HEIGHT(font) + INTER_LINE_SPACING;
+    RECT clip = RectIntersection(box, SCREEN_BOUNDS);
 
     //
-    // For each line draw the text, and also clear any non-text areas.
-    // Non-text areas must be cleared separately (as opposed to clearing the
-    // whole text box beforehand) to avoid flicker - display is not double
-    // buffered.
+    // Each line is drawn as a box wide strip (the text, the background on
+    // either side of it, and the space below it), all in one bitmap.  Drawing
+    // over the whole strip at once (as opposed to clearing the whole text box
+    // beforehand) also avoids flicker - display is not double buffered
+    // (unless drawing to the framebuffer, see DrawToFramebuf()).
     //
-    for (int i = 0; i < num; i++) {
-        RECT textRect = box;
-        GetTextDimensions(lines[i], font, &textRect);
+    // Lines are only measured if they're drawn, and need justifying
+    for (int i = 0; i < num && lineY < clip.y + clip.height; i++) {
+        r = (RECT) {box.x, lineY, box.width, lineHeight};
+        lineY += lineHeight;
+        if (!DoRectsIntersect(r, clip)) continue;
 
         switch (justify) {
             case LEFT_JUSTIFIED:
                 lineX = box.x;
-
-                // Erase BG to right of text line
-                r = (RECT) {
-                    lineX + textRect.width, lineY, box.width - textRect.width, textRect.height};
-                r = RectIntersection(r, box);
-                DrawRect(r, bgColor);
                 break;
 
             case RIGHT_JUSTIFIED:
-                lineX = box.x + box.width - textRect.width;
-
-                // Erase BG to left of text line
-                r = (RECT) {box.x, lineY, box.width - textRect.width, textRect.height};
-                r = RectIntersection(r, box);
-                DrawRect(r, bgColor);
+                lineX = box.x + box.width - GetTextWidth(lines[i], font);
                 break;
 
             case CENTER_JUSTIFIED:
-                lineX = box.x + (box.width - textRect.width)/2;
-
-                // Erase BG to left of text line
-                r = (RECT) {box.x, lineY, lineX - box.x, textRect.height};
-                r = RectIntersection(r, box);
-                DrawRect(r, bgColor);
-
-                // Erase BG to right of text line
-                r2 = (RECT) {
-                    lineX + textRect.width,
-                    lineY,
-                    (box.x + box.width) - (lineX + textRect.width),
-                    textRect.height};
-                r2 = RectIntersection(r2, box);
-                DrawRect(r2, bgColor);
+                lineX = box.x + (box.width - GetTextWidth(lines[i], font))/2;
                 break;
 
             default:
                 assert(0);
         }
-        DrawTextBounded(lines[i], lineX, lineY, font, fgColor, bgColor, box);
-        lineY += textRect.height;
 
-        // Erase space between lines
-        r = (RECT) {box.x, lineY, box.width, INTER_LINE_SPACING};
-        r = RectIntersection(r, box);
-        DrawRect(r, bgColor);
-        lineY += INTER_LINE_SPACING;
+        DrawTextStrip(lines[i], lineX, r.y, RectIntersection(r, clip), font, fgColor, bgColor);
     }
 
     // Erase the rest of the text box
     r = (RECT) {box.x, lineY, box.width, box.y + box.height - lineY};
     r = RectIntersection(r, box);
     DrawRect(r, bgColor);
-    lineY += INTER_LINE_SPACING;
+}
+
+//
+// Start scrolling the whole screen up by /dy/ rows (down, if negative), by
+// moving the OLED's start line (see DisplayScrollStart()).  Draw the rows in
+// /exposed/, then call DrawScrollFinish().
+//
+// Can't be done when drawing to the framebuffer or a display list, or for
+// more than DISPLAY_SPARE_ROWS - the caller must redraw instead.
+//
+// @return 0 on success, -EINVAL if the scroll can't be done
+//
+int DrawScrollStart(
+    int dy,
+    RECT * exposed
+    )
+{
+    if (drawToFramebuf || drawListActive) return -EINVAL;
+    return DisplayScrollStart(dy, exposed);
+}
+
+void DrawScrollFinish()
+{
+    DisplayScrollFinish();
+}
+
+//
+// Scroll a full screen text box, drawn by DrawTextBox() at /fromShiftUp/, to
+// /toShiftUp/.
+//
+// The OLED's start line is moved to scroll the content already on screen,
+// and only the newly exposed rows are drawn (into the off screen OLED RAM
+// rows, before they are shown).  Falls back to redrawing the box if it's not
+// full screen, if it scrolls by more than DISPLAY_SPARE_ROWS, or when drawing
+// to the framebuffer or a display list.
+//
+// @param fromShiftUp   shiftUp the box is currently drawn at
+// @param toShiftUp     shiftUp to scroll to
+//
+// See DrawTextBox() for the other params.
+//
+void DrawTextBoxScroll(
+    char * lines[],
+    int num,
+    RECT box,
+    int fromShiftUp,
+    int toShiftUp,
+    int justify,
+    int font,
+    int fgColor,
+    int bgColor
+    )
+{
+    RECT exposed;
+    int fullScreen = box.x == 0 && box.y == 0
+        && box.width == SCREEN_WIDTH && box.height == SCREEN_HEIGHT;
+
+    if (!fullScreen || DrawScrollStart(toShiftUp - fromShiftUp, &exposed) < 0) {
+        DrawTextBox(lines, num, box, toShiftUp, justify, font, fgColor, bgColor);
+        return;
+    }
+
+    //
+    // Draw just the exposed rows: a text box of those rows, shifted so that
+    // the text lines up with the rest of the box.
+    //
+    if (exposed.height > 0) {
+        DrawTextBox(lines, num, exposed, toShiftUp + exposed.y, justify, font, fgColor, bgColor);
+    }
+    DrawScrollFinish();
 }
 
 void DrawPoint(
@@ -372,18 +770,24 @@ void DrawPoint(
 {
     if (x < 0 || x >= SCREEN_WIDTH) return;
     if (y < 0 || y >= SCREEN_HEIGHT) return;
-    DisplayRect(x, y, 1, 1, color);
+    if (drawListActive) {
+        DrawRect((RECT) {x, y, 1, 1}, color);
+        return;
+    }
+    TargetRect(x, y, 1, 1, color);
 }
 
 //
-// Diagonal line, shallow slope (Bresenham's line algorithm via Wikipedia)
+// Diagonal line, shallow slope (Bresenham's line algorithm via Wikipedia).
+// Each run of pixels on the same row is filled as one horizontal span.
 //
 static void DrawLineLow(
     int x1,
     int y1, 
     int x2,
     int y2,
-    int color
+    int color,
+    void (*fill)(RECT, int)
     )
 {
     int dx = x2 - x1;
@@ -395,26 +799,33 @@ static void DrawLineLow(
     }
     int D = 2*dy - dx;
     int y = y1;
+    int runX = x1;
 
     for (int x = x1; x <= x2; x++) {
-        DrawPoint(x, y, color);
         if (D > 0) {
+            fill((RECT) {runX, y, x - runX + 1, 1}, color);
+            runX = x + 1;
             y = y + yi;
             D = D - 2*dx;
         }
         D = D + 2*dy;
     }
+    if (runX <= x2) {
+        fill((RECT) {runX, y, x2 - runX + 1, 1}, color);
+    }
 }
 
 //
-// Diagonal line, steep slope (Bresenham's line algorithm via Wikipedia)
+// Diagonal line, steep slope (Bresenham's line algorithm via Wikipedia).
+// Each run of pixels in the same column is filled as one vertical span.
 //
 static void DrawLineHigh(
     int x1,
     int y1, 
     int x2,
     int y2,
-    int color
+    int color,
+    void (*fill)(RECT, int)
     )
 {
     int dx = x2 - x1;
@@ -426,15 +837,66 @@ static void DrawLineHigh(
     }
     int D = 2*dx - dy;
     int x = x1;
+    int runY = y1;
 
     for (int y = y1; y <= y2; y++) {
-        DrawPoint(x, y, color);
         if (D > 0) {
+            fill((RECT) {x, runY, 1, y - runY + 1}, color);
+            runY = y + 1;
             x = x + xi;
             D = D - 2*dy;
         }
         D = D + 2*dx;
     }
+    if (runY <= y2) {
+        fill((RECT) {x, runY, 1, y2 - runY + 1}, color);
+    }
+}
+
+//
+// Record a primitive in the display list.  Returns NULL if the op was not
+// recorded: if the list is still active, the op is not visible, otherwise the
+// caller must draw it directly.
+//
+static struct DRAW_OP * DrawListAddShape(
+    int type,
+    RECT bbox,
+    int color
+    )
+{
+    struct DRAW_OP * op = DrawListAdd(type, bbox);
+    if (op) {
+        op->color = color;
+    }
+    return op;
+}
+
+//
+// Diagonal line (Bresenham's line algorithm via Wikipedia), filled as spans
+// by /fill/.
+//
+static void DrawLineDiag(
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int color,
+    void (*fill)(RECT, int)
+    )
+{
+    if (ABS(y2 - y1) < ABS(x2 - x1)) {
+        if (x1 > x2) {
+            DrawLineLow(x2, y2, x1, y1, color, fill);
+        } else {
+            DrawLineLow(x1, y1, x2, y2, color, fill);
+        }
+    } else {
+        if (y1 > y2) {
+            DrawLineHigh(x2, y2, x1, y1, color, fill);
+        } else {
+            DrawLineHigh(x1, y1, x2, y2, color, fill);
+        }
+    }
 }
 
 void DrawLine(
@@ -459,20 +921,761 @@ void DrawLine(
 
     } else {
         //
-        // Diagonal line (Bresenham's line algorithm via Wikipedia)
+        // Diagonal line
         //
-        if (ABS(y2 - y1) < ABS(x2 - x1)) {
-            if (x1 > x2) {
-                DrawLineLow(x2, y2, x1, y1, color);
-            } else {
-                DrawLineLow(x1, y1, x2, y2, color);
+        if (drawListActive) {
+            RECT bbox = {MIN(x1, x2), MIN(y1, y2), ABS(x2 - x1) + 1, ABS(y2 - y1) + 1};
+            struct DRAW_OP * op = DrawListAddShape(DRAW_OP_LINE, bbox, color);
+            if (op) {
+                op->x1 = x1;
+                op->y1 = y1;
+                op->x2 = x2;
+                op->y2 = y2;
+                return;
+            }
+            if (drawListActive) return;
+        }
+        DrawLineDiag(x1, y1, x2, y2, color, SpanAdd);
+        SpansFlush();
+    }
+}
+
+//
+// @return integer square root of /n/, rounded down
+//
+static int ISqrt(
+    int n
+    )
+{
+    int root = 0;
+    int bit = 1 << 30;
+
+    if (n <= 0) return 0;
+    while (bit > n) bit >>= 2;
+    while (bit) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+//
+// @return half width of the row /dy/ rows from the center of a circle of
+// radius /r/.  (Uses r*r + r, close to (r + 0.5)^2, for rounder circles.)
+//
+static int CircleHalfWidth(
+    int r,
+    int dy
+    )
+{
+    return ISqrt(r * r + r - dy * dy);
+}
+
+//
+// Filled circle, as one horizontal span per row
+//
+static void RasterCircle(
+    int cx,
+    int cy,
+    int r,
+    int color,
+    void (*fill)(RECT, int)
+    )
+{
+    for (int dy = -r; dy <= r; dy++) {
+        int hw = CircleHalfWidth(r, dy);
+        fill((RECT) {cx - hw, cy + dy, 2 * hw + 1, 1}, color);
+    }
+}
+
+//
+// sin() of 0 to 90 degrees, scaled by 1024
+//
+static const int16 sinTable[91] = {
+       0,   18,   36,   54,   71,   89,  107,  125,  143,  160,
+     178,  195,  213,  230,  248,  265,  282,  299,  316,  333,
+     350,  367,  384,  400,  416,  433,  449,  465,  481,  496,
+     512,  527,  543,  558,  573,  587,  602,  616,  630,  644,
+     658,  672,  685,  698,  711,  724,  737,  749,  761,  773,
+     784,  796,  807,  818,  828,  839,  849,  859,  868,  878,
+     887,  896,  904,  912,  920,  928,  935,  943,  949,  956,
+     962,  968,  974,  979,  984,  989,  994,  998, 1002, 1005,
+    1008, 1011, 1014, 1016, 1018, 1020, 1022, 1023, 1023, 1024,
+    1024,
+};
+
+//
+// @return sin() of /degrees/ (any value), scaled by 1024
+//
+static int Sin1024(
+    int degrees
+    )
+{
+    degrees = ((degrees % 360) + 360) % 360;
+    if (degrees <= 90) return sinTable[degrees];
+    if (degrees <= 180) return sinTable[180 - degrees];
+    if (degrees <= 270) return -sinTable[degrees - 180];
+    return -sinTable[360 - degrees];
+}
+
+//
+// @return screen direction of clock angle /degrees/ (clockwise from 12
+// o'clock), scaled by 1024
+//
+static POINT ClockDirection(
+    int degrees
+    )
+{
+    return (POINT) {Sin1024(degrees), -Sin1024(degrees + 90)};
+}
+
+static int Cross(
+    POINT a,
+    POINT b
+    )
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+//
+// Ring segment (arc) of outer radius /r/ and /thickness/, clockwise from clock
+// angle /start/ to /end/ (degrees clockwise from 12 o'clock).  Each row of the
+// ring is split into spans where it leaves the arc's angles.
+//
+static void RasterArc(
+    int cx,
+    int cy,
+    int r,
+    int thickness,
+    int start,
+    int end,
+    int color,
+    void (*fill)(RECT, int)
+    )
+{
+    int ri = r - thickness;
+    int sweep = end - start;
+    int full = sweep >= 360 || sweep <= -360;
+    POINT s = ClockDirection(start);
+    POINT e = ClockDirection(end);
+
+    sweep = ((sweep % 360) + 360) % 360;
+
+    for (int dy = -r; dy <= r; dy++) {
+        int ho = CircleHalfWidth(r, dy);
+        int hi = (ri >= 0 && ABS(dy) <= ri) ? CircleHalfWidth(ri, dy) : -1;
+        int runX = 0;
+        int inRun = 0;
+
+        for (int dx = -ho; dx <= ho + 1; dx++) {
+            int in = 0;
+            if (dx <= ho && ABS(dx) > hi) {
+                POINT p = {dx, dy};
+                if (full) {
+                    in = 1;
+                } else if (sweep <= 180) {
+                    in = Cross(s, p) >= 0 && Cross(p, e) >= 0;
+                } else {
+                    in = !(Cross(e, p) > 0 && Cross(p, s) > 0);
+                }
+            }
+            if (in && !inRun) {
+                runX = dx;
+            } else if (!in && inRun) {
+                fill((RECT) {cx + runX, cy + dy, dx - runX, 1}, color);
+            }
+            inRun = in;
+        }
+    }
+}
+
+//
+// Filled polygon (even-odd rule), scanned one row at a time, with spans
+// between pairs of edge crossings of each row's center.
+//
+static void RasterPolygon(
+    POINT * points,
+    int num,
+    int color,
+    void (*fill)(RECT, int)
+    )
+{
+    int xs[MAX_POLYGON_POINTS];
+    int ymin, ymax;
+    int i, j;
+
+    assert(num <= MAX_POLYGON_POINTS);
+    if (num < 3) return;
+
+    ymin = ymax = points[0].y;
+    for (i = 1; i < num; i++) {
+        ymin = MIN(ymin, points[i].y);
+        ymax = MAX(ymax, points[i].y);
+    }
+    ymin = MAX(ymin, 0);
+    ymax = MIN(ymax, SCREEN_HEIGHT - 1);
+
+    for (int y = ymin; y <= ymax; y++) {
+        int yc2 = 2 * y + 1;    // Row center, doubled
+        int n = 0;
+
+        for (i = 0; i < num; i++) {
+            POINT a = points[i];
+            POINT b = points[(i + 1) % num];
+            if ((2 * a.y < yc2) != (2 * b.y < yc2)) {
+                xs[n++] = a.x + (yc2 - 2 * a.y) * (b.x - a.x) / (2 * (b.y - a.y));
+            }
+        }
+
+        // Insertion sort - n is small
+        for (i = 1; i < n; i++) {
+            int x = xs[i];
+            for (j = i; j > 0 && xs[j - 1] > x; j--) {
+                xs[j] = xs[j - 1];
+            }
+            xs[j] = x;
+        }
+
+        for (i = 0; i + 1 < n; i += 2) {
+            fill((RECT) {xs[i], y, xs[i + 1] - xs[i] + 1, 1}, color);
+        }
+    }
+}
+
+//
+// Line of /thickness/ (with square ends), as a four sided polygon.
+//
+static void RasterThickLine(
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int thickness,
+    int color,
+    void (*fill)(RECT, int)
+    )
+{
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+    int len = ISqrt(dx * dx + dy * dy);
+    int ox, oy;
+
+    if (len == 0) {
+        fill((RECT) {x1 - thickness / 2, y1 - thickness / 2, thickness, thickness}, color);
+        return;
+    }
+
+    // Offset from the center line to each side
+    ox = (-dy * thickness) / (2 * len);
+    oy = (dx * thickness) / (2 * len);
+
+    POINT points[4] = {
+        {x1 + ox, y1 + oy},
+        {x2 + ox, y2 + oy},
+        {x2 - ox, y2 - oy},
+        {x1 - ox, y1 - oy},
+    };
+    RasterPolygon(points, 4, color, fill);
+}
+
+//
+// Draw a filled circle of radius /r/ centered at /cx/, /cy/
+//
+void DrawCircle(
+    int cx,
+    int cy,
+    int r,
+    int color
+    )
+{
+    if (drawListActive) {
+        RECT bbox = {cx - r, cy - r, 2 * r + 1, 2 * r + 1};
+        struct DRAW_OP * op = DrawListAddShape(DRAW_OP_CIRCLE, bbox, color);
+        if (op) {
+            op->x1 = cx;
+            op->y1 = cy;
+            op->x2 = r;
+            return;
+        }
+        if (drawListActive) return;
+    }
+    RasterCircle(cx, cy, r, color, SpanAdd);
+    SpansFlush();
+}
+
+//
+// Draw an arc (ring segment), like for a watch face dial or progress ring.
+//
+// @param cx, cy    center
+// @param r         outer radius
+// @param thickness thickness of the ring, inwards from /r/.  >= /r/ draws a
+//                  pie slice.
+// @param start     start angle, degrees clockwise from 12 o'clock
+// @param end       end angle (clockwise from /start/).  A 360 degree sweep
+//                  draws the full ring.
+// @param color     color
+//
+void DrawArc(
+    int cx,
+    int cy,
+    int r,
+    int thickness,
+    int start,
+    int end,
+    int color
+    )
+{
+    if (drawListActive) {
+        RECT bbox = {cx - r, cy - r, 2 * r + 1, 2 * r + 1};
+        struct DRAW_OP * op = DrawListAddShape(DRAW_OP_ARC, bbox, color);
+        if (op) {
+            op->x1 = cx;
+            op->y1 = cy;
+            op->x2 = r;
+            op->y2 = thickness;
+            op->a = start;
+            op->b = end;
+            return;
+        }
+        if (drawListActive) return;
+    }
+    RasterArc(cx, cy, r, thickness, start, end, color, SpanAdd);
+    SpansFlush();
+}
+
+//
+// Draw a filled polygon (even-odd rule) of up to MAX_POLYGON_POINTS points.
+// When drawing to a display list, /points/ must stay valid until
+// DrawListEnd().
+//
+void DrawPolygon(
+    POINT * points,
+    int num,
+    int color
+    )
+{
+    if (num < 3) return;
+    assert(num <= MAX_POLYGON_POINTS);
+
+    if (drawListActive) {
+        RECT bbox;
+        int x2, y2;
+        struct DRAW_OP * op;
+
+        bbox.x = x2 = points[0].x;
+        bbox.y = y2 = points[0].y;
+        for (int i = 1; i < num; i++) {
+            bbox.x = MIN(bbox.x, points[i].x);
+            bbox.y = MIN(bbox.y, points[i].y);
+            x2 = MAX(x2, points[i].x);
+            y2 = MAX(y2, points[i].y);
+        }
+        bbox.width = x2 - bbox.x + 1;
+        bbox.height = y2 - bbox.y + 1;
+
+        op = DrawListAddShape(DRAW_OP_POLYGON, bbox, color);
+        if (op) {
+            op->points = points;
+            op->a = num;
+            return;
+        }
+        if (drawListActive) return;
+    }
+    RasterPolygon(points, num, color, SpanAdd);
+    SpansFlush();
+}
+
+//
+// Draw a line of /thickness/ pixels, with square ends - like a watch hand.
+//
+void DrawThickLine(
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int thickness,
+    int color
+    )
+{
+    if (thickness <= 1) {
+        DrawLine(x1, y1, x2, y2, color);
+        return;
+    }
+
+    if (drawListActive) {
+        RECT bbox = {
+            MIN(x1, x2) - thickness, MIN(y1, y2) - thickness,
+            ABS(x2 - x1) + 2 * thickness + 1, ABS(y2 - y1) + 2 * thickness + 1};
+        struct DRAW_OP * op = DrawListAddShape(DRAW_OP_THICK_LINE, bbox, color);
+        if (op) {
+            op->x1 = x1;
+            op->y1 = y1;
+            op->x2 = x2;
+            op->y2 = y2;
+            op->a = thickness;
+            return;
+        }
+        if (drawListActive) return;
+    }
+    RasterThickLine(x1, y1, x2, y2, thickness, color, SpanAdd);
+    SpansFlush();
+}
+
+//
+// Image decoder (see images.h for the format).  Packets are decoded strictly
+// in order, so clipped pixels are decoded and dropped.
+//
+struct IMAGE_DECODER {
+    const uint8 * p;    // Next byte of image data
+    int count;          // Pixels left in the current packet
+    int run;            // True if the current packet is a run
+    uint16 pixel;       // The run's pixel
+};
+
+//
+// Decode the next /n/ pixels to /dest/, or skip them if /dest/ is NULL.
+//
+static void ImageDecode(
+    struct IMAGE_DECODER * d,
+    uint16 * dest,
+    int n
+    )
+{
+    while (n > 0) {
+        int k;
+
+        if (d->count == 0) {
+            uint8 header = *d->p++;
+            d->count = (header & ~IMAGE_PACKET_RUN) + 1;
+            d->run = header & IMAGE_PACKET_RUN;
+            if (d->run) {
+                // Image data is bytes, so may not be aligned
+                memcpy(&d->pixel, d->p, sizeof(uint16));
+                d->p += sizeof(uint16);
+            }
+        }
+
+        k = MIN(n, d->count);
+        if (d->run) {
+            for (int i = 0; dest && i < k; i++) {
+                dest[i] = d->pixel;
             }
         } else {
-            if (y1 > y2) {
-                DrawLineHigh(x2, y2, x1, y1, color);
-            } else {
-                DrawLineHigh(x1, y1, x2, y2, color);
+            if (dest) memcpy(dest, d->p, k * sizeof(uint16));
+            d->p += k * sizeof(uint16);
+        }
+        if (dest) dest += k;
+        d->count -= k;
+        n -= k;
+    }
+}
+
+//
+// Decode the columns of an image (drawn at /y/) that are in /clip/ to /dest/,
+// with /stride/ pixels from the start of one column to the next.  The decoder
+// must be at the start of column /clip.x/.
+//
+static void ImageDecodeColumns(
+    struct IMAGE_DECODER * d,
+    const struct IMAGE * image,
+    int y,
+    RECT clip,
+    uint16 * dest,
+    int stride
+    )
+{
+    int above = clip.y - y;
+    int below = y + image->height - (clip.y + clip.height);
+
+    for (int col = 0; col < clip.width; col++, dest += stride) {
+        ImageDecode(d, NULL, above);
+        ImageDecode(d, dest, clip.height);
+        ImageDecode(d, NULL, below);
+    }
+}
+
+//
+// Draw /image/ (one of the IMAGE_* enums, see images.h) with its top left
+// corner at /x/, /y/.
+//
+// The image is decoded straight into displayBuf, as many columns at a time as
+// fit, and each chunk sent as it's done - there's never an uncompressed copy
+// of the whole image.
+//
+void DrawImage(
+    int image,
+    int x,
+    int y
+    )
+{
+    const struct IMAGE * im = &images[image];
+    struct IMAGE_DECODER d = { im->data };
+    RECT r = {x, y, im->width, im->height};
+    RECT clip;
+    int maxColumns, columns;
+
+    if (!DoRectsIntersect(r, SCREEN_BOUNDS)) return;
+    clip = RectIntersection(r, SCREEN_BOUNDS);
+
+    // Images need all the colors (see FramebufSetDepth())
+    if (drawToFramebuf && FramebufGetDepth() != 16) {
+        FramebufSetDepth(16);
+    }
+
+    if (drawListActive) {
+        struct DRAW_OP * op = DrawListAdd(DRAW_OP_IMAGE, clip);
+        if (op) {
+            op->x1 = x;
+            op->y1 = y;
+            op->image = im;
+            return;
+        }
+        if (drawListActive) return;
+    }
+
+    // Skip the columns left of the screen
+    ImageDecode(&d, NULL, (clip.x - x) * im->height);
+
+    maxColumns = DISPLAY_BUF_SIZE / (clip.height * sizeof(uint16));
+    for (int cx = clip.x; cx < clip.x + clip.width; cx += columns) {
+        columns = MIN(maxColumns, clip.x + clip.width - cx);
+        RECT chunk = {cx, clip.y, columns, clip.height};
+        ImageDecodeColumns(&d, im, y, chunk, (uint16 *) displayBuf, clip.height);
+        TargetBitmap(displayBuf, cx, clip.y, cx + columns - 1, clip.y + clip.height - 1);
+    }
+}
+
+//
+// Tile being rasterized: /tile/ is the area of the screen, and /tileBuf/ its
+// column-major pixels.
+//
+static RECT tile;
+static uint16 * tileBuf;
+
+//
+// Fill the part of /r/ that is in the tile with /color/.
+//
+static void TileRect(
+    RECT r,
+    int color
+    )
+{
+    if (!DoRectsIntersect(r, tile)) return;
+    r = RectIntersection(r, tile);
+
+    for (int x = r.x; x < r.x + r.width; x++) {
+        uint16 * d = &tileBuf[(x - tile.x) * tile.height + (r.y - tile.y)];
+        for (int i = 0; i < r.height; i++) {
+            d[i] = color;
+        }
+    }
+}
+
+//
+// Rasterize the part of text /op/ that is in the tile.  Same as
+// CharImageCopy(), but clipped to the tile.
+//
+static void TileText(
+    struct DRAW_OP * op
+    )
+{
+    const struct FONT_CHAR * pfont = fonts[op->font];
+    RECT clip;
+    int charX = op->x1;
+    uint32 lut[4];
+
+    if (!DoRectsIntersect(op->bbox, tile)) return;
+    clip = RectIntersection(op->bbox, tile);
+    ColorLut(lut, op->color, op->bgColor);
+
+    // Skip chars left of the tile without touching their images
+    char * t = op->text;
+    while (*t != '\0' && charX + CHAR_ADVANCE(op->font, *t) <= clip.x) {
+        charX += CHAR_ADVANCE(op->font, *t);
+        t++;
+    }
+
+    for (; *t != '\0' && charX < clip.x + clip.width; t++) {
+        const struct FONT_CHAR * p = &pfont[(int) *t];
+        int x1 = MAX(charX, clip.x);
+        int x2 = MIN(charX + p->width + INTER_CHAR_SPACING, clip.x + clip.width);
+
+        for (int x = x1; x < x2; x++) {
+            int col = x - charX;
+            uint16 * d = &tileBuf[(x - tile.x) * tile.height + (clip.y - tile.y)];
+
+            // Columns past the char are spacing, all bg
+            uint32 bits = col < p->width ? CharColumnBits(p, col) >> (clip.y - op->y1) : 0;
+            ExpandBits(d, bits, clip.height, lut);
+        }
+        charX += p->width + INTER_CHAR_SPACING;
+    }
+}
+
+//
+// Decode the part of image /op/ that is in the tile.
+//
+static void TileImage(
+    struct DRAW_OP * op
+    )
+{
+    struct IMAGE_DECODER d = { op->image->data };
+    RECT clip;
+
+    if (!DoRectsIntersect(op->bbox, tile)) return;
+    clip = RectIntersection(op->bbox, tile);
+
+    ImageDecode(&d, NULL, (clip.x - op->x1) * op->image->height);
+    ImageDecodeColumns(&d, op->image, op->y1, clip,
+        &tileBuf[(clip.x - tile.x) * tile.height + (clip.y - tile.y)], tile.height);
+}
+
+//
+// Draw /text/ at /x/, /y/, and fill the rest of /strip/ with /bgColor/, all
+// as one bitmap.  Falls back to a rect and text when the strip doesn't fit in
+// displayBuf, or when adding to a display list.
+//
+// @param strip     area to draw, which must be on screen.  The text is
+//                  cropped to it.
+//
+static void DrawTextStrip(
+    char * text,
+    int x,
+    int y,
+    RECT strip,
+    int font,
+    int fgColor,
+    int bgColor
+    )
+{
+    struct DRAW_OP op;
+    uint32 lut[4];
+
+    if (drawListActive || strip.width * strip.height * sizeof(uint16) > DISPLAY_BUF_SIZE) {
+        DrawRect(strip, bgColor);
+        DrawTextBounded(text, x, y, font, fgColor, bgColor, strip);
+        return;
+    }
+
+    tile = strip;
+    tileBuf = (uint16 *) displayBuf;
+    ColorLut(lut, fgColor, bgColor);
+    ExpandBits(tileBuf, 0, strip.width * strip.height, lut);
+
+    op.font = font;
+    op.color = fgColor;
+    op.bgColor = bgColor;
+    op.x1 = x;
+    op.y1 = y;
+    op.text = text;
+    op.bbox = (RECT) {x, y};
+    GetTextDimensions(text, font, &op.bbox);
+    TileText(&op);
+
+    TargetBitmap(
+        displayBuf,
+        strip.x,
+        strip.y,
+        strip.x + strip.width - 1,
+        strip.y + strip.height - 1
+        );
+}
+
+//
+// Rasterize and send the display list, tile by tile, then empty it.
+//
+// @return number of tiles sent
+//
+static int DrawListSend()
+{
+    int tiles = 0;
+
+    if (drawList.num == 0) return 0;
+
+    for (int y = 0; y < SCREEN_HEIGHT; y += TILE_HEIGHT) {
+        RECT band = {0, y, SCREEN_WIDTH, TILE_HEIGHT};
+
+        if (!DoRectsIntersect(band, drawList.bbox)) continue;
+        tile = RectIntersection(band, drawList.bbox);
+        tileBuf = (uint16 *) displayBuf;
+
+        TileRect(tile, drawList.bgColor);
+        for (int i = 0; i < drawList.num; i++) {
+            struct DRAW_OP * op = &drawList.ops[i];
+            if (!DoRectsIntersect(op->bbox, tile)) continue;
+            switch (op->type) {
+                case DRAW_OP_RECT:
+                    TileRect(op->bbox, op->color);
+                    break;
+                case DRAW_OP_TEXT:
+                    TileText(op);
+                    break;
+                case DRAW_OP_LINE:
+                    DrawLineDiag(op->x1, op->y1, op->x2, op->y2, op->color, TileRect);
+                    break;
+                case DRAW_OP_THICK_LINE:
+                    RasterThickLine(
+                        op->x1, op->y1, op->x2, op->y2, op->a, op->color, TileRect);
+                    break;
+                case DRAW_OP_CIRCLE:
+                    RasterCircle(op->x1, op->y1, op->x2, op->color, TileRect);
+                    break;
+                case DRAW_OP_ARC:
+                    RasterArc(
+                        op->x1, op->y1, op->x2, op->y2, op->a, op->b, op->color, TileRect);
+                    break;
+                case DRAW_OP_POLYGON:
+                    RasterPolygon(op->points, op->a, op->color, TileRect);
+                    break;
+                case DRAW_OP_IMAGE:
+                    TileImage(op);
+                    break;
+                default:
+                    assert(0);
             }
         }
+
+        TargetBitmap(
+            displayBuf,
+            tile.x,
+            tile.y,
+            tile.x + tile.width - 1,
+            tile.y + tile.height - 1
+            );
+        tiles++;
     }
+
+    drawList.num = 0;
+    return tiles;
+}
+
+//
+// Start recording draws in the display list (see "Display list" above).
+//
+// @param bgColor   color of pixels in the list's area that nothing is drawn on
+//
+void DrawListBegin(
+    int bgColor
+    )
+{
+    drawList.num = 0;
+    drawList.bgColor = bgColor;
+    drawListActive = 1;
+}
+
+//
+// Rasterize and send everything drawn since DrawListBegin().
+//
+// @return number of tiles sent
+//
+int DrawListEnd()
+{
+    int tiles = DrawListSend();
+    drawListActive = 0;
+    return tiles;
 }
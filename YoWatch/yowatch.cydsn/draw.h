@@ -7,7 +7,28 @@
 #define CENTER_JUSTIFIED    1
 #define RIGHT_JUSTIFIED     2
 
+#define MAX_POLYGON_POINTS  16
+
+//
+// Colored glyph cache size.  Chars larger than GLYPH_CACHE_MAX_PIXELS (5x8)
+// aren't cached.
+//
+#define GLYPH_CACHE_SLOTS       12
+#define GLYPH_CACHE_MAX_PIXELS  (5 * 8)
+
 extern RECT SCREEN_BOUNDS;
+extern int glyphCacheHits;
+extern int glyphCacheMisses;
+
+void DrawToFramebuf(
+    int enable
+    );
+
+void DrawListBegin(
+    int bgColor
+    );
+
+int DrawListEnd();
 
 void DrawText(
     char * text,
@@ -34,6 +55,25 @@ void DrawTextBox(
     int bgColor
     );
 
+int DrawScrollStart(
+    int dy,
+    RECT * exposed
+    );
+
+void DrawScrollFinish();
+
+void DrawTextBoxScroll(
+    char * lines[],
+    int num,
+    RECT box,
+    int fromShiftUp,
+    int toShiftUp,
+    int justify,
+    int font,
+    int fgColor,
+    int bgColor
+    );
+
 void DrawTextBounded(
     char * text,
     int x,
@@ -59,6 +99,12 @@ RECT RectIntersection(
     RECT r2
     );
 
+void DrawPoint(
+    int x,
+    int y,
+    int color
+    );
+
 void DrawLine(
     int x1,
     int y1,
@@ -67,4 +113,42 @@ void DrawLine(
     int color
     );
 
+void DrawThickLine(
+    int x1,
+    int y1,
+    int x2,
+    int y2,
+    int thickness,
+    int color
+    );
+
+void DrawCircle(
+    int cx,
+    int cy,
+    int r,
+    int color
+    );
+
+void DrawArc(
+    int cx,
+    int cy,
+    int r,
+    int thickness,
+    int start,
+    int end,
+    int color
+    );
+
+void DrawPolygon(
+    POINT * points,
+    int num,
+    int color
+    );
+
+void DrawImage(
+    int image,
+    int x,
+    int y
+    );
+
 #endif
@@ -2,3 +2,4 @@
 echo "#define VERSION \"$(/cmd/git describe --tags --dirty)\"" > _version.h
 
 python genfonts.py
+python genimages.py
@@ -15,6 +15,31 @@
 #include "fonts.h"
 #include "util.h"
 
+//
+// Get pixel width of string for a given font
+//
+// @param text      string to get width of
+// @param font      font
+//
+// @return width in pixels (0 for an empty string)
+//
+int GetTextWidth(
+    char * text,
+    int font
+    )
+{
+    const uint8 * widths = fontWidths[font];
+    int width = 0;
+
+    if (!text || *text == '\0') return 0;
+
+    for (char * t = text; *t != '\0'; t++) {
+        assert(*t >= 0 && *t < MAX_CHARS);
+        width += widths[(int) *t] + INTER_CHAR_SPACING;
+    }
+    return width - INTER_CHAR_SPACING;
+}
+
 //
 // Get pixel width/height of string for a given font
 //
@@ -29,26 +54,69 @@ void GetTextDimensions(
     RECT * r
     )
 {
-    const struct FONT_CHAR * pfont = fonts[font];
-    int _width = 0;
-    int _height = 0;
-
-    if (!text || *text == '\0') {
-        _width = 0;
-        _height = pfont[0].height;
-    } else {
-        for (char * t = text; *t != '\0'; t++) {
-            assert(*t >= 0 && *t < MAX_CHARS);
-            const struct FONT_CHAR * p = &pfont[(int) *t];
-            _width += p->width + INTER_CHAR_SPACING;
-            _height = MAX(_height, p->height);
-            // For now, only handle fixed height fonts
-            assert(_height == p->height);
-        }
-        _width--;
-    }
+    r->width = GetTextWidth(text, font);
+    r->height = FONT_HEIGHT(font);
+}
 
-    r->width = _width;
-    r->height = _height;
+//
+// Get the pixel width of each prefix of a string, so that the string can be
+// measured at any length (to truncate it, or to wrap it) without walking it
+// again.
+//
+// @param text      string to measure
+// @param font      font
+// @param widths    output: widths[i] is the width of the first i + 1 chars
+// @param maxChars  size of /widths/.  Longer strings are only measured up to
+//                  /maxChars/ chars.
+//
+// @return number of /widths/ set
+//
+int GetTextPrefixWidths(
+    char * text,
+    int font,
+    uint16 * widths,
+    int maxChars
+    )
+{
+    const uint8 * charWidths = fontWidths[font];
+    int width = -INTER_CHAR_SPACING;
+    int i;
+
+    for (i = 0; i < maxChars && text[i] != '\0'; i++) {
+        assert(text[i] >= 0 && text[i] < MAX_CHARS);
+        width += charWidths[(int) text[i]] + INTER_CHAR_SPACING;
+        widths[i] = width;
+    }
+    return i;
 }
 
+//
+// Binary search prefix widths (from GetTextPrefixWidths()) for the longest
+// prefix that fits in /width/ pixels.
+//
+// @param widths    prefix widths
+// @param num       number of /widths/
+// @param width     pixels available
+//
+// @return number of chars that fit
+//
+int GetTextCharsThatFit(
+    uint16 * widths,
+    int num,
+    int width
+    )
+{
+    int lo = 0;
+    int hi = num;
+
+    // Invariant: the first /lo/ chars fit, and the first /hi/ + 1 don't
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (widths[mid - 1] <= width) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
@@ -5,22 +5,56 @@
 #include "fonts/_fonts.h"
 #include "rect.h"
 
+//
+// Char images are 1bpp, stored column by column.  Each column is
+// FONT_COLUMN_BYTES(height) bytes, little endian, with the top pixel in bit 0.
+//
 struct FONT_CHAR {
-    const uint16 * image;
+    const uint8 * image;
     uint16 width;
     uint16 height;
 };
 
+#define FONT_COLUMN_BYTES(height) (((height) + 7) / 8)
+
 #define MAX_CHARS 128
 #define INTER_CHAR_SPACING 1
 #define INTER_LINE_SPACING 1
 
 extern const struct FONT_CHAR *fonts[MAX_FONTS];
 
+//
+// Char widths, and the (fixed) char height, of each font.  Measuring text
+// only needs these, not the FONT_CHARs.
+//
+extern const uint8 *fontWidths[MAX_FONTS];
+extern const uint8 fontHeights[MAX_FONTS];
+
+#define FONT_HEIGHT(font) (fontHeights[font])
+#define CHAR_ADVANCE(font, c) (fontWidths[font][(int) (c)] + INTER_CHAR_SPACING)
+
 void GetTextDimensions(
     char * s,
     int font,
     RECT * r
     );
 
+int GetTextWidth(
+    char * text,
+    int font
+    );
+
+int GetTextPrefixWidths(
+    char * text,
+    int font,
+    uint16 * widths,
+    int maxChars
+    );
+
+int GetTextCharsThatFit(
+    uint16 * widths,
+    int num,
+    int width
+    );
+
 #endif
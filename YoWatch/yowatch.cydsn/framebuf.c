@@ -0,0 +1,453 @@
+/*
+ * framebuf.c
+ *
+ * Shadow framebuffer in serial RAM
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <errno.h>
+#include <string.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "oled.h"
+#include "draw.h"
+#include "serialram.h"
+#include "framebuf.h"
+#include "colors.h"
+
+#define DISPLAY_BUF_SIZE (4 * 1024)
+extern uint8 displayBuf[DISPLAY_BUF_SIZE];
+
+//
+// Drawing into the framebuffer only writes serial RAM, and records the area
+// as dirty.  FramebufFlush() then copies just the dirty areas to the OLED.
+//
+// Dirty rects are merged when they overlap or touch, and when the list is
+// full, a new rect is merged into the existing one it grows the least.
+//
+static RECT dirtyRects[FRAMEBUF_MAX_DIRTY_RECTS];
+static int numDirtyRects = 0;
+static int framebufExists = 0;
+static uint32 framebufAddress = 0;
+
+//
+// Pixels are stored as RGB565 (2 bytes), or as RGB332 (1 byte).  The OLED has
+// no 8 bit mode (it only takes RGB565, or 18 bit color), so RGB332 is expanded
+// on FramebufFlush(), and still goes to the OLED as 2 bytes.
+//
+// So on the SPI bus shared with audio, a pixel drawn and flushed costs 6 bytes
+// in 16 bit color (written to and read back from serial RAM, then sent to the
+// OLED), or 4 bytes in 8 bit color - against 2 bytes drawn straight to the
+// OLED (see TestFramebufBusBytes()).  The framebuffer is for screens that must
+// change all at once, not for saving bus time.
+//
+static int bytesPerPixel = sizeof(uint16);
+static uint16 rgb332To565[256];
+
+//
+// @return serial RAM address of pixel /x/, /y/
+//
+static uint32 PixelAddress(
+    int x,
+    int y
+    )
+{
+    return framebufAddress + (x * SCREEN_HEIGHT + y) * bytesPerPixel;
+}
+
+//
+// @return /color/ (RGB565, see colors.h) reduced to RGB332
+//
+static uint8 Rgb565To332(
+    uint16 color
+    )
+{
+    // RGB565() is stored byte swapped: byte 0 is R4-0,G5-3, byte 1 G2-0,B4-0
+    uint8 b0 = color & 0xFF;
+    uint8 b1 = color >> 8;
+    return (b0 & 0xE0) | ((b0 & 0x07) << 2) | ((b1 >> 3) & 0x03);
+}
+
+static void Rgb332LutInit()
+{
+    for (int i = 0; i < 256; i++) {
+        // Replicate the high bits into the low bits, so that 0xFF is white
+        int r = (i >> 5) & 0x07;
+        int g = (i >> 2) & 0x07;
+        int b = i & 0x03;
+        r = (r << 5) | (r << 2) | (r >> 1);
+        g = (g << 5) | (g << 2) | (g >> 1);
+        b = b * 0x55;
+        rgb332To565[i] = RGB565(r, g, b);
+    }
+}
+
+//
+// Convert /n/ RGB565 pixels in /buf/ to RGB332, in place.
+//
+static void CompactPixels(
+    uint8 * buf,
+    int n
+    )
+{
+    uint16 * src = (uint16 *) buf;
+    for (int i = 0; i < n; i++) {
+        buf[i] = Rgb565To332(src[i]);
+    }
+}
+
+//
+// Convert /n/ RGB332 pixels in /buf/ to RGB565, in place.  /buf/ must have
+// room for the RGB565 pixels.
+//
+static void ExpandPixels(
+    uint8 * buf,
+    int n
+    )
+{
+    uint16 * dest = (uint16 *) buf;
+    for (int i = n - 1; i >= 0; i--) {
+        dest[i] = rgb332To565[buf[i]];
+    }
+}
+
+//
+// @return smallest rect that contains both /r1/ and /r2/
+//
+static RECT BoundingRect(
+    RECT r1,
+    RECT r2
+    )
+{
+    RECT r3;
+    r3.x = MIN(r1.x, r2.x);
+    r3.y = MIN(r1.y, r2.y);
+    r3.width = MAX(r1.x + r1.width, r2.x + r2.width) - r3.x;
+    r3.height = MAX(r1.y + r1.height, r2.y + r2.height) - r3.y;
+    return r3;
+}
+
+static int RectArea(
+    RECT r
+    )
+{
+    return r.width * r.height;
+}
+
+//
+// Initialize the framebuffer to all black (and all dirty).  The framebuffer
+// is a serial RAM region - if there's no serial RAM to spare for it, there's
+// no framebuffer.  Requires SerialRamInit() was run.
+//
+// @return 0 on success, -ENOMEM if there's no RAM for the framebuffer.
+//
+int FramebufInit()
+{
+    int ret;
+
+    numDirtyRects = 0;
+    bytesPerPixel = sizeof(uint16);
+    ret = SerialRamRegionAlloc(SERIAL_RAM_REGION_FRAMEBUF, FRAMEBUF_BYTES);
+    framebufExists = ret == 0;
+    if (ret) return ret;
+    framebufAddress = SerialRamRegionAddress(SERIAL_RAM_REGION_FRAMEBUF);
+
+    FramebufRect(SCREEN_BOUNDS, 0);
+    return 0;
+}
+
+//
+// @return true if FramebufInit() found RAM for the framebuffer.
+//
+int FramebufExists()
+{
+    return framebufExists;
+}
+
+//
+// Set the framebuffer to 16 bit (RGB565) or 8 bit (RGB332) color, converting
+// what's already in it.
+//
+// 8 bit color halves the serial RAM bytes of drawing, and of reading back on
+// FramebufFlush(), for UI screens that don't need more colors - but what's
+// flushed is still sent to the OLED in RGB565.  Drawing an image switches
+// back to 16 bit color (see DrawImage()).
+//
+// @param bits      8 or 16
+//
+// @return 0 on success, -EINVAL for other /bits/, or -ENODEV if there's no
+// framebuffer.
+//
+int FramebufSetDepth(
+    int bits
+    )
+{
+    int newBytesPerPixel = bits / 8;
+    int maxColumns = sizeof(displayBuf) / (SCREEN_HEIGHT * sizeof(uint16));
+    int x, columns;
+
+    if (bits != 8 && bits != 16) return -EINVAL;
+    if (!framebufExists) return -ENODEV;
+    if (newBytesPerPixel == bytesPerPixel) return 0;
+
+    if (bits == 8) {
+        Rgb332LutInit();
+
+        //
+        // Compact a chunk of full columns at a time.  Going from the left,
+        // the (smaller) RGB332 pixels never overwrite RGB565 pixels that
+        // haven't been read yet.
+        //
+        for (x = 0; x < SCREEN_WIDTH; x += columns) {
+            int pixels;
+            columns = MIN(maxColumns, SCREEN_WIDTH - x);
+            pixels = columns * SCREEN_HEIGHT;
+            assert(SerialRamReadBlocking(displayBuf,
+                framebufAddress + x * SCREEN_HEIGHT * sizeof(uint16),
+                pixels * sizeof(uint16)) == 0);
+            CompactPixels(displayBuf, pixels);
+            assert(SerialRamWriteBlocking(displayBuf,
+                framebufAddress + x * SCREEN_HEIGHT, pixels) == 0);
+        }
+    } else {
+        //
+        // Expand from the right, so that RGB565 pixels never overwrite
+        // RGB332 pixels that haven't been read yet.
+        //
+        for (x = SCREEN_WIDTH; x > 0; x -= columns) {
+            int pixels;
+            columns = MIN(maxColumns, x);
+            pixels = columns * SCREEN_HEIGHT;
+            assert(SerialRamReadBlocking(displayBuf,
+                framebufAddress + (x - columns) * SCREEN_HEIGHT, pixels) == 0);
+            ExpandPixels(displayBuf, pixels);
+            assert(SerialRamWriteBlocking(displayBuf,
+                framebufAddress + (x - columns) * SCREEN_HEIGHT * sizeof(uint16),
+                pixels * sizeof(uint16)) == 0);
+        }
+    }
+
+    bytesPerPixel = newBytesPerPixel;
+    return 0;
+}
+
+//
+// @return bits per pixel of the framebuffer (8 or 16)
+//
+int FramebufGetDepth()
+{
+    return bytesPerPixel * 8;
+}
+
+//
+// @return RGB565 color of pixel /x/, /y/ in the framebuffer (expanded, if in
+// 8 bit color)
+//
+uint16 FramebufGetPixel(
+    int x,
+    int y
+    )
+{
+    uint16 pixel = 0;
+
+    assert(SerialRamReadBlocking((uint8 *) &pixel, PixelAddress(x, y), bytesPerPixel) == 0);
+    if (bytesPerPixel == 1) {
+        pixel = rgb332To565[pixel & 0xFF];
+    }
+    return pixel;
+}
+
+//
+// Record /r/ as needing to be flushed to the OLED.
+//
+void FramebufMarkDirty(
+    RECT r
+    )
+{
+    int i;
+
+    if (!DoRectsIntersect(r, SCREEN_BOUNDS)) return;
+    r = RectIntersection(r, SCREEN_BOUNDS);
+
+    //
+    // Merge with any overlapping/touching rects.  Merging can make the
+    // result touch rects that were already checked, so start over after each.
+    //
+    for (i = 0; i < numDirtyRects; i++) {
+        if (DoRectsIntersect(ExpandedRect(r, 1), dirtyRects[i])) {
+            r = BoundingRect(r, dirtyRects[i]);
+            dirtyRects[i] = dirtyRects[--numDirtyRects];
+            i = -1;
+        }
+    }
+
+    if (numDirtyRects == FRAMEBUF_MAX_DIRTY_RECTS) {
+        int best = 0;
+        int bestGrowth = 0;
+        for (i = 0; i < numDirtyRects; i++) {
+            int growth = RectArea(BoundingRect(r, dirtyRects[i])) - RectArea(dirtyRects[i]);
+            if (i == 0 || growth < bestGrowth) {
+                best = i;
+                bestGrowth = growth;
+            }
+        }
+        r = BoundingRect(r, dirtyRects[best]);
+        dirtyRects[best] = dirtyRects[--numDirtyRects];
+        FramebufMarkDirty(r);
+        return;
+    }
+
+    dirtyRects[numDirtyRects++] = r;
+}
+
+//
+// Copy out the current dirty rects.
+//
+// @return number of dirty rects
+//
+int FramebufGetDirtyRects(
+    RECT rects[FRAMEBUF_MAX_DIRTY_RECTS]
+    )
+{
+    memcpy(rects, dirtyRects, numDirtyRects * sizeof(RECT));
+    return numDirtyRects;
+}
+
+//
+// Write /bytes/ of column-major pixels /buf/, for columns starting at /x/,
+// rows /y/ to /y/ + /height/ - 1.  Full height columns are contiguous in
+// serial RAM, so are written in one go.  Otherwise, each column is written
+// separately.
+//
+static void WriteColumns(
+    uint8 * buf,
+    int x,
+    int y,
+    int height,
+    uint32 bytes
+    )
+{
+    uint32 columnBytes = height * bytesPerPixel;
+
+    if (height == SCREEN_HEIGHT) {
+        assert(SerialRamWriteBlocking(buf, PixelAddress(x, y), bytes) == 0);
+        return;
+    }
+    for (; bytes > 0; bytes -= columnBytes, buf += columnBytes, x++) {
+        assert(SerialRamWriteBlocking(buf, PixelAddress(x, y), columnBytes) == 0);
+    }
+}
+
+//
+// Read counterpart of WriteColumns().
+//
+static void ReadColumns(
+    uint8 * buf,
+    int x,
+    int y,
+    int height,
+    uint32 bytes
+    )
+{
+    uint32 columnBytes = height * bytesPerPixel;
+
+    if (height == SCREEN_HEIGHT) {
+        assert(SerialRamReadBlocking(buf, PixelAddress(x, y), bytes) == 0);
+        return;
+    }
+    for (; bytes > 0; bytes -= columnBytes, buf += columnBytes, x++) {
+        assert(SerialRamReadBlocking(buf, PixelAddress(x, y), columnBytes) == 0);
+    }
+}
+
+//
+// Draw a solid rect of /color/ into the framebuffer.
+//
+void FramebufRect(
+    RECT r,
+    uint16 color
+    )
+{
+    int i;
+    int x, columns, maxColumns;
+
+    if (!DoRectsIntersect(r, SCREEN_BOUNDS)) return;
+    r = RectIntersection(r, SCREEN_BOUNDS);
+
+    //
+    // Fill displayBuf with as many columns of /color/ as fit, and write them
+    // out until the rect is done.
+    //
+    maxColumns = sizeof(displayBuf) / (r.height * bytesPerPixel);
+    columns = MIN(maxColumns, r.width);
+    if (bytesPerPixel == 1) {
+        memset(displayBuf, Rgb565To332(color), columns * r.height);
+    } else {
+        for (i = 0; i < columns * r.height; i++) {
+            ((uint16 *) displayBuf)[i] = color;
+        }
+    }
+    for (x = r.x; x < r.x + r.width; x += columns) {
+        columns = MIN(columns, r.x + r.width - x);
+        WriteColumns(displayBuf, x, r.y, r.height, columns * r.height * bytesPerPixel);
+    }
+
+    FramebufMarkDirty(r);
+}
+
+//
+// Draw a bitmap into the framebuffer.
+//
+// @param buf   column-major RGB565 pixels, the same format as DisplayBitmap().
+//              In 8 bit color, /buf/ is converted in place (so is clobbered).
+// @param r     where to draw /buf/.  Must be on screen.
+//
+void FramebufBitmap(
+    uint8 * buf,
+    RECT r
+    )
+{
+    assert(r.x >= 0 && r.x + r.width <= SCREEN_WIDTH);
+    assert(r.y >= 0 && r.y + r.height <= SCREEN_HEIGHT);
+
+    if (r.width <= 0 || r.height <= 0) return;
+
+    if (bytesPerPixel == 1) {
+        CompactPixels(buf, r.width * r.height);
+    }
+    WriteColumns(buf, r.x, r.y, r.height, r.width * r.height * bytesPerPixel);
+    FramebufMarkDirty(r);
+}
+
+//
+// Copy all dirty rects from the framebuffer to the OLED, and mark them clean.
+//
+// Each dirty rect is streamed through displayBuf, as many full columns at a
+// time as fit (once expanded to RGB565, if in 8 bit color).
+//
+void FramebufFlush()
+{
+    int i;
+
+    for (i = 0; i < numDirtyRects; i++) {
+        RECT r = dirtyRects[i];
+        int maxColumns = sizeof(displayBuf) / (r.height * sizeof(uint16));
+        int x, columns;
+
+        for (x = r.x; x < r.x + r.width; x += columns) {
+            columns = MIN(maxColumns, r.x + r.width - x);
+            ReadColumns(displayBuf, x, r.y, r.height, columns * r.height * bytesPerPixel);
+            if (bytesPerPixel == 1) {
+                ExpandPixels(displayBuf, columns * r.height);
+            }
+            DisplayBitmap(displayBuf, x, r.y, x + columns - 1, r.y + r.height - 1);
+        }
+    }
+    numDirtyRects = 0;
+}
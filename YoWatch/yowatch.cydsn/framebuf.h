@@ -0,0 +1,53 @@
+#ifndef _FRAMEBUF_H_
+#define _FRAMEBUF_H_
+
+#include <project.h>
+#include "display.h"
+#include "rect.h"
+#include "serialram.h"
+
+//
+// Shadow framebuffer of the full screen, in serial RAM.  Stored column-major
+// (like the OLED is written, and like DisplayBitmap() bufs), so that a full
+// height rect is contiguous.
+//
+#define FRAMEBUF_BYTES (SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint16))
+
+#define FRAMEBUF_MAX_DIRTY_RECTS 8
+
+int FramebufInit();
+
+int FramebufExists();
+
+int FramebufSetDepth(
+    int bits
+    );
+
+int FramebufGetDepth();
+
+uint16 FramebufGetPixel(
+    int x,
+    int y
+    );
+
+void FramebufRect(
+    RECT r,
+    uint16 color
+    );
+
+void FramebufBitmap(
+    uint8 * buf,
+    RECT r
+    );
+
+void FramebufMarkDirty(
+    RECT r
+    );
+
+int FramebufGetDirtyRects(
+    RECT rects[FRAMEBUF_MAX_DIRTY_RECTS]
+    );
+
+void FramebufFlush();
+
+#endif
@@ -17,6 +17,7 @@ with contextlib.suppress(FileNotFoundError):
 # For each font file, generate C code
 #
 font_names = []
+font_heights = []
 for font_index, font_file in enumerate(glob("fonts/*.fnt")):
     font_name = os.path.splitext(os.path.basename(font_file))[0]
     font_codename = chr(ord('a') + font_index)
@@ -62,8 +63,14 @@ for font_index, font_file in enumerate(glob("fonts/*.fnt")):
     # For each char, width must be the same for each line
     for c in chars:
         assert(len(set(len(line) for line in c)) == 1)
-    # Height of each char must be the same
-    assert(len(set(len(c) for c in chars)) == 1)
+    #
+    # Height of each char must be the same, as text is measured and laid out
+    # with the one font height output below (see FONT_HEIGHT())
+    #
+    font_height = len(chars[0])
+    for i, c in enumerate(chars):
+        assert len(c) == font_height, \
+            "{:s}: char {:d} is {:d} rows high, not {:d}".format(font_file, i, len(c), font_height)
     # Chars must be composed of only space and 'O'
     for i, c in enumerate(chars):
         unique_pixel_chars = sorted(set("".join(c)))
@@ -93,12 +100,21 @@ for font_index, font_file in enumerate(glob("fonts/*.fnt")):
         #
         # Output the C code for the char image once for each unique char.
         #
+        # Images are 1bpp, column by column (to match the OLED's column-major
+        # writes).  Each column is packed into FONT_COLUMN_BYTES(height) bytes,
+        # little endian, with the top pixel in bit 0.
+        #
         for i in sorted(set(char_refs)):
             height = len(chars[i])
             width = len(chars[i][0])
-            flatten = (chars[i][h][w] for w in range(width) for h in range(height))
-            data = ",".join("0xFFFF" if pixel=='O' else "0x0000" for pixel in flatten)
-            fprint("static const uint16 {:s}{:02X}[] = {{{:s}}};".format(font_codename, i, data))
+            assert(height <= 32)
+            column_bytes = (height + 7) // 8
+            data = []
+            for w in range(width):
+                bits = sum(1 << h for h in range(height) if chars[i][h][w] == 'O')
+                data.extend((bits >> (8 * b)) & 0xFF for b in range(column_bytes))
+            data = ",".join("0x{:02X}".format(byte) for byte in data)
+            fprint("static const uint8 {:s}{:02X}[] = {{{:s}}};".format(font_codename, i, data))
 
         #
         # Output struct FONT_CHAR array (pointers to the char image, length & width)
@@ -109,6 +125,16 @@ for font_index, font_file in enumerate(glob("fonts/*.fnt")):
         fprint(",\n".join(array))
         fprint("};")
 
+        #
+        # Output the char widths on their own, so text can be measured
+        # without touching the FONT_CHARs.
+        #
+        fprint("static const uint8 {:s}_widths[MAX_CHARS] = {{".format(font_name))
+        widths = [str(len(c[0])) for c in chars]
+        fprint(",\n".join(",".join(widths[i:i + 16]) for i in range(0, len(widths), 16)))
+        fprint("};")
+        font_heights.append(font_height)
+
 #
 # Write master font array
 #
@@ -117,6 +143,12 @@ with open(C_FILE, 'a') as f:
     fprint("const struct FONT_CHAR *fonts[MAX_FONTS] = {")
     fprint(",\n".join(font_names))
     fprint("};")
+    fprint("const uint8 *fontWidths[MAX_FONTS] = {")
+    fprint(",\n".join(fnt + "_widths" for fnt in font_names))
+    fprint("};")
+    fprint("const uint8 fontHeights[MAX_FONTS] = {")
+    fprint(",\n".join(str(h) for h in font_heights))
+    fprint("};")
     
 hfile_template = \
 """\
@@ -0,0 +1,154 @@
+import re
+import os
+from glob import glob
+from functools import partial
+import contextlib
+
+C_FILE = "images/_images.c"
+H_FILE = "images/_images.h"
+
+# Longest run or literal in one packet (see images.h)
+MAX_PACKET = 128
+
+with contextlib.suppress(FileNotFoundError):
+    os.remove(C_FILE)
+    os.remove(H_FILE)
+
+def read_ppm(image_file):
+    """
+    Read a PPM (P3 ASCII or P6 binary, as exported by most image editors).
+
+    Returns (width, height, rows), where each row is a list of (r, g, b).
+    """
+    with open(image_file, 'rb') as f:
+        data = f.read()
+
+    #
+    # Header is the magic number, width, height and max value, separated by
+    # whitespace, with comments from '#' to end of line.  For P6, the pixels
+    # start right after the single whitespace char following the max value.
+    #
+    fields = []
+    pos = 0
+    while len(fields) < 4:
+        m = re.compile(rb"\s*(#[^\n]*\n\s*)*(\S+)").match(data, pos)
+        fields.append(m.group(2).decode())
+        pos = m.end()
+    magic, width, height, maxval = fields[0], int(fields[1]), int(fields[2]), int(fields[3])
+    assert(magic in ("P3", "P6"))
+    assert(maxval == 255)
+
+    if magic == "P6":
+        values = list(data[pos + 1:pos + 1 + width * height * 3])
+    else:
+        values = [int(v) for v in re.sub(rb"#[^\n]*", b"", data[pos:]).split()]
+    assert(len(values) == width * height * 3)
+
+    pixels = list(zip(values[0::3], values[1::3], values[2::3]))
+    rows = [pixels[y * width:(y + 1) * width] for y in range(height)]
+    return width, height, rows
+
+def rgb565(r, g, b):
+    """
+    RGB565 as the two bytes sent to the OLED (same as the RGB565() macro in
+    colors.h).
+    """
+    return ((r & 0xF8) | (g >> 5), ((g & 0x1C) << 3) | (b >> 3))
+
+def encode(pixels):
+    """
+    Run length encode a list of pixels (each a 2 byte tuple) into packets.
+    Runs of 2 or more identical pixels are a run packet - anything else is
+    gathered into literal packets.
+    """
+    out = []
+    literals = []
+
+    def flush_literals():
+        while literals:
+            chunk = literals[:MAX_PACKET]
+            del literals[:MAX_PACKET]
+            out.append(len(chunk) - 1)
+            for p in chunk:
+                out.extend(p)
+
+    i = 0
+    while i < len(pixels):
+        n = 1
+        while i + n < len(pixels) and n < MAX_PACKET and pixels[i + n] == pixels[i]:
+            n += 1
+        if n >= 2:
+            flush_literals()
+            out.append(0x80 | (n - 1))
+            out.extend(pixels[i])
+        else:
+            literals.append(pixels[i])
+        i += n
+    flush_literals()
+    return out
+
+with open(C_FILE, 'w') as f:
+    fprint = partial(print, file=f)
+    fprint("/*\n * Generated file (by '{:s}') - DO NOT EDIT\n */\n".format(__file__))
+    fprint('#include "images.h"')
+
+#
+# For each image file, generate C code
+#
+image_names = []
+image_sizes = []
+for image_file in sorted(glob("images/*.ppm")):
+    image_name = os.path.splitext(os.path.basename(image_file))[0]
+    width, height, rows = read_ppm(image_file)
+    image_names.append(image_name)
+    image_sizes.append((width, height))
+    assert(width <= 0xFFFF and height <= 0xFFFF)
+
+    #
+    # Images are stored column by column (to match the OLED's column-major
+    # writes).
+    #
+    pixels = [rgb565(*rows[y][x]) for x in range(width) for y in range(height)]
+    data = encode(pixels)
+
+    print("{:s}: {:d}x{:d}, {:d} bytes ({:d}% of raw)".format(
+        image_name, width, height, len(data), 100 * len(data) // (width * height * 2)))
+
+    with open(C_FILE, 'a') as f:
+        fprint = partial(print, file=f)
+
+        fprint("static const uint8 {:s}_data[] = {{".format(image_name))
+        lines = (data[i:i + 16] for i in range(0, len(data), 16))
+        fprint(",\n".join(",".join("0x{:02X}".format(byte) for byte in line) for line in lines))
+        fprint("};")
+
+#
+# Write master image array
+#
+with open(C_FILE, 'a') as f:
+    fprint = partial(print, file=f)
+    fprint("const struct IMAGE images[MAX_IMAGES] = {")
+    fmt = "{{{:s}_data,sizeof({:s}_data),{:d},{:d}}}"
+    array = (fmt.format(name, name, w, h) for name, (w, h) in zip(image_names, image_sizes))
+    fprint(",\n".join(array))
+    fprint("};")
+
+hfile_template = \
+"""\
+/*
+ * Generated file (by '{:s}') - DO NOT EDIT
+ */
+
+#ifndef __IMAGES_H_
+#define __IMAGES_H_
+
+enum {{
+{:s}
+}};
+
+#endif
+"""
+
+with open(H_FILE, 'w') as f:
+    enum_string = ",\n".join(name.upper() for name in image_names + ["MAX_IMAGES"])
+    f.write(hfile_template.format(__file__, enum_string))
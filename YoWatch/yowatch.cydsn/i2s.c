@@ -11,8 +11,10 @@
  */
 #include <project.h>
 #include <errno.h>
+#include <string.h>
 #include "printf.h"
 #include "assert.h"
+#include "util.h"
 #include "spi.h"
 #include "serialram.h"
 #include "queue.h"
@@ -41,72 +43,175 @@ void I2sGetBuf(
     I2sStopDma();
 }
 
+static struct I2S_STATS stats;
+
 //
-// I2S DMA complete ISR.
+// Samples dropped since the last block enqueued
+//
+static uint32 gapSamples;
+
 //
-// When I2S DMA from Mic to RAM buf completes, enqueue the buffer to SPI Serial
-// RAM, and start a new I2S DMA on the ping pong buf.
+// Stream bufs, filled in turn.  A filled buf is enqueued to serial RAM, and
+// is only free to be filled again when that enqueue completes - which may be
+// behind QUEUE_MAX_PENDING - 1 others, waiting for the SPI bus.  So with one
+// more buf to fill, the next buf is normally free.  If it isn't, the block
+// just filled is dropped, and its buf filled again.
 //
+// Enqueues complete in order, so when the next buf isn't free, none are.
+//
+#define I2S_NUM_STREAM_BUFS (QUEUE_MAX_PENDING + 1)
+static uint8 streamBufs[I2S_NUM_STREAM_BUFS][SERIAL_RAM_BUFSIZE];
+static int streamBufFree[I2S_NUM_STREAM_BUFS];
+static int fillingBuf;
+
 int stopI2sDma = 1;
+
+//
+// Start an I2S Mic DMA transaction of /bytes/ to /dst/, calling /isr/ when
+// done.
+//
+static void StartDma(
+    uint8 * dst,
+    uint32 bytes,
+    void (*isr)(void)
+    )
+{
+    if (stopI2sDma) {
+        stopI2sDma = 0;
+        SpiSetAudioActive(1);
+        I2S_1_ClearRxFIFO();
+        I2S_1_EnableRx();
+    }
+    I2sRxDma_SetInterruptCallback(isr);
+    I2sRxDma_SetSrcAddress(0, (void *) I2S_1_RX_CH0_F0_PTR);
+    I2sRxDma_SetDstAddress(0, dst);
+    I2sRxDma_SetNumDataElements(0, bytes);
+    I2sRxDma_ValidateDescriptor(0);
+    I2sRxDma_ChEnable();
+}
+
+static void I2sRxDmaIsr(void);
+
+//
+// Start filling stream buf /i/, after its header (filled in by
+// I2sRxDmaIsr()).
+//
+static void StartStreamDma(
+    int i
+    )
+{
+    streamBufFree[i] = 0;
+    fillingBuf = i;
+    StartDma(&streamBufs[i][I2S_BLOCK_HEADER_BYTES],
+        SERIAL_RAM_BUFSIZE - I2S_BLOCK_HEADER_BYTES, I2sRxDmaIsr);
+}
+
+//
+// Fill in the I2S_BLOCK_HEADER_BYTES header at the start of a stream block.
+//
+static void SetBlockHeader(
+    uint8 * buf,
+    uint32 gap
+    )
+{
+    gap = MIN(gap, I2S_MAX_GAP_SAMPLES);
+    buf[0] = gap;
+    buf[1] = gap >> 8;
+    buf[2] = gap >> 16;
+    buf[3] = I2S_BLOCK_MAGIC;
+}
+
+//
+// I2S DMA complete ISR.
+//
+// When I2S DMA from Mic to RAM buf completes, start a new I2S DMA on the next
+// stream buf, and enqueue the filled buf to SPI Serial RAM.
+//
 static void I2sRxDmaIsr(void)
 {
     if (stopI2sDma) {
         I2S_1_DisableRx();
     } else {
-        uint8 * buf = I2sStartDma(NULL, NULL);
+        int filled = fillingBuf;
+        int next = (filled + 1) % I2S_NUM_STREAM_BUFS;
+        uint8 * buf = streamBufs[filled];
+        uint32 queued;
+        int ret;
 
         //
-        // Enqueue audio buf to Serial RAM (don't care when it finishes).  
+        // Enqueue audio buf to Serial RAM (don't care when it finishes, as
+        // long as it's before the buf is filled again).
         //
         // Time to enqueue must be less than time to collect I2S data (I2S
         // bitrate is 16kHz * 16 bits/sample = 256 kbps which is much less than
-        // the maximum SPI data rate of 8Mbps).
+        // the maximum SPI data rate of 8Mbps).  But the enqueue of the last
+        // bufs may still be waiting for the bus.
         // 
-        int ret = EnqueueBytes(buf, SERIAL_RAM_BUFSIZE, NULL);
-        if (ret == -ENOSPC) {
-            // Flag error?
+        if (!streamBufFree[next]) {
+            StartStreamDma(filled);
+            ret = -ENOBUFS;
+        } else {
+            StartStreamDma(next);
+            SetBlockHeader(buf, gapSamples);
+            ret = EnqueueBytes(buf, SERIAL_RAM_BUFSIZE, &streamBufFree[filled]);
         }
 
+        if (ret == 0 || ret == -EAGAIN) {
+            stats.blocks++;
+            gapSamples = 0;
+        } else {
+            //
+            // Drop the block, and mark the gap in the header of the next one
+            // that is enqueued.
+            //
+            streamBufFree[filled] = 1;
+            stats.droppedBlocks++;
+            if (ret == -ENOBUFS) {
+                stats.bufsBusy++;
+            } else if (ret == -ENOSPC) {
+                stats.queueFull++;
+            } else if (ret == -EBUSY) {
+                stats.pendingFull++;
+            } else if (ret == -ENOMEM) {
+                stats.spiQueueFull++;
+            }
+            gapSamples += I2S_BLOCK_SAMPLES;
+        }
+
+        queued = BufQueueSize() - BufQueueFree();
+        stats.queueHighWater = MAX(stats.queueHighWater, queued);
     }
 }
 
 //
-// Start an I2S Mic DMA transaction to a ping-pong buf
+// Start an I2S Mic DMA transaction.
+//
+// If /buf/ is given, a single SERIAL_RAM_BUFSIZE buf of samples is filled,
+// and /isr/ is called when done.
 //
-// As the completion ISR starts another DMA transaction when this one
-// completes, the sequenece of DMAs will run forever until stopped
-// (via I2sStopDma())
+// Otherwise, the audio stream is started: stream bufs are filled in turn,
+// and enqueued to serial RAM, forever until stopped (via I2sStopDma()).
 //
-uint8 * I2sStartDma(
+void I2sStartDma(
     uint8 * buf,
     void (*isr)(void)
     )
 {
-    uint8 * pbuf1 = SerialRamGetBuf(0);
-    uint8 * pbuf2 = SerialRamGetBuf(1);
-    static uint8 * pCurrentBuf = NULL;
-    uint8 * pPrevBuf;
+    int i;
 
     if (buf) {
-        pPrevBuf = buf;
-    } else {
-        pPrevBuf = pCurrentBuf;
-        pCurrentBuf = pCurrentBuf == pbuf1 ? pbuf2 : pbuf1;
-        buf = pCurrentBuf;
+        StartDma(buf, SERIAL_RAM_BUFSIZE, isr);
+        return;
     }
-    isr = isr ? isr : &I2sRxDmaIsr;
+
     if (stopI2sDma) {
-        stopI2sDma = 0;
-        I2S_1_ClearRxFIFO();
-        I2S_1_EnableRx();
+        memset(&stats, 0, sizeof(stats));
+        gapSamples = 0;
+        for (i = 0; i < I2S_NUM_STREAM_BUFS; i++) {
+            streamBufFree[i] = 1;
+        }
     }
-    I2sRxDma_SetInterruptCallback(isr);
-    I2sRxDma_SetSrcAddress(0, (void *) I2S_1_RX_CH0_F0_PTR);
-    I2sRxDma_SetDstAddress(0, buf);
-    I2sRxDma_SetNumDataElements(0, SERIAL_RAM_BUFSIZE);
-    I2sRxDma_ValidateDescriptor(0);
-    I2sRxDma_ChEnable();
-    return pPrevBuf;
+    StartStreamDma(0);
 }
 
 //
@@ -115,4 +220,18 @@ uint8 * I2sStartDma(
 void I2sStopDma()
 {
     stopI2sDma = 1;
+    SpiSetAudioActive(0);
+}
+
+//
+// Get the audio stream stats, of the current stream, or the last one if
+// stopped.  See struct I2S_STATS.
+//
+void I2sGetStats(
+    struct I2S_STATS * pStats
+    )
+{
+    uint8 interruptState = CyEnterCriticalSection();
+    *pStats = stats;
+    CyExitCriticalSection(interruptState);
 }
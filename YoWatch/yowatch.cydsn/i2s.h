@@ -2,17 +2,54 @@
 #define _I2S_H_
 
 #include <project.h>
+#include "serialram.h"
+
+//
+// Mic audio stream, as enqueued to the serial RAM queue: blocks of
+// SERIAL_RAM_BUFSIZE bytes, each a header then I2S_BLOCK_SAMPLES 16-bit
+// samples.  The header is 4 bytes, little endian:
+//
+//      bytes 0-2   samples dropped just before this block (saturates at
+//                  I2S_MAX_GAP_SAMPLES)
+//      byte 3      I2S_BLOCK_MAGIC
+//
+// So a reader can pad the gaps left by dropped blocks with silence, and keep
+// time.
+//
+#define I2S_BLOCK_HEADER_BYTES  4
+#define I2S_BLOCK_MAGIC         0xA5
+#define I2S_BYTES_PER_SAMPLE    2
+#define I2S_BLOCK_SAMPLES       ((SERIAL_RAM_BUFSIZE - I2S_BLOCK_HEADER_BYTES) / I2S_BYTES_PER_SAMPLE)
+#define I2S_MAX_GAP_SAMPLES     0xFFFFFF
+
+//
+// Audio stream stats, reset when the stream starts.  A block is dropped when
+// it can't be enqueued - the drop reasons are counted separately.
+//
+struct I2S_STATS {
+    uint32 blocks;              // enqueued
+    uint32 droppedBlocks;
+    uint32 bufsBusy;            // all stream bufs waiting to be enqueued
+    uint32 queueFull;           // serial RAM queue full (-ENOSPC)
+    uint32 pendingFull;         // QUEUE_MAX_PENDING enqueues in flight (-EBUSY)
+    uint32 spiQueueFull;        // SPI audio class queue full (-ENOMEM)
+    uint32 queueHighWater;      // most bytes in the queue, including pending
+};
 
 void I2sGetBuf(
     uint8 * buf
     );
 
-uint8 * I2sStartDma(
+void I2sStartDma(
     uint8 * buf,
     void (*isr)(void)
     );
 
 void I2sStopDma();
 
+void I2sGetStats(
+    struct I2S_STATS * stats
+    );
+
 #endif
 
@@ -0,0 +1,31 @@
+#ifndef _IMAGES_H_
+#define _IMAGES_H_
+
+#include <project.h>
+#include "images/_images.h"
+
+//
+// Images are generated from images/*.ppm by genimages.py.
+//
+// Pixels are stored column by column (like the OLED is written), as RGB565 in
+// the OLED's byte order, run length encoded.  The data is a series of
+// packets, each starting with a header byte:
+//
+//      0x80 | (n - 1)  a run: the next pixel (2 bytes), repeated n times
+//      n - 1           literals: the next n pixels (2n bytes), as is
+//
+// for n up to IMAGE_MAX_PACKET.  Packets can span columns.
+//
+struct IMAGE {
+    const uint8 * data;
+    uint16 size;
+    uint16 width;
+    uint16 height;
+};
+
+#define IMAGE_MAX_PACKET    128
+#define IMAGE_PACKET_RUN    0x80
+
+extern const struct IMAGE images[MAX_IMAGES];
+
+#endif
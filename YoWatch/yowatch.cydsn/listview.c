@@ -0,0 +1,315 @@
+/*
+ * listview.c
+ *
+ * Virtualized, scrolling list of rows of text
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <string.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "display.h"
+#include "fonts.h"
+#include "draw.h"
+#include "listview.h"
+
+//
+// A list view shows rows (like message headers, or the lines of a message)
+// from a LIST_VIEW_SOURCE, full screen.  Only the rows on screen are kept in
+// SRAM - each is fetched from the source when it is about to be drawn, and
+// cached in slot (index % LIST_VIEW_MAX_ROWS) until scrolled away.
+//
+// A scroll step moves the OLED start line by one row height (see
+// DrawScrollStart()), and draws only the row scrolled in, and the rows whose
+// selection highlight changed.  So each step costs the same, however many
+// rows the source has.
+//
+#define LIST_VIEW_ROW_SPACING   1
+
+int listViewRowFetches = 0;
+
+static int LineHeight(
+    int font
+    )
+{
+    return FONT_HEIGHT(font) + INTER_LINE_SPACING;
+}
+
+//
+// @return number of rows that fit on screen completely
+//
+static int FullRows(
+    struct LIST_VIEW * view
+    )
+{
+    return SCREEN_HEIGHT / view->rowHeight;
+}
+
+static void InvalidateRows(
+    struct LIST_VIEW * view
+    )
+{
+    for (int i = 0; i < LIST_VIEW_MAX_ROWS; i++) {
+        view->rows[i].index = -1;
+    }
+}
+
+//
+// @return row /index/, fetched from the source if it's not cached
+//
+static struct LIST_VIEW_ROW * GetRow(
+    struct LIST_VIEW * view,
+    int index
+    )
+{
+    struct LIST_VIEW_ROW * row = &view->rows[index % LIST_VIEW_MAX_ROWS];
+    uint16 widths[LIST_VIEW_MAX_CHARS];
+
+    if (row->index == index) return row;
+
+    memset(row->text, 0, sizeof(row->text));
+    view->source->getRow(index, row->text);
+    row->index = index;
+    listViewRowFetches++;
+
+    //
+    // Truncate lines to the screen width, once, rather than clipping them
+    // on each draw.
+    //
+    for (int i = 0; i < view->numLines; i++) {
+        int font = i == 0 ? view->font : view->subFont;
+        char * text = row->text[i];
+        int n;
+
+        text[LIST_VIEW_MAX_CHARS] = '\0';
+        n = GetTextPrefixWidths(text, font, widths, LIST_VIEW_MAX_CHARS);
+        text[GetTextCharsThatFit(widths, n, LIST_VIEW_TEXT_WIDTH)] = '\0';
+    }
+    return row;
+}
+
+//
+// Draw the part of row /index/ that is in /clip/.
+//
+// @return 1 if any of the row was drawn, otherwise 0
+//
+static int DrawRow(
+    struct LIST_VIEW * view,
+    int index,
+    RECT clip
+    )
+{
+    RECT rowRect = {0, (index - view->top) * view->rowHeight, SCREEN_WIDTH, view->rowHeight};
+    int bgColor = index == view->selected ? LIST_VIEW_SELECTED_BG : LIST_VIEW_BG;
+    struct LIST_VIEW_ROW * row;
+    RECT r;
+    int y;
+
+    if (!DoRectsIntersect(rowRect, clip)) return 0;
+    r = RectIntersection(rowRect, clip);
+
+    if (index < 0 || index >= view->count) {
+        DrawRect(r, LIST_VIEW_BG);
+        return 1;
+    }
+
+    row = GetRow(view, index);
+
+    // Left margin
+    DrawRect(RectIntersection((RECT) {0, rowRect.y, LIST_VIEW_MARGIN, rowRect.height}, r), bgColor);
+
+    //
+    // Each line is a one line text box, shifted up by however much of it is
+    // clipped, so that the text lines up with the rest of the row.
+    //
+    y = rowRect.y;
+    for (int i = 0; i < view->numLines; i++) {
+        int font = i == 0 ? view->font : view->subFont;
+        RECT lineBox = {LIST_VIEW_MARGIN, y, SCREEN_WIDTH - LIST_VIEW_MARGIN, LineHeight(font)};
+        char * lines[] = { row->text[i] };
+
+        if (DoRectsIntersect(lineBox, r)) {
+            RECT box = RectIntersection(lineBox, r);
+            DrawTextBox(lines, 1, box, box.y - lineBox.y, LEFT_JUSTIFIED,
+                font, LIST_VIEW_FG, bgColor);
+        }
+        y += lineBox.height;
+    }
+
+    // Row spacing
+    DrawRect(RectIntersection(
+        (RECT) {LIST_VIEW_MARGIN, y, SCREEN_WIDTH - LIST_VIEW_MARGIN, rowRect.y + rowRect.height - y},
+        r), bgColor);
+
+    return 1;
+}
+
+//
+// Draw all rows that are (even partly) in /clip/, clipped to it.
+//
+// @return number of rows drawn
+//
+static int DrawRows(
+    struct LIST_VIEW * view,
+    RECT clip
+    )
+{
+    int first = view->top + clip.y / view->rowHeight;
+    int last = view->top + (clip.y + clip.height - 1) / view->rowHeight;
+    int drawn = 0;
+
+    for (int i = first; i <= last; i++) {
+        drawn += DrawRow(view, i, clip);
+    }
+    return drawn;
+}
+
+//
+// Set up a list view, and draw it, from the first row.
+//
+// @param view          list view to init
+// @param source        where to get rows from
+// @param numLines      lines of text per row, up to LIST_VIEW_MAX_LINES
+// @param font          font of the first line of each row
+// @param subFont       font of the other lines
+// @param selectable    if true, one row is selected (highlighted), and
+//                      scrolling moves the selection.  Otherwise, scrolling
+//                      moves the rows.
+//
+void ListViewInit(
+    struct LIST_VIEW * view,
+    const struct LIST_VIEW_SOURCE * source,
+    int numLines,
+    int font,
+    int subFont,
+    int selectable
+    )
+{
+    assert(numLines >= 1 && numLines <= LIST_VIEW_MAX_LINES);
+
+    view->source = source;
+    view->numLines = numLines;
+    view->font = font;
+    view->subFont = subFont;
+    view->rowHeight = LineHeight(font) + (numLines - 1) * LineHeight(subFont)
+        + LIST_VIEW_ROW_SPACING;
+    view->selectable = selectable;
+    view->top = 0;
+    view->selected = -1;
+
+    // All rows on screen, and one scrolling in, must fit in the cache
+    assert(SCREEN_HEIGHT / view->rowHeight + 2 <= LIST_VIEW_MAX_ROWS);
+
+    ListViewRefresh(view);
+}
+
+//
+// Redraw the whole list view.
+//
+// @return number of rows drawn
+//
+int ListViewDraw(
+    struct LIST_VIEW * view
+    )
+{
+    return DrawRows(view, SCREEN_BOUNDS);
+}
+
+//
+// Re-read the row count and rows from the source (after rows were added or
+// removed), and redraw.
+//
+// @return number of rows drawn
+//
+int ListViewRefresh(
+    struct LIST_VIEW * view
+    )
+{
+    view->count = view->source->getCount();
+    InvalidateRows(view);
+
+    if (view->selectable) {
+        view->selected = MIN(MAX(view->selected, 0), view->count - 1);
+        view->top = MIN(view->top, MAX(view->selected, 0));
+    } else {
+        view->top = MIN(view->top, MAX(view->count - FullRows(view), 0));
+    }
+    return ListViewDraw(view);
+}
+
+//
+// Scroll by /delta/ rows: down if positive, up if negative.  For selectable
+// lists, the selection moves, and the rows only scroll to keep it on screen.
+//
+// @return number of rows drawn
+//
+int ListViewScroll(
+    struct LIST_VIEW * view,
+    int delta
+    )
+{
+    int oldSelected = view->selected;
+    int top = view->top;
+    int scrolled = 0;
+    int drawn = 0;
+    RECT exposed;
+
+    if (view->selectable) {
+        if (view->count == 0) return 0;
+        view->selected = MIN(MAX(view->selected + delta, 0), view->count - 1);
+        if (view->selected == oldSelected) return 0;
+        if (view->selected < top) {
+            top = view->selected;
+        } else if (view->selected >= top + FullRows(view)) {
+            top = view->selected - FullRows(view) + 1;
+        }
+    } else {
+        top = MIN(MAX(top + delta, 0), MAX(view->count - FullRows(view), 0));
+        if (top == view->top) return 0;
+    }
+
+    if (top != view->top) {
+        if (DrawScrollStart((top - view->top) * view->rowHeight, &exposed) == 0) {
+            view->top = top;
+            drawn += DrawRows(view, exposed);
+            scrolled = 1;
+        } else {
+            // Too far to scroll in hardware
+            view->top = top;
+            return ListViewDraw(view);
+        }
+    }
+
+    //
+    // Rows already on screen are only redrawn once the scroll is finished, as
+    // until then, the OLED still shows them at their old positions.  The newly
+    // selected row is only already drawn if it scrolled in.
+    //
+    if (scrolled) {
+        DrawScrollFinish();
+    }
+
+    if (view->selectable) {
+        drawn += DrawRow(view, oldSelected, SCREEN_BOUNDS);
+        if (!scrolled) {
+            drawn += DrawRow(view, view->selected, SCREEN_BOUNDS);
+        }
+    }
+    return drawn;
+}
+
+//
+// @return index of the selected row, or -1 if none
+//
+int ListViewGetSelected(
+    struct LIST_VIEW * view
+    )
+{
+    return view->selected;
+}
@@ -0,0 +1,90 @@
+#ifndef _LISTVIEW_H_
+#define _LISTVIEW_H_
+
+#include <project.h>
+#include "colors.h"
+#include "display.h"
+
+//
+// Each row is up to LIST_VIEW_MAX_LINES lines of text, of up to
+// LIST_VIEW_MAX_CHARS chars (less, if they don't fit the screen width).
+//
+#define LIST_VIEW_MAX_LINES     2
+#define LIST_VIEW_MAX_CHARS     32
+
+//
+// Text is indented by LIST_VIEW_MARGIN, leaving LIST_VIEW_TEXT_WIDTH pixels
+// for each line.
+//
+#define LIST_VIEW_MARGIN        2
+#define LIST_VIEW_TEXT_WIDTH    (SCREEN_WIDTH - LIST_VIEW_MARGIN)
+
+//
+// Rows kept in SRAM: enough for a screen of the shortest rows, plus the row
+// being scrolled in.
+//
+#define LIST_VIEW_MAX_ROWS      12
+
+#define LIST_VIEW_FG            WHITE
+#define LIST_VIEW_BG            BLACK
+#define LIST_VIEW_SELECTED_BG   NAVY
+
+//
+// Where the rows come from.  getRow() is only called for rows about to be
+// drawn, so it can read them from storage.
+//
+struct LIST_VIEW_SOURCE {
+    int (*getCount)();
+    void (*getRow)(
+        int index,
+        char text[LIST_VIEW_MAX_LINES][LIST_VIEW_MAX_CHARS + 1]
+        );
+};
+
+struct LIST_VIEW_ROW {
+    int index;
+    char text[LIST_VIEW_MAX_LINES][LIST_VIEW_MAX_CHARS + 1];
+};
+
+struct LIST_VIEW {
+    const struct LIST_VIEW_SOURCE * source;
+    int numLines;
+    int font;
+    int subFont;
+    int rowHeight;
+    int selectable;
+    int count;
+    int top;
+    int selected;
+    struct LIST_VIEW_ROW rows[LIST_VIEW_MAX_ROWS];
+};
+
+extern int listViewRowFetches;
+
+void ListViewInit(
+    struct LIST_VIEW * view,
+    const struct LIST_VIEW_SOURCE * source,
+    int numLines,
+    int font,
+    int subFont,
+    int selectable
+    );
+
+int ListViewDraw(
+    struct LIST_VIEW * view
+    );
+
+int ListViewRefresh(
+    struct LIST_VIEW * view
+    );
+
+int ListViewScroll(
+    struct LIST_VIEW * view,
+    int delta
+    );
+
+int ListViewGetSelected(
+    struct LIST_VIEW * view
+    );
+
+#endif
@@ -52,6 +52,9 @@
  *
  *           (ping pong bufs)
  *
+ * Audio is compressed 4:1 with IMA-ADPCM (see adpcm.c), a stream block at a
+ * time, and YoPhone decompresses it before speech-to-text.
+ *
  * Copyright (C) 2017 Brian Silverman <bri@readysetstem.com>
  *
  * This program is free software; you can redistribute it and/or modify
@@ -67,19 +70,120 @@
 #include "printf.h"
 #include "post.h"
 #include "assert.h"
+#include "util.h"
 #include "spi.h"
 #include "queue.h"
 #include "i2s.h"
 #include "oled.h"
+#include "draw.h"
+#include "framebuf.h"
+#include "colors.h"
+#include "fonts.h"
+#include "watchface.h"
+#include "listview.h"
+#include "textlayout.h"
+#include "msgstore.h"
+#include "adpcm.h"
 
 //
-// Speedtest buffer
-// TODO: merge with other buffers?
+// Speedtest and mic test packet buffer.  Packets are built in /buffer/, and
+// mic audio is dequeued straight into it, after the header (see
+// DequeuePacket()).  /words/ keeps it word aligned, and is used for the word
+// stores of the header.  It can't share a serial RAM buf (see
+// SerialRamGetBuf()), as a packet is bigger than SERIAL_RAM_BUFSIZE.
 //
-uint8 buffer[MAX_MTU_SIZE+4];
+static union {
+    uint8 buffer[MAX_MTU_SIZE + 4];
+    uint32 words[(MAX_MTU_SIZE + 4) / sizeof(uint32)];
+} packet;
 int speedTestPackets;
 int deviceConnected = 0;
 
+//
+// Debug commands from YoPhone (the first byte written to the debug command
+// characteristic), and mic test packets to YoPhone (the first byte of debug
+// command notifications).
+//
+#define DEBUG_CMD_MIC_TEST      3
+#define DEBUG_CMD_END_TEST      4
+#define DEBUG_CMD_SET_TIME      7
+#define DEBUG_CMD_ADD_MSG       8
+#define DEBUG_CMD_RESULT        9
+#define MIC_RAW_PACKET          5
+#define MIC_ADPCM_PACKET        6
+#define MIC_PACKET_BYTES        500
+
+//
+// Mic test: packet type (MIC_RAW_PACKET or MIC_ADPCM_PACKET), ADPCM encoder
+// state, bytes of payload in the packet so far, and the dequeue in flight
+// (see SmMicTest()).
+//
+static int micPacketType;
+static struct ADPCM_STATE micAdpcm;
+static uint32 micPayloadBytes;
+static int micDequeuing;
+static int micDone;
+
+//
+// Time of day, kept by counting SysTick (1 ms) interrupts, plus
+// timeOfDayOffset seconds.  YoPhone sets the time and date when it connects
+// (see SetTimeOfDay()) - until then, the watch counts from midnight, and the
+// date is unknown.  The date is dateOffset plus the days counted.
+//
+// Whole seconds are counted on their own, as uptimeMsecs wraps after 49.7
+// days, which isn't a whole number of days.
+//
+#define SECONDS_PER_DAY (24 * 60 * 60)
+static volatile uint32 uptimeMsecs = 0;
+static volatile uint32 uptimeSeconds = 0;
+static uint32 tickMsecs = 0;
+static uint32 timeOfDayOffset = 0;
+static int32 dateOffset = 0;
+static int dateValid = 0;
+
+//
+// Message from YoPhone (DEBUG_CMD_ADD_MSG) waiting to be added to the message
+// store, from the main loop (see MsgAddPending()): id (2 bytes, little
+// endian), sender, NUL, and body.
+//
+static char pendingMsg[MAX_MTU_SIZE + 1];
+static int pendingMsgLen = 0;
+
+//
+// Result text from YoPhone (DEBUG_CMD_RESULT), shown by RESULT.  It arrives in
+// pieces, each replacing the text from a byte offset on.  resultChangedFrom is
+// the first byte changed since RESULT last drew it, or -1 if none.
+//
+#define RESULT_MAX_BYTES 1024
+static char resultText[RESULT_MAX_BYTES + 1];
+static int resultLen = 0;
+static int resultChangedFrom = -1;
+static struct TEXT_LAYOUT resultLayout;
+
+//
+// Buttons pressed and not yet taken by a state transition (see TrButton()),
+// and the buttons that caused the last transition taken.  Set by
+// PollButtons().
+//
+static volatile int buttonsPressed = 0;
+static int lastButtons = 0;
+
+//
+// BLE events (debug commands from YoPhone) not yet taken by a state
+// transition (see TrBle()).
+//
+static volatile int bleEvents = 0;
+
+//
+// Message list (MSGS), and the message being viewed (MSG_VIEW).  The list
+// views only keep the rows on screen - rows are read from the sources below
+// as they are scrolled in.
+//
+static struct LIST_VIEW msgsView;
+static struct LIST_VIEW msgView;
+static int msgsViewValid = 0;
+static int viewedMsg = -1;
+
 //
 // Main state machine STATEs
 //
@@ -131,6 +235,129 @@ enum {
 #define VOICE_ACTIVITY      (1 << 0)
 #define VOICE_TIMEOUT       (1 << 1)
 
+//
+// A button input must be steady for this long to count, so that switch bounce
+// isn't taken as several presses.
+//
+#define BUTTON_DEBOUNCE_MSECS 20
+
+
+//
+// Set the time of day to /seconds/ since midnight, and the date to /days/
+// since 1970-01-01, from now on.
+//
+static void SetTimeOfDay(
+    uint32 seconds,
+    uint32 days
+    )
+{
+    uint32 uptime = uptimeSeconds;
+
+    timeOfDayOffset = (seconds % SECONDS_PER_DAY + SECONDS_PER_DAY
+        - uptime % SECONDS_PER_DAY) % SECONDS_PER_DAY;
+    dateOffset = days - (timeOfDayOffset + uptime) / SECONDS_PER_DAY;
+    dateValid = 1;
+}
+
+//
+// @return local time in seconds since 1970-01-01 - or until YoPhone sets the
+// date, since the midnight the watch started counting from.
+//
+static uint32 LocalTime()
+{
+    uint32 seconds = timeOfDayOffset + uptimeSeconds;
+
+    if (dateValid) {
+        seconds += (uint32) dateOffset * SECONDS_PER_DAY;
+    }
+    return seconds;
+}
+
+//
+// Convert /days/ since 1970-01-01 to the /month/ (1 to 12) and /day/ of the
+// month, in the proleptic Gregorian calendar.
+//
+static void DateFromDays(
+    int32 days,
+    uint8 * month,
+    uint8 * day
+    )
+{
+    // Days since 0000-03-01, so that the leap day is the last day of the year
+    uint32 z = days + 719468;
+    uint32 dayOfEra = z % 146097;
+    uint32 yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32 dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32 marchMonth = (5 * dayOfYear + 2) / 153;
+
+    *day = dayOfYear - (153 * marchMonth + 2) / 5 + 1;
+    *month = marchMonth < 10 ? marchMonth + 3 : marchMonth - 9;
+}
+
+//
+// @return the buttons (S1 to S4, active low) held down now, as BUTTON_* bits.
+//
+static int ReadButtons()
+{
+    int buttons = 0;
+
+    if (!S1_Read()) buttons |= BUTTON_FORWARD;
+    if (!S2_Read()) buttons |= BUTTON_BACK;
+    if (!S3_Read()) buttons |= BUTTON_UP;
+    if (!S4_Read()) buttons |= BUTTON_DOWN;
+    return buttons;
+}
+
+//
+// Add the buttons newly pressed (once debounced) to buttonsPressed.  Called
+// every pass of the state machine.
+//
+static void PollButtons()
+{
+    static int lastRead = 0;
+    static int held = 0;
+    static uint32 lastChangeMsecs = 0;
+    int buttons = ReadButtons();
+
+    if (buttons != lastRead) {
+        lastRead = buttons;
+        lastChangeMsecs = uptimeMsecs;
+        return;
+    }
+    if (uptimeMsecs - lastChangeMsecs < BUTTON_DEBOUNCE_MSECS) return;
+
+    buttonsPressed |= buttons & ~held;
+    held = buttons;
+}
+
+//
+// Add a piece of result text from YoPhone: the byte offset (2 bytes, little
+// endian) it replaces the text from, and the UTF-8 text.  Offset 0 starts a
+// new result.  Text past RESULT_MAX_BYTES is dropped.
+//
+static void ResultAddPiece(
+    uint8 * data,
+    int len
+    )
+{
+    int offset;
+
+    if (len < 2) return;
+    offset = data[0] | (data[1] << 8);
+    if (offset > resultLen) return;
+
+    len = MIN(len - 2, RESULT_MAX_BYTES - offset);
+    memcpy(&resultText[offset], &data[2], len);
+    resultLen = offset + len;
+    resultText[resultLen] = '\0';
+
+    if (offset == 0) {
+        bleEvents |= BLE_RESULT;
+        resultChangedFrom = -1;
+    } else if (resultChangedFrom < 0 || offset < resultChangedFrom) {
+        resultChangedFrom = offset;
+    }
+}
 
 //
 // BLE callback when debug command received
@@ -141,38 +368,64 @@ CYBLE_API_RESULT_T OnDebugCommandCharacteristic(
     int len
     )
 {
-#if 0
-    // TODO Fix hardcoded constants
-    switch (*data) {
-        case 0: // Exit debug mode
-            bleSelectedNextState = SLEEP;
+    if (len < 1) return 0;
+
+    switch (data[0]) {
+        case DEBUG_CMD_MIC_TEST:
+            //
+            // Compressed audio, or with a second byte, the packet type.  The
+            // lengths are exact, as a short command written to the
+            // characteristic can leave bytes of a longer one after it.
+            //
+            if (len == 1) {
+                micPacketType = MIC_ADPCM_PACKET;
+            } else if (len == 2 && (data[1] == MIC_RAW_PACKET || data[1] == MIC_ADPCM_PACKET)) {
+                micPacketType = data[1];
+            } else {
+                break;
+            }
+            // Drop any stale end, so the test isn't ended as soon as it starts
+            bleEvents = (bleEvents & ~BLE_END_TEST) | BLE_MIC_TEST;
             break;
-        case 1: // Go to debug
-            if (state == SLEEP) {
-                bleSelectedNextState = DEBUG_IDLE;
+        case DEBUG_CMD_END_TEST:
+            if (len == 1) {
+                bleEvents |= BLE_END_TEST;
             }
-            xprintf("Go to DEBUG_IDLE\r\n");
             break;
-        case 2: // Go to debug speedtest
-            speedTestPackets = 100; // TODO need correct # packets
-            if (state == DEBUG_IDLE) {
-                bleSelectedNextState = DEBUG_SPEEDTEST;
+        case DEBUG_CMD_SET_TIME:
+            // Seconds since midnight, then days since 1970-01-01, little endian
+            if (len == 7) {
+                SetTimeOfDay(data[1] | (data[2] << 8) | (data[3] << 16) |
+                    ((uint32) data[4] << 24), data[5] | (data[6] << 8));
             }
             break;
-        case 3:
-            if (state == DEBUG_IDLE) {
-                bleSelectedNextState = DEBUG_MIC;
+        case DEBUG_CMD_ADD_MSG:
+            // A message not yet added is replaced
+            if (len > 3 && len - 1 <= MAX_MTU_SIZE) {
+                memcpy(pendingMsg, &data[1], len - 1);
+                pendingMsg[len - 1] = '\0';
+                pendingMsgLen = len - 1;
             }
             break;
+        case DEBUG_CMD_RESULT:
+            ResultAddPiece(&data[1], len - 1);
+            break;
         default:
-            bleSelectedNextState = NONE;
             break;
     }
-#endif
 
     return 0;
 }
 
+void OnSysTick()
+{
+    uptimeMsecs++;
+    if (++tickMsecs == 1000) {
+        tickMsecs = 0;
+        uptimeSeconds++;
+    }
+}
+
 //
 // BLE callback when connection changed
 // TODO handle state change (in main state machine) when device disconnects
@@ -209,15 +462,22 @@ int TrAccel(
 }
 
 int TrBle(
+    int events
     )
 {
-    return 0;
+    if (!(bleEvents & events)) return 0;
+    bleEvents &= ~events;
+    return 1;
 }
 
 int TrButton(
+    int buttons
     )
 {
-    return 0;
+    if (!(buttonsPressed & buttons)) return 0;
+    lastButtons = buttonsPressed & buttons;
+    buttonsPressed &= ~buttons;
+    return 1;
 }
 
 int TrGoToSleep(
@@ -226,10 +486,129 @@ int TrGoToSleep(
     return 0;
 }
 
+//
+// No voice activity detection yet, so neither VOICE_ACTIVITY nor
+// VOICE_TIMEOUT ever fires and TIME stays the resting state.
+//
 int TrVoice(
+    int voice
     )
 {
-    return 1;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Message list sources, read from the message store
+//
+
+//
+// Add the message from YoPhone, if any, to the message store.  Done from the
+// main loop, not the BLE callback, as it reads and writes serial RAM.
+//
+static void MsgAddPending()
+{
+    uint16 id;
+    char * sender;
+    char * body;
+    int senderLen;
+
+    if (pendingMsgLen == 0) return;
+
+    id = (uint8) pendingMsg[0] | ((uint8) pendingMsg[1] << 8);
+    sender = &pendingMsg[2];
+    senderLen = strlen(sender);
+    body = 2 + senderLen < pendingMsgLen ? &sender[senderLen + 1] : &pendingMsg[pendingMsgLen];
+    MsgStoreAdd(id, LocalTime(), sender, body);
+    pendingMsgLen = 0;
+}
+
+//
+// MSGS rows: sender (marked "* " if unread), and the start of the message
+//
+static int MsgsGetCount()
+{
+    return MsgStoreGetCount();
+}
+
+static void MsgsGetRow(
+    int index,
+    char text[LIST_VIEW_MAX_LINES][LIST_VIEW_MAX_CHARS + 1]
+    )
+{
+    char buf[2 * LIST_VIEW_MAX_CHARS + 1];
+    struct MSG_STORE_ENTRY entry;
+    int len;
+    int senderLen;
+    char * body;
+    char sender[LIST_VIEW_MAX_CHARS + 1];
+
+    if (MsgStoreGetEntry(index, &entry) < 0) return;
+    len = MsgStoreRead(index, buf, sizeof(buf) - 1);
+    if (len < 0) return;
+    buf[len] = '\0';
+
+    // Text is the sender, NUL, then the body
+    senderLen = strlen(buf);
+    body = senderLen < len ? &buf[senderLen + 1] : &buf[len];
+    Utf8ToFontChars(buf, sender, LIST_VIEW_MAX_CHARS);
+
+    snprintf(text[0], LIST_VIEW_MAX_CHARS + 1, "%s%s",
+        (entry.flags & MSG_STORE_FLAG_READ) ? "" : "* ", sender);
+    Utf8ToFontChars(body, text[1], LIST_VIEW_MAX_CHARS);
+}
+
+//
+// MSG_VIEW rows: the sender, then the body of message viewedMsg, wrapped to
+// the screen width.  The message is read and wrapped once, by MsgLinesLoad().
+//
+static char viewedText[MSG_STORE_MAX_TEXT + 1];
+static struct TEXT_LAYOUT viewedLayout;
+
+static void MsgLinesLoad()
+{
+    int len;
+    int senderLen;
+
+    len = MsgStoreRead(viewedMsg, viewedText, MSG_STORE_MAX_TEXT);
+    if (len < 0) len = 0;
+    viewedText[len] = '\0';
+
+    // The sender is the first line
+    senderLen = strlen(viewedText);
+    if (senderLen < len) viewedText[senderLen] = '\n';
+
+    TextLayoutWrap(&viewedLayout, viewedText, LIST_VIEW_TEXT_WIDTH, FONT_5X8);
+}
+
+static int MsgLinesGetCount()
+{
+    return viewedLayout.numLines;
+}
+
+static void MsgLinesGetRow(
+    int index,
+    char text[LIST_VIEW_MAX_LINES][LIST_VIEW_MAX_CHARS + 1]
+    )
+{
+    char buf[TEXT_LAYOUT_MAX_LINE_CHARS + 1];
+
+    if (index < 0 || index >= viewedLayout.numLines) return;
+    TextLayoutGetLine(&viewedLayout, index, buf);
+    strncpy(text[0], buf, LIST_VIEW_MAX_CHARS);
+}
+
+static const struct LIST_VIEW_SOURCE msgsSource = { MsgsGetCount, MsgsGetRow };
+static const struct LIST_VIEW_SOURCE msgLinesSource = { MsgLinesGetCount, MsgLinesGetRow };
+
+//
+// @return list scroll step for the last button: 1 for down, -1 for up, else 0
+//
+static int ScrollStep()
+{
+    if (lastButtons & BUTTON_DOWN) return 1;
+    if (lastButtons & BUTTON_UP) return -1;
+    return 0;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -244,6 +623,18 @@ void SmOff(
 {
     DisplayInit();
     SerialRamInit();
+
+    //
+    // Only at boot - TIME is re-entered from most other states.  The tests
+    // reset the serial RAM regions (and the message store), so they run
+    // before the regions are set up, and before BLE can add any messages.
+    //
+    Post();
+
+    // Audio gets the serial RAM left over, so its queue is set up last
+    SerialRamInit();
+    FramebufInit();
+    MsgStoreInit();
     BufQueueInit();
 }
 
@@ -259,9 +650,31 @@ void SmTime(
     int call
     )
 {
+    struct WATCH_FACE face;
+    uint32 now;
+    uint32 seconds;
+
     if (call == FIRST_STATE_CALL) {
-        Post();
+        DisplayErase();
+        WatchFaceInvalidate();
+    }
+    if (call == LAST_STATE_CALL) return;
+
+    //
+    // Called continuously - the watch face only draws what changed.
+    //
+    now = LocalTime();
+    seconds = now % SECONDS_PER_DAY;
+    face.hours = seconds / (60 * 60);
+    face.minutes = (seconds / 60) % 60;
+    face.seconds = seconds % 60;
+    face.month = 0;
+    face.day = 0;
+    if (dateValid) {
+        DateFromDays(now / SECONDS_PER_DAY, &face.month, &face.day);
     }
+    face.bleConnected = deviceConnected;
+    WatchFaceDraw(&face);
 }
 
 void SmVoice(
@@ -271,11 +684,32 @@ void SmVoice(
 {
 }
 
+//
+// Scrolling (BUTTON_UP/BUTTON_DOWN) re-enters the state, so the list is only
+// set up when coming from elsewhere.  Coming back from MSG_VIEW keeps the
+// list's position.
+//
 void SmMsgs(
     int prevState,
     int call
     )
 {
+    if (call == LAST_STATE_CALL) {
+        // On the last call, prevState is the state being entered
+        msgsViewValid = prevState == MSGS || prevState == MSG_VIEW;
+        viewedMsg = ListViewGetSelected(&msgsView);
+        return;
+    }
+    if (call != FIRST_STATE_CALL) return;
+
+    if (!msgsViewValid) {
+        ListViewInit(&msgsView, &msgsSource, 2, FONT_5X8, FONT_5X5, 1);
+    } else if (ScrollStep()) {
+        ListViewScroll(&msgsView, ScrollStep());
+    } else {
+        // Back from MSG_VIEW - rows may have been read, or added
+        ListViewRefresh(&msgsView);
+    }
 }
 
 void SmMsgView(
@@ -283,6 +717,19 @@ void SmMsgView(
     int call
     )
 {
+    if (call == LAST_STATE_CALL) {
+        msgsViewValid = prevState == MSGS || prevState == MSG_VIEW;
+        return;
+    }
+    if (call != FIRST_STATE_CALL) return;
+
+    if (ScrollStep()) {
+        ListViewScroll(&msgView, ScrollStep());
+    } else {
+        MsgStoreMarkRead(viewedMsg);
+        MsgLinesLoad();
+        ListViewInit(&msgView, &msgLinesSource, 1, FONT_5X8, FONT_5X8, 0);
+    }
 }
 
 void SmRunCmd(
@@ -294,11 +741,39 @@ void SmRunCmd(
     for(;;);
 }
 
+//
+// Re-entered (BLE_RESULT) when a new result starts.  As pieces of the result
+// arrive, only the lines they change are redrawn.
+//
+// Drawn to the framebuffer (if there is one), so that when the text scrolls
+// up, all its lines change on the OLED at once, and only the rects drawn are
+// flushed.  It's only white text on black, so the framebuffer is set to 8 bit
+// color: that's 4 bus bytes per pixel drawn, rather than 6 in 16 bit color
+// (drawing straight to the OLED is 2, see framebuf.c).
+//
 void SmResult(
     int prevState,
     int call
     )
 {
+    RECT box = {2, 2, SCREEN_WIDTH - 4, SCREEN_HEIGHT - 4};
+
+    if (call == LAST_STATE_CALL) {
+        DrawToFramebuf(0);
+        return;
+    }
+
+    if (call == FIRST_STATE_CALL) {
+        DrawToFramebuf(1);
+        FramebufSetDepth(8);
+        DrawRect(SCREEN_BOUNDS, BLACK);
+        TextLayoutInit(&resultLayout, resultText, box, FONT_5X8, WHITE, BLACK);
+        resultChangedFrom = -1;
+    } else if (resultChangedFrom >= 0) {
+        TextLayoutUpdate(&resultLayout, resultChangedFrom);
+        resultChangedFrom = -1;
+    }
+    FramebufFlush();
 }
 
 void SmCustomCmd(
@@ -317,13 +792,13 @@ void SmSpeedTest(
     case DEBUG_SPEEDTEST:
         if (speedTestPackets > 0) {
             if(CyBle_GattGetBusyStatus() == CYBLE_STACK_STATE_FREE) {
-                ((uint32 *) buffer)[0] = 0;
-                buffer[0] = 3;
-                ((uint32 *) buffer)[1] = n++;
-                ((uint32 *) buffer)[2] = 0x11223344;
+                packet.words[0] = 0;
+                packet.buffer[0] = 3;
+                packet.words[1] = n++;
+                packet.words[2] = 0x11223344;
 
                 ret = BleSendNotification(
-                    CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, buffer, 500);
+                    CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, packet.buffer, 500);
                 if (ret == 0) {
                     speedTestPackets--;
                 }
@@ -336,11 +811,11 @@ void SmSpeedTest(
 
     case DEBUG_SPEEDTEST_2:
         if(CyBle_GattGetBusyStatus() == CYBLE_STACK_STATE_FREE) {
-            ((uint32 *) buffer)[0] = 0;
-            buffer[0] = 4;
+            packet.words[0] = 0;
+            packet.buffer[0] = 4;
 
             ret = BleSendNotification(
-                CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, buffer, 1);
+                CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, packet.buffer, 1);
             if (ret == 0) {
                 newState = DEBUG_IDLE;
             }
@@ -350,55 +825,104 @@ void SmSpeedTest(
 #endif
 }
 
+//
+// Send the mic test packet, once BLE is free.
+//
+static void MicTestSend()
+{
+    int ret;
+
+    if (CyBle_GattGetBusyStatus() != CYBLE_STACK_STATE_FREE) return;
+
+    packet.words[0] = 0;
+    packet.buffer[0] = micPacketType;
+    ret = BleSendNotification(
+        CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, packet.buffer,
+        QUEUE_PACKET_HEADER_BYTES + micPayloadBytes);
+    if (ret == 0) {
+        micPayloadBytes = 0;
+    }
+}
+
+//
+// Raw mic test: dequeue as much of the stream as fits straight into the
+// packet, and send it.  Stream blocks may be split across packets - YoPhone
+// puts them back together.
+//
+static void MicTestRaw()
+{
+    int ret;
+
+    if (micDequeuing) {
+        if (!micDone) return;
+        micDequeuing = 0;
+    }
+
+    if (micPayloadBytes == 0) {
+        ret = DequeuePacket(packet.buffer, MIC_PACKET_BYTES, &micPayloadBytes, &micDone);
+        micDequeuing = ret == 0 || ret == -EAGAIN;
+        return;
+    }
+
+    MicTestSend();
+}
+
+//
+// ADPCM mic test: dequeue a stream block at a time, compress it into the
+// packet, and send the packet once no more blocks fit.  YoPhone decodes the
+// packets back to PCM (see BleService).
+//
+static void MicTestAdpcm()
+{
+    int ret;
+
+    if (micDequeuing) {
+        if (!micDone) return;
+        micDequeuing = 0;
+        ret = AdpcmEncodeBlock(&micAdpcm, SerialRamGetBuf(2),
+            &packet.buffer[QUEUE_PACKET_HEADER_BYTES + micPayloadBytes]);
+        if (ret > 0) {
+            micPayloadBytes += ret;
+        }
+    }
+
+    if (QUEUE_PACKET_HEADER_BYTES + micPayloadBytes + ADPCM_BLOCK_BYTES <= MIC_PACKET_BYTES) {
+        ret = DequeueBytes(SerialRamGetBuf(2), SERIAL_RAM_BUFSIZE, &micDone);
+        micDequeuing = ret == 0 || ret == -EAGAIN;
+        return;
+    }
+
+    MicTestSend();
+}
+
+//
+// Stream the mic to YoPhone, as debug command packets of micPacketType.
+//
 void SmMicTest(
     int prevState,
     int call
     )
 {
-#if 0
-    case DEBUG_MIC:
+    if (call == FIRST_STATE_CALL) {
         BufQueueInit();
-        micBytes = 0;
+        AdpcmInit(&micAdpcm);
+        micPayloadBytes = 0;
+        micDequeuing = 0;
         I2sStartDma(NULL, NULL);
-        newState = DEBUG_MIC_2;
-        newState = GetBleStateIfNew(newState);
-        break;
-
-    case DEBUG_MIC_2:
-        ret = DequeueBytes(buffer, 496, &done);
-        if (ret != -ENODATA) {
-            newState = DEBUG_MIC_3;
-        }
-        newState = GetBleStateIfNew(newState);
-        break;
-
-    case DEBUG_MIC_3:
-        if (done) {
-            newState = DEBUG_MIC_4;
-        }
-        newState = GetBleStateIfNew(newState);
-        break;
-
-    case DEBUG_MIC_4:
-        if(CyBle_GattGetBusyStatus() == CYBLE_STACK_STATE_FREE) {
-            buffer[0] = 5;
-            ret = BleSendNotification(
-                CYBLE_SMARTWATCH_SERVICE_DEBUG_COMMAND_CHAR_HANDLE, buffer, 500);
-            if (ret == 0) {
-                micBytes += 500;
-                newState = DEBUG_MIC_2;
-            }
-        }
-        if (micBytes > 100000) {
-            I2sStopDma();
-            newState = DEBUG_IDLE;
-        }
-        newState = GetBleStateIfNew(newState);
-        break;
+        return;
+    }
+    if (call == LAST_STATE_CALL) {
+        I2sStopDma();
+        while (micDequeuing && !micDone);
+        micDequeuing = 0;
+        return;
+    }
 
-    default:
-        break;
-#endif
+    if (micPacketType == MIC_RAW_PACKET) {
+        MicTestRaw();
+    } else {
+        MicTestAdpcm();
+    }
 }
 
 void SmDisconnect(
@@ -412,7 +936,7 @@ void SmDisconnect(
 // State Machine transition structure
 //
 #define NAME(n) n, #n
-#define MAX_STATE_TRANSITIONS 5
+#define MAX_STATE_TRANSITIONS 6
 const struct {
     int state;
     char * name;
@@ -432,13 +956,16 @@ const struct {
         { TrGoToSleep, 0, SLEEP },
         { TrAccel, ACCEL_TWIST, TIME },
         { TrButton, BUTTON_ANY, TIME },
-        { TrBle, BLE_SPEED_TEST | BLE_MIC_TEST, DISCONNECT },
+        { TrBle, BLE_SPEED_TEST, DISCONNECT },
+        { TrBle, BLE_MIC_TEST, MIC_TEST },
         }},
     { NAME(TIME), SmTime, {
         { TrBle, BLE_DISCONNECT, DISCONNECT },
         { TrGoToSleep, 0, SLEEP },
-        { TrVoice, VOICE_ACTIVITY, VOICE },
+        { TrBle, BLE_MIC_TEST, MIC_TEST },
         { TrButton, BUTTON_FORWARD, MSGS },
+        { TrVoice, VOICE_ACTIVITY, VOICE },
+        { TrBle, BLE_RESULT, RESULT },
         }},
     { NAME(VOICE), SmVoice, {
         { TrBle, BLE_DISCONNECT, DISCONNECT },
@@ -469,6 +996,7 @@ const struct {
     { NAME(RESULT), SmResult, {
         { TrBle, BLE_DISCONNECT, DISCONNECT },
         { TrGoToSleep, 0, SLEEP },
+        { TrBle, BLE_RESULT, RESULT },
         { TrButton, BUTTON_UP | BUTTON_DOWN, RESULT },
         { TrButton, BUTTON_BACK, TIME },
         }},
@@ -511,6 +1039,7 @@ int main()
     I2sRxDma_Init();
     SpiTxDma_Init();
     SpiRxDma_Init();
+    SpiInit();
 
     BleStart();
     BleRegisterWriteCallback(
@@ -526,6 +1055,10 @@ int main()
     UART_1_Start();
 
     Timer_Programmable_Init();
+
+    CySysTickStart();
+    CySysTickSetCallback(0, OnSysTick);
+
     //
     // Verify state machine state field
     //
@@ -546,6 +1079,8 @@ int main()
     for (;;) {
         const struct TRANSITION * ptransition;
         CyBle_ProcessEvents();
+        PollButtons();
+        MsgAddPending();
         
         if (first) {
             xprintf("+State %s\r\n", SM[state].name);
@@ -553,7 +1088,8 @@ int main()
         SM[state].func(prevState, first ? FIRST_STATE_CALL : MIDDLE_STATE_CALL);
         first = 0;
         ptransition = &SM[state].transition[0];
-        while (ptransition->newState != NONE) {
+        // A full transition list has no NONE terminator
+        for (i = 0; i < MAX_STATE_TRANSITIONS && ptransition->newState != NONE; i++) {
             if (!ptransition->condition || ptransition->condition(ptransition->condArg)) {
                 int newState = ptransition->newState;
                 xprintf("-State %s\r\n", SM[state].name);
@@ -0,0 +1,471 @@
+/*
+ * msgstore.c
+ *
+ * Store of received messages (notifications), in serial RAM
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <errno.h>
+#include <string.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "serialram.h"
+#include "msgstore.h"
+
+//
+// Messages are appended to a circular log in serial RAM, compressed.  The
+// index of what's in the log (one MSG_STORE_ENTRY per message) is kept in
+// SRAM, in the same order as the log, so the oldest message is always the
+// next to be overwritten, and evicting it is just dropping its index entry.
+//
+// Each message is its text: the sender, a NUL, and the body.
+//
+static struct MSG_STORE_ENTRY entries[MSG_STORE_MAX_MSGS];
+static int firstEntry = 0;      // oldest
+static int numEntries = 0;
+static uint32 logTail = 0;      // offset of the next message appended
+static uint32 logUsed = 0;
+static int msgStoreExists = 0;
+static uint32 logAddress = 0;
+
+//
+// Scratch for the text of the message being added or read
+//
+static char scratchText[MSG_STORE_MAX_TEXT];
+static uint8 scratchPacked[MSG_STORE_MAX_PACKED];
+
+//
+// Compression is LZSS: the packed message is groups of up to 8 items, each
+// group led by a flags byte, with bit i (LSB first) set if item i is a match.
+// An item is either:
+//      - literal:  one byte of text
+//      - match:    2 bytes, 12 bits of distance - 1, and 4 bits of
+//                  length - MSG_PACK_MIN_MATCH, copying length bytes from
+//                  distance bytes back.
+//
+// Notifications are too short to repeat themselves much, so the window starts
+// out filled with the dictionary below, of text common in notifications.
+// Matches can go back into the dictionary as if it preceded the message.
+//
+#define MSG_PACK_MIN_MATCH      3
+#define MSG_PACK_MAX_MATCH      (MSG_PACK_MIN_MATCH + 0xF)
+#define MSG_PACK_WINDOW         (1 << 12)
+
+static const char msgPackDict[] =
+    "http://https://www..com/ Missed call from Voicemail New message "
+    "Reminder: Meeting tomorrow tonight today at the and you your for "
+    "that this with have are not was will can just what Thanks! please "
+    "OK sure I'm Let me know when where ing tion ed ly ,  ";
+
+#define MSG_PACK_DICT_LEN       (sizeof(msgPackDict) - 1)
+
+//
+// Incremental decoder of a packed message in the log
+//
+struct MSG_UNPACKER {
+    uint32 offset;          // next packed byte
+    int remaining;          // packed bytes left
+    uint8 flags;
+    int items;              // items left in group
+    int chunkPos;
+    int chunkLen;
+    uint8 chunk[32];
+};
+
+//
+// Write /bytes/ of /buf/ to /offset/ in the log, wrapping at the end
+//
+static void LogWrite(
+    uint8 * buf,
+    uint32 offset,
+    uint32 bytes
+    )
+{
+    uint32 toEnd = MIN(bytes, MSG_STORE_BYTES - offset);
+
+    assert(SerialRamWriteBlocking(buf, logAddress + offset, toEnd) == 0);
+    if (bytes > toEnd) {
+        assert(SerialRamWriteBlocking(buf + toEnd, logAddress, bytes - toEnd) == 0);
+    }
+}
+
+//
+// Read /bytes/ from /offset/ in the log to /buf/, wrapping at the end
+//
+static void LogRead(
+    uint8 * buf,
+    uint32 offset,
+    uint32 bytes
+    )
+{
+    uint32 toEnd = MIN(bytes, MSG_STORE_BYTES - offset);
+
+    assert(SerialRamReadBlocking(buf, logAddress + offset, toEnd) == 0);
+    if (bytes > toEnd) {
+        assert(SerialRamReadBlocking(buf + toEnd, logAddress, bytes - toEnd) == 0);
+    }
+}
+
+//
+// @return index entry of message /index/ (0 is the newest)
+//
+static struct MSG_STORE_ENTRY * GetEntry(
+    int index
+    )
+{
+    return &entries[(firstEntry + numEntries - 1 - index) % MSG_STORE_MAX_MSGS];
+}
+
+static void EvictOldest()
+{
+    struct MSG_STORE_ENTRY * entry = &entries[firstEntry];
+
+    logUsed -= entry->length;
+    firstEntry = (firstEntry + 1) % MSG_STORE_MAX_MSGS;
+    numEntries--;
+}
+
+//
+// @return byte /pos/ of the dictionary followed by /text/
+//
+static char WindowByte(
+    const char * text,
+    int pos
+    )
+{
+    return pos < (int) MSG_PACK_DICT_LEN ? msgPackDict[pos] : text[pos - MSG_PACK_DICT_LEN];
+}
+
+//
+// Find the longest match for the text at /pos/ in the window before it.
+//
+// @return match length (0 if none), and its distance back in /pDist/
+//
+static int FindMatch(
+    const char * text,
+    int pos,
+    int len,
+    int * pDist
+    )
+{
+    int windowPos = MSG_PACK_DICT_LEN + pos;
+    int maxLen = MIN(MSG_PACK_MAX_MATCH, len - pos);
+    int bestLen = 0;
+
+    for (int start = MAX(windowPos - MSG_PACK_WINDOW, 0); start < windowPos; start++) {
+        int n = 0;
+        // Matches may run on past pos, into the text they're copying
+        while (n < maxLen && WindowByte(text, start + n) == text[pos + n]) {
+            n++;
+        }
+        if (n > bestLen) {
+            bestLen = n;
+            *pDist = windowPos - start;
+            if (n == maxLen) break;
+        }
+    }
+    return bestLen;
+}
+
+//
+// Compress message text.
+//
+// @param text      text to compress
+// @param len       bytes of text, up to MSG_STORE_MAX_TEXT
+// @param packed    output: compressed text
+//
+// @return bytes of packed
+//
+int MsgStorePack(
+    const char * text,
+    int len,
+    uint8 packed[MSG_STORE_MAX_PACKED]
+    )
+{
+    int out = 0;
+    int flagsAt = 0;
+    int items = 0;
+    int pos = 0;
+
+    assert(len <= MSG_STORE_MAX_TEXT);
+
+    while (pos < len) {
+        int dist = 0;
+        int n = FindMatch(text, pos, len, &dist);
+
+        if (items % 8 == 0) {
+            flagsAt = out++;
+            packed[flagsAt] = 0;
+        }
+
+        if (n >= MSG_PACK_MIN_MATCH) {
+            packed[flagsAt] |= 1 << (items % 8);
+            packed[out++] = (dist - 1) >> 4;
+            packed[out++] = ((dist - 1) << 4) | (n - MSG_PACK_MIN_MATCH);
+            pos += n;
+        } else {
+            packed[out++] = text[pos++];
+        }
+        items++;
+    }
+    return out;
+}
+
+static void UnpackerInit(
+    struct MSG_UNPACKER * u,
+    struct MSG_STORE_ENTRY * entry
+    )
+{
+    u->offset = entry->offset;
+    u->remaining = entry->length;
+    u->items = 0;
+    u->chunkPos = 0;
+    u->chunkLen = 0;
+}
+
+static uint8 UnpackerNextByte(
+    struct MSG_UNPACKER * u
+    )
+{
+    if (u->chunkPos == u->chunkLen) {
+        u->chunkLen = MIN(u->remaining, (int) sizeof(u->chunk));
+        u->chunkPos = 0;
+        LogRead(u->chunk, u->offset, u->chunkLen);
+        u->offset = (u->offset + u->chunkLen) % MSG_STORE_BYTES;
+    }
+    u->remaining--;
+    return u->chunk[u->chunkPos++];
+}
+
+//
+// Decode the next item of the packed message into /text/, which holds the
+// text decoded so far.
+//
+// @param pos   bytes of text decoded so far
+//
+// @return bytes of text decoded, including this item (so /pos/ if there are
+// no items left)
+//
+static int UnpackItem(
+    struct MSG_UNPACKER * u,
+    char text[MSG_STORE_MAX_TEXT],
+    int pos
+    )
+{
+    if (u->remaining == 0) return pos;
+    if (u->items == 0) {
+        u->flags = UnpackerNextByte(u);
+        u->items = 8;
+    }
+
+    if (u->flags & 1) {
+        uint8 b0 = UnpackerNextByte(u);
+        uint8 b1 = UnpackerNextByte(u);
+        int src = MSG_PACK_DICT_LEN + pos - (((b0 << 4) | (b1 >> 4)) + 1);
+        int n = (b1 & 0xF) + MSG_PACK_MIN_MATCH;
+
+        for (; n > 0 && pos < MSG_STORE_MAX_TEXT; n--) {
+            text[pos++] = WindowByte(text, src++);
+        }
+    } else if (pos < MSG_STORE_MAX_TEXT) {
+        text[pos++] = UnpackerNextByte(u);
+    }
+
+    u->flags >>= 1;
+    u->items--;
+    return pos;
+}
+
+//
+// Initialize the message store to empty.  The log is a serial RAM region - if
+// there's no serial RAM to spare for it, messages aren't stored.  Requires
+// SerialRamInit() was run.
+//
+// @return 0 on success, -ENOMEM if there's no RAM for the store.
+//
+int MsgStoreInit()
+{
+    int ret;
+
+    firstEntry = 0;
+    numEntries = 0;
+    logTail = 0;
+    logUsed = 0;
+    ret = SerialRamRegionAlloc(SERIAL_RAM_REGION_MSG_STORE, MSG_STORE_BYTES);
+    msgStoreExists = ret == 0;
+    logAddress = SerialRamRegionAddress(SERIAL_RAM_REGION_MSG_STORE);
+    return ret;
+}
+
+//
+// @return true if MsgStoreInit() found RAM for the store.
+//
+int MsgStoreExists()
+{
+    return msgStoreExists;
+}
+
+//
+// Add a message, as the newest, evicting the oldest messages if the store is
+// full.
+//
+// @param id        id of the message (from YoPhone)
+// @param timestamp when the message was received
+// @param sender    sender, NUL terminated
+// @param body      body, NUL terminated.  Truncated if the sender and body
+//                  are more than MSG_STORE_MAX_TEXT.
+//
+// @return 0 on success, -EEXIST if the message is already stored, or -ENODEV
+// if there's no store.
+//
+int MsgStoreAdd(
+    uint16 id,
+    uint32 timestamp,
+    char * sender,
+    char * body
+    )
+{
+    struct MSG_STORE_ENTRY * entry;
+    int senderLen;
+    int bodyLen;
+    int len;
+
+    if (!msgStoreExists) return -ENODEV;
+    if (MsgStoreFind(id) >= 0) return -EEXIST;
+
+    senderLen = MIN((int) strlen(sender), MSG_STORE_MAX_TEXT - 1);
+    bodyLen = MIN((int) strlen(body), MSG_STORE_MAX_TEXT - senderLen - 1);
+    memcpy(scratchText, sender, senderLen);
+    scratchText[senderLen] = '\0';
+    memcpy(scratchText + senderLen + 1, body, bodyLen);
+
+    len = MsgStorePack(scratchText, senderLen + 1 + bodyLen, scratchPacked);
+
+    while (numEntries == MSG_STORE_MAX_MSGS || logUsed + len > MSG_STORE_BYTES) {
+        EvictOldest();
+    }
+
+    LogWrite(scratchPacked, logTail, len);
+
+    entry = &entries[(firstEntry + numEntries) % MSG_STORE_MAX_MSGS];
+    entry->timestamp = timestamp;
+    entry->id = id;
+    entry->length = len;
+    entry->offset = logTail;
+    entry->flags = 0;
+    numEntries++;
+
+    logTail = (logTail + len) % MSG_STORE_BYTES;
+    logUsed += len;
+    return 0;
+}
+
+//
+// @return number of messages stored
+//
+int MsgStoreGetCount()
+{
+    return numEntries;
+}
+
+//
+// @return number of messages stored that aren't marked read
+//
+int MsgStoreGetUnread()
+{
+    int unread = 0;
+
+    for (int i = 0; i < numEntries; i++) {
+        if (!(GetEntry(i)->flags & MSG_STORE_FLAG_READ)) unread++;
+    }
+    return unread;
+}
+
+//
+// @return index of message /id/ (0 is the newest), or -ENOENT
+//
+int MsgStoreFind(
+    uint16 id
+    )
+{
+    for (int i = 0; i < numEntries; i++) {
+        if (GetEntry(i)->id == id) return i;
+    }
+    return -ENOENT;
+}
+
+//
+// Get the index entry of a message.
+//
+// @param index     message index, 0 is the newest
+// @param entry     output: copy of the entry
+//
+// @return 0 on success, -EINVAL if there's no message /index/
+//
+int MsgStoreGetEntry(
+    int index,
+    struct MSG_STORE_ENTRY * entry
+    )
+{
+    if (index < 0 || index >= numEntries) return -EINVAL;
+    *entry = *GetEntry(index);
+    return 0;
+}
+
+//
+// Read the text of a message: the sender, a NUL, then the body.  Only as
+// much as fits in /text/ is decompressed (and read from serial RAM), so
+// reading the start of a message is cheap.
+//
+// @param index     message index, 0 is the newest
+// @param text      output: text, not NUL terminated
+// @param maxLen    size of text
+//
+// @return bytes of text read, or -EINVAL if there's no message /index/
+//
+int MsgStoreRead(
+    int index,
+    char * text,
+    int maxLen
+    )
+{
+    struct MSG_UNPACKER u;
+    int pos = 0;
+    int prev;
+
+    if (index < 0 || index >= numEntries) return -EINVAL;
+
+    //
+    // Matches copy from earlier in the text, so decode all of it up to
+    // maxLen (and maybe a bit past it) in the scratch buf.
+    //
+    UnpackerInit(&u, GetEntry(index));
+    do {
+        prev = pos;
+        pos = UnpackItem(&u, scratchText, pos);
+    } while (pos != prev && pos < maxLen);
+
+    pos = MIN(pos, maxLen);
+    memcpy(text, scratchText, pos);
+    return pos;
+}
+
+//
+// Mark a message as read.
+//
+// @return 0 on success, -EINVAL if there's no message /index/
+//
+int MsgStoreMarkRead(
+    int index
+    )
+{
+    if (index < 0 || index >= numEntries) return -EINVAL;
+    GetEntry(index)->flags |= MSG_STORE_FLAG_READ;
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef _MSGSTORE_H_
+#define _MSGSTORE_H_
+
+#include <project.h>
+#include "serialram.h"
+
+//
+// Size of the message log, a serial RAM region.  Holds a few hundred typical
+// messages, compressed.
+//
+#define MSG_STORE_BYTES         (64 * 1024)
+
+//
+// Messages indexed in SRAM.  When either the index or the log is full, the
+// oldest messages are evicted.
+//
+#define MSG_STORE_MAX_MSGS      256
+
+//
+// Longest message text: sender, NUL, and body.  Longer bodies are truncated.
+//
+#define MSG_STORE_MAX_TEXT      384
+
+//
+// Longest message once compressed: every item a literal, plus a flag byte per
+// 8 items (see msgstore.c).
+//
+#define MSG_STORE_MAX_PACKED    (MSG_STORE_MAX_TEXT + (MSG_STORE_MAX_TEXT + 7) / 8)
+
+#define MSG_STORE_FLAG_READ     (1 << 0)
+
+//
+// Index entry, kept in SRAM for each message in the log.
+//
+struct MSG_STORE_ENTRY {
+    uint32 timestamp;
+    uint16 id;
+    uint16 length;              // compressed bytes in the log
+    uint32 offset : 24;         // in the log
+    uint32 flags : 8;           // MSG_STORE_FLAG_*
+};
+
+int MsgStoreInit();
+
+int MsgStoreExists();
+
+int MsgStoreAdd(
+    uint16 id,
+    uint32 timestamp,
+    char * sender,
+    char * body
+    );
+
+int MsgStoreGetCount();
+
+int MsgStoreGetUnread();
+
+int MsgStoreFind(
+    uint16 id
+    );
+
+int MsgStoreGetEntry(
+    int index,
+    struct MSG_STORE_ENTRY * entry
+    );
+
+int MsgStoreRead(
+    int index,
+    char * text,
+    int maxLen
+    );
+
+int MsgStoreMarkRead(
+    int index
+    );
+
+int MsgStorePack(
+    const char * text,
+    int len,
+    uint8 packed[MSG_STORE_MAX_PACKED]
+    );
+
+#endif
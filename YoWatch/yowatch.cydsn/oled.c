@@ -29,13 +29,18 @@
     }
 
 
-#define SET_COLUMN_ADDRESS(a, b)                CMD_ARGS(0x15, 2, a, b)
-#define SET_ROW_ADDRESS(a, b)                   CMD_ARGS(0x75, 2, a, b)
-#define WRITE_RAM_COMMAND()                     CMD_ARGS(0x5C, 0)
+#define SET_COLUMN_ADDRESS_CMD                  0x15
+#define SET_ROW_ADDRESS_CMD                     0x75
+#define WRITE_RAM_CMD                           0x5C
+#define SET_DISPLAY_START_LINE_CMD              0xA1
+
+#define SET_COLUMN_ADDRESS(a, b)                CMD_ARGS(SET_COLUMN_ADDRESS_CMD, 2, a, b)
+#define SET_ROW_ADDRESS(a, b)                   CMD_ARGS(SET_ROW_ADDRESS_CMD, 2, a, b)
+#define WRITE_RAM_COMMAND()                     CMD_ARGS(WRITE_RAM_CMD, 0)
 #define READ_RAM_COMMAND()                      CMD_ARGS(0x5D, 0)
 #define SET_REMAP(a)                            CMD_ARGS(0xA0, 1, a)
 
-#define SET_DISPLAY_START_LINE(a)               CMD_ARGS(0xA1, 1, a)
+#define SET_DISPLAY_START_LINE(a)               CMD_ARGS(SET_DISPLAY_START_LINE_CMD, 1, a)
 #define SET_DISPLAY_OFFSET(a)                   CMD_ARGS(0xA2, 1, a)
 #define SET_DISPLAY_MODE_ALL_OFF()              CMD_ARGS(0xA4, 0)
 #define SET_DISPLAY_MODE_ALL_ON()               CMD_ARGS(0xA5, 0)
@@ -122,6 +127,34 @@ uint8 displayBuf[DISPLAY_BUF_SIZE];
 #endif
 
 
+//
+// Column/row window that the OLED is currently set to, so that setting up the
+// same window again can be skipped.
+//
+// This relies on every write to a window filling it completely, which leaves
+// the OLED RAM pointer wrapped back around to the start of the window.  So if
+// a data write fails, the pointer is left mid-window, and the window must be
+// set up again (see InvalidateWindowOnError()).
+//
+static struct {
+    int valid;
+    uint8 x1, y1, x2, y2;
+} window;
+
+//
+// @return /ret/, a SpiXfer() return value, forgetting the window if it's an
+// error.
+//
+static int InvalidateWindowOnError(
+    int ret
+    )
+{
+    if (ret < 0 && ret != -EAGAIN) {
+        window.valid = 0;
+    }
+    return ret;
+}
+
 static int SendDataRepeatedBlocking(
     uint8 data,
     uint32 bytes
@@ -132,13 +165,14 @@ static int SendDataRepeatedBlocking(
 
     OLED_DAT_CMD_Write(1);
     ret = SpiXfer(
-        &data, NULL, bytes, SPI_SS_OLED, NULL, &done, SPI_DONE_CALLBACK | SPI_TX_BYTE_REPEATED
+        &data, NULL, bytes, SPI_SS_OLED, NULL, &done,
+        SPI_DONE_CALLBACK | SPI_TX_BYTE_REPEATED | SPI_SPLITTABLE | SPI_CLASS(SPI_CLASS_DISPLAY)
         );
     if (ret == 0 || ret == -EAGAIN) {
         while (!done);
     }
     OLED_DAT_CMD_Write(0);
-    return ret;
+    return InvalidateWindowOnError(ret);
 }
 
 static int SendBytesBlocking(
@@ -149,16 +183,123 @@ static int SendBytesBlocking(
 {
     int ret;
     int done;
+    uint32 flags;
 
     if (bytes == 0) return 0;
 
+    //
+    // The OLED only cares about slave select framing for commands, so data
+    // may be split up by the SPI scheduler to let audio through.
+    //
+    flags = SPI_DONE_CALLBACK | SPI_CLASS(SPI_CLASS_DISPLAY);
+    if (!isCmd) {
+        flags |= SPI_SPLITTABLE;
+    }
+
     OLED_DAT_CMD_Write(isCmd ? 0 : 1);
-    ret = SpiXfer(data, NULL, bytes, SPI_SS_OLED, NULL, &done, SPI_DONE_CALLBACK);
+    ret = SpiXfer(data, NULL, bytes, SPI_SS_OLED, NULL, &done, flags);
     if (ret == 0 || ret == -EAGAIN) {
         while (!done);
     }
     OLED_DAT_CMD_Write(0);
-    return ret;
+    return InvalidateWindowOnError(ret);
+}
+
+//
+// Command lists
+//
+// Sent one piece at a time, every command byte and every run of args is its
+// own SPI transaction (with its own bus lock, and D/C line writes).  Instead,
+// a command list collects a stream of commands, and optionally a short pixel
+// payload, with the D/C state of each byte.  The whole list is then sent by
+// the CPU while holding the bus just once, changing D/C between runs.
+//
+#define CMD_LIST_MAX_BYTES 64
+
+//
+// Most bytes CmdListSetWindow() adds: column and row commands with args, and
+// the write RAM command.
+//
+#define CMD_LIST_WINDOW_BYTES (3 + 3 + 1)
+
+struct CMD_LIST {
+    uint8 bytes[CMD_LIST_MAX_BYTES];
+    uint8 isData[CMD_LIST_MAX_BYTES];
+    uint32 len;
+};
+
+static void CmdListInit(
+    struct CMD_LIST * list
+    )
+{
+    list->len = 0;
+}
+
+//
+// @return bytes left in /list/
+//
+static uint32 CmdListSpace(
+    struct CMD_LIST * list
+    )
+{
+    return CMD_LIST_MAX_BYTES - list->len;
+}
+
+//
+// Add /bytes/ of /data/ to /list/, as command bytes if /isCmd/, else as data
+// bytes (command args, or pixels).
+//
+static void CmdListAddBytes(
+    struct CMD_LIST * list,
+    uint8 * data,
+    uint32 bytes,
+    int isCmd
+    )
+{
+    if (bytes == 0) return;
+    assert(bytes <= CmdListSpace(list));
+    memcpy(&list->bytes[list->len], data, bytes);
+    memset(&list->isData[list->len], !isCmd, bytes);
+    list->len += bytes;
+}
+
+//
+// Add command /cmd/, with /bytes/ of args /data/, to /list/.
+//
+static void CmdListAdd(
+    struct CMD_LIST * list,
+    uint8 cmd,
+    uint8 * data,
+    uint32 bytes
+    )
+{
+    CmdListAddBytes(list, &cmd, 1, 1);
+    CmdListAddBytes(list, data, bytes, 0);
+}
+
+//
+// Send /list/, and empty it.
+//
+static void CmdListSend(
+    struct CMD_LIST * list
+    )
+{
+    uint32 start, end;
+
+    if (list->len == 0) return;
+
+    assert(SpiAcquireBus(SPI_CLASS(SPI_CLASS_DISPLAY)) == 0);
+    for (start = 0; start < list->len; start = end) {
+        for (end = start + 1; end < list->len; end++) {
+            if (list->isData[end] != list->isData[start]) break;
+        }
+        OLED_DAT_CMD_Write(list->isData[start]);
+        SpiWritePio(&list->bytes[start], end - start, SPI_SS_OLED);
+    }
+    OLED_DAT_CMD_Write(0);
+    SpiReleaseBus();
+
+    list->len = 0;
 }
 
 static void SendCommand(
@@ -167,8 +308,85 @@ static void SendCommand(
     uint32 bytes
     )
 {
-    assert(SendBytesBlocking(&cmd, 1, 1) == 0);
-    assert(SendBytesBlocking(data, bytes, 0) == 0);
+    struct CMD_LIST list;
+
+    CmdListInit(&list);
+    CmdListAdd(&list, cmd, data, bytes);
+    CmdListSend(&list);
+}
+
+//
+// Hardware scrolling
+//
+// The OLED shows RAM rows startLine to startLine + SCREEN_HEIGHT - 1 (mod
+// DISPLAY_RAM_HEIGHT) as screen rows 0 to SCREEN_HEIGHT - 1.  All Display
+// functions take screen rows, which are translated by writeStartLine - so
+// content already drawn moves with the start line, and nothing else has to
+// know about scrolling.  Screen rows are checked against SCREEN_HEIGHT, so a
+// caller can never write the off screen RAM rows directly.
+//
+// writeStartLine is ahead of startLine between DisplayScrollStart() and
+// DisplayScrollFinish(), so that exposed rows are drawn to the off screen rows
+// before they are shown.
+//
+static uint8 startLine = 0;
+static uint8 writeStartLine = 0;
+
+//
+// @return OLED RAM row of screen row /y/
+//
+static uint32 RamRow(
+    uint32 y
+    )
+{
+    return (y + writeStartLine) % DISPLAY_RAM_HEIGHT;
+}
+
+//
+// @return rows, from screen row /y/, until the OLED RAM wraps back to row 0
+//
+static uint32 RowsUntilWrap(
+    uint32 y
+    )
+{
+    return DISPLAY_RAM_HEIGHT - RamRow(y);
+}
+
+//
+// Add the commands to write the given window of display RAM to /list/ -
+// skipping the column and/or row setup if they are already set.  After
+// sending /list/, exactly the full window of pixels must be written.
+//
+// /y1/ and /y2/ are screen rows, and must not wrap in OLED RAM (see
+// RowsUntilWrap()).
+//
+static void CmdListSetWindow(
+    struct CMD_LIST * list,
+    uint32 x1,
+    uint32 y1,
+    uint32 x2,
+    uint32 y2
+    )
+{
+    assert(y2 - y1 < RowsUntilWrap(y1));
+    y1 = RamRow(y1);
+    y2 = RamRow(y2);
+
+    if (!window.valid || window.x1 != x1 || window.x2 != x2) {
+        uint8 data[2] = { x1, x2 };
+        CmdListAdd(list, SET_COLUMN_ADDRESS_CMD, data, sizeof(data));
+    }
+    if (!window.valid || window.y1 != y1 || window.y2 != y2) {
+        uint8 data[2] = { y1, y2 };
+        CmdListAdd(list, SET_ROW_ADDRESS_CMD, data, sizeof(data));
+    }
+    CmdListAdd(list, WRITE_RAM_CMD, NULL, 0);
+
+    window.valid = 1;
+    window.x1 = x1;
+    window.y1 = y1;
+    window.x2 = x2;
+    window.y2 = y2;
 }
 
 static void SendLookupTableForGrayscale(
@@ -185,6 +403,9 @@ void DisplayInit()
     //
     // Univision Technology OLED display init.  Modified from UG-2896GDEAF11.
     //
+    window.valid = 0;
+    startLine = 0;
+    writeStartLine = 0;
     SET_COMMAND_LOCK(0x12);
     SET_COMMAND_LOCK(0xB1);
     SET_SLEEP_MODE_ON();
@@ -228,6 +449,7 @@ void DisplayRect(
 {
     int i;
     int pixels = width * height;
+    struct CMD_LIST list;
 
     uint32 x2 = x1 + width - 1;
     uint32 y2 = y1 + height - 1;
@@ -237,9 +459,31 @@ void DisplayRect(
     assert(y1 < SCREEN_HEIGHT);
     assert(y2 < SCREEN_HEIGHT);
 
-    SET_COLUMN_ADDRESS(x1, x2);
-    SET_ROW_ADDRESS(y1, y2);
-    WRITE_RAM_COMMAND();
+    //
+    // If scrolled so that the rect wraps in OLED RAM, draw it as two rects.
+    //
+    if (height > RowsUntilWrap(y1)) {
+        uint32 rows = RowsUntilWrap(y1);
+        DisplayRect(x1, y1, width, rows, color);
+        DisplayRect(x1, y1 + rows, width, height - rows, color);
+        return;
+    }
+
+    CmdListInit(&list);
+    CmdListSetWindow(&list, x1, y1, x2, y2);
+
+    //
+    // Small rects (like text and points) go out with the window setup, all in
+    // one go.
+    //
+    if (pixels * sizeof(color) <= CmdListSpace(&list)) {
+        for (i = 0; i < pixels; i++) {
+            CmdListAddBytes(&list, (uint8 *) &color, sizeof(color), 0);
+        }
+        CmdListSend(&list);
+        return;
+    }
+    CmdListSend(&list);
 
     //
     // Optimize writes if possible
@@ -252,18 +496,11 @@ void DisplayRect(
         // faster because the transfer (via SpiXfer(..., SPI_TX_BYTE_REPEATED))
         // is done solely via DMA.
         //
-        // The only negative is that if we hog the bus for too long audio
-        // packets will be dropped while getting written to RAM.  See
+        // The transfer is splittable, so the SPI scheduler breaks it up as
+        // needed to keep from hogging the bus while audio is active.  See
         // MAX_SPI_BUS_HOGGING_BYTES.
         //
-        int bytes = pixels * sizeof(uint16);
-        while (bytes > MAX_SPI_BUS_HOGGING_BYTES) {
-            SendDataRepeatedBlocking(color & 0xFF, MAX_SPI_BUS_HOGGING_BYTES);
-            bytes -= MAX_SPI_BUS_HOGGING_BYTES;
-        }
-        if (bytes > 0) {
-            SendDataRepeatedBlocking(color & 0xFF, bytes);
-        }
+        SendDataRepeatedBlocking(color & 0xFF, pixels * sizeof(uint16));
     } else {
         //
         // Generic writes get a significant speed boost if we can write them
@@ -286,6 +523,96 @@ void DisplayRect(
     }
 }
 
+//
+// Draw solid /color/ spans (thin rects, from the line and shape rasterizers).
+//
+// As many spans (window setup plus pixels) as fit are packed into each
+// command list, so that a whole run of short spans goes out in a few bus
+// acquisitions, instead of one DisplayRect() each.
+//
+// @param spans     spans to draw.  Must be on screen.
+// @param num       number of /spans/
+// @param color     color of all spans
+//
+void DisplaySpans(
+    RECT * spans,
+    int num,
+    uint16 color
+    )
+{
+    int i, j;
+    struct CMD_LIST list;
+
+    CmdListInit(&list);
+    for (i = 0; i < num; i++) {
+        RECT r = spans[i];
+        uint32 bytes = r.width * r.height * sizeof(color);
+
+        assert(r.x >= 0 && r.x + r.width <= SCREEN_WIDTH);
+        assert(r.y >= 0 && r.y + r.height <= SCREEN_HEIGHT);
+
+        if (CMD_LIST_WINDOW_BYTES + bytes > CMD_LIST_MAX_BYTES
+            || r.height > RowsUntilWrap(r.y))
+        {
+            CmdListSend(&list);
+            DisplayRect(r.x, r.y, r.width, r.height, color);
+            continue;
+        }
+        if (CMD_LIST_WINDOW_BYTES + bytes > CmdListSpace(&list)) {
+            CmdListSend(&list);
+        }
+        CmdListSetWindow(&list, r.x, r.y, r.x + r.width - 1, r.y + r.height - 1);
+        for (j = 0; j < r.width * r.height; j++) {
+            CmdListAddBytes(&list, (uint8 *) &color, sizeof(color), 0);
+        }
+    }
+    CmdListSend(&list);
+}
+
+//
+// Start scrolling the display content up by /dy/ rows (down, if negative).
+//
+// Content doesn't move until DisplayScrollFinish(), but Display functions
+// already draw in the scrolled coordinates.  In between, draw the rows that
+// the scroll exposes (/exposed/) - they are off screen until the scroll is
+// finished, so the new content appears all at once, without tearing.
+//
+// Only the exposed rows need to be drawn, so scrolling one row sends just one
+// row of pixels instead of the whole screen.
+//
+// @param dy        rows to scroll up by.  Negative scrolls down.
+// @param exposed   output: screen rows exposed by the scroll.  Can be NULL.
+//
+// @return 0 on success, -EINVAL if more rows than DISPLAY_SPARE_ROWS would
+// be exposed.
+//
+int DisplayScrollStart(
+    int dy,
+    RECT * exposed
+    )
+{
+    int rows = dy < 0 ? -dy : dy;
+
+    if (rows > DISPLAY_SPARE_ROWS) return -EINVAL;
+
+    writeStartLine = (startLine + DISPLAY_RAM_HEIGHT + dy) % DISPLAY_RAM_HEIGHT;
+
+    if (exposed) {
+        *exposed = (RECT) {0, dy > 0 ? SCREEN_HEIGHT - rows : 0, SCREEN_WIDTH, rows};
+    }
+    return 0;
+}
+
+//
+// Show the scroll started by DisplayScrollStart().
+//
+void DisplayScrollFinish()
+{
+    if (startLine == writeStartLine) return;
+    startLine = writeStartLine;
+    SET_DISPLAY_START_LINE(startLine);
+}
+
 void DisplayFill(
     uint16 color
     )
@@ -307,19 +634,43 @@ void DisplayBitmap(
     )
 {
     int width, height;
+    uint32 bytes;
+    struct CMD_LIST list;
 
     assert(x1 < SCREEN_WIDTH);
     assert(x2 < SCREEN_WIDTH);
     assert(y1 < SCREEN_HEIGHT);
     assert(y2 < SCREEN_HEIGHT);
 
-    SET_COLUMN_ADDRESS(x1, x2);
-    SET_ROW_ADDRESS(y1, y2);
-    WRITE_RAM_COMMAND();
-
     width = x2 - x1 + 1;
     height = y2 - y1 + 1;
-    SendBytesBlocking(buf, width * height * 2, 0);
+    bytes = width * height * 2;
+
+    //
+    // If scrolled so that the bitmap wraps in OLED RAM, each column is split
+    // in two.  The pieces aren't contiguous in /buf/, so send them one column
+    // at a time.
+    //
+    if (height > RowsUntilWrap(y1)) {
+        uint32 rows = RowsUntilWrap(y1);
+        for (uint32 x = x1; x <= x2; x++) {
+            DisplayBitmap(buf, x, y1, x, y1 + rows - 1);
+            DisplayBitmap(buf + rows * 2, x, y1 + rows, x, y2);
+            buf += height * 2;
+        }
+        return;
+    }
+
+    CmdListInit(&list);
+    CmdListSetWindow(&list, x1, y1, x2, y2);
+
+    if (bytes <= CmdListSpace(&list)) {
+        CmdListAddBytes(&list, buf, bytes, 0);
+        CmdListSend(&list);
+    } else {
+        CmdListSend(&list);
+        SendBytesBlocking(buf, bytes, 0);
+    }
 }
 
     
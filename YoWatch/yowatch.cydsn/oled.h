@@ -15,6 +15,19 @@ void DisplayRect(
     uint16 color
     );
 
+void DisplaySpans(
+    RECT * spans,
+    int num,
+    uint16 color
+    );
+
+int DisplayScrollStart(
+    int dy,
+    RECT * exposed
+    );
+
+void DisplayScrollFinish();
+
 void DisplayErase();
 
 void DisplayFill(
@@ -15,40 +15,86 @@
 #include <string.h>
 #include "printf.h"
 #include "assert.h"
+#include "util.h"
+#include "spi.h"
 #include "serialram.h"
 #include "queue.h"
 
 //
 // Serial RAM buffer queue (circular)
 //
-// Queue starts with a count of QUEUE_SIZE bytes free.  
+// The queue is the whole audio serial RAM region, so its size is set at
+// BufQueueInit(), from the serial RAM found (and what other regions took).
+//
+// Queue starts with a count of size bytes free.  
 // When NO queue transactions are pending:
-//      used + free = QUEUE_SIZE.  
+//      used + free = size.  
 // When queue transactions ARE pending:
-//      used + free + pending*Bytes = QUEUE_SIZE.  
+//      used + free + pending bytes = size.  
 // Queue starts with head = tail = 0, and bytes are added to tail, which
 // increments tail.  Pending bytes are added/removed from queue when DMA
 // completes.
 //
+// Up to QUEUE_MAX_PENDING enqueues, and as many dequeues, can be pending at
+// once, so that the next block can be handed to the SPI bus while the last is
+// still waiting for it.  Each side keeps its pending transfers in order, and
+// they are only added to (or removed from) the queue in that order - so if a
+// later transfer completes first, it waits for the earlier ones.
+//
+// Space is reserved, and the pending transfer added, in a critical section,
+// but the serial RAM transfer is issued with interrupts enabled (it may start
+// the SPI bus).  While it is being issued, the side is marked /issuing/, and
+// other calls for that side (from an ISR) get -EBUSY.  So if issuing fails,
+// the transfer is still the newest, and just taken back off the list.
+//
+// A serial RAM transfer can't go past the end of the queue, or past the end
+// of the first serial RAM, so transfers are split there (see QueueXfer()).
+//
+#define QUEUE_MAX_PIECES 3
+
+struct QUEUE_PENDING {
+    uint32 bytes;
+    int * pDone;
+    int done;
+};
+
+struct QUEUE_PENDING_LIST {
+    struct QUEUE_PENDING xfers[QUEUE_MAX_PENDING];
+    uint32 first;           // oldest pending transfer
+    uint32 num;
+    uint32 end;             // queue offset after the newest pending transfer
+    int issuing;
+};
+
 struct {
-    uint32 pendingTail;
-    uint32 pendingTailBytes;
-    uint32 pendingHead;
-    uint32 pendingHeadBytes;
+    struct QUEUE_PENDING_LIST enq;
+    struct QUEUE_PENDING_LIST deq;
     uint32 tail;
     uint32 head;
     uint32 used;
     uint32 free;
+    uint32 address;
+    uint32 size;
 } bufq;
 
+//
+// Set the queue to empty, and to fill the audio serial RAM region.  Requires
+// SerialRamInit(), and that any other regions were allocated.
+//
 void BufQueueInit()
 {
-    bufq.pendingTail = 0;
-    bufq.pendingHead = 0;
-    bufq.tail = 0;
-    bufq.head = 0;
-    bufq.used = 0;
-    bufq.free = QUEUE_SIZE;
+    memset(&bufq, 0, sizeof(bufq));
+    bufq.address = SerialRamRegionAddress(SERIAL_RAM_REGION_AUDIO);
+    bufq.size = SerialRamRegionSize(SERIAL_RAM_REGION_AUDIO);
+    bufq.free = bufq.size;
+}
+
+//
+// @return size of the queue in bytes
+//
+uint32 BufQueueSize()
+{
+    return bufq.size;
 }
 
 int BufQueueFree()
@@ -61,35 +107,168 @@ int BufQueueUsed()
     return bufq.used;
 }
 
+//
+// Read or write /bytes/ of the queue, starting at /offset/ into it, as one
+// serial RAM transfer per contiguous piece.  Either all pieces are queued on
+// the SPI bus or none are, and only the last piece calls /doneCallback/ (SPI
+// transfers of a class run in order).
+//
+// Only one transfer per side of the queue is issued at a time (see
+// /issuing/), and no other transfers of the same SPI class are queued from
+// ISRs, so there is still room for all pieces once checked.
+//
+// @param xfer      SerialRamRead or SerialRamWrite
+//
+// All other params and the return value are the same as /xfer/.
+//
+static int QueueXfer(
+    int (*xfer)(uint8 *, uint32, uint32, void (*)(void *), void *, uint32),
+    uint8 * buf,
+    uint32 offset,
+    uint32 bytes,
+    void (*doneCallback)(void *),
+    void * doneArg,
+    uint32 flags
+    )
+{
+    uint32 address[QUEUE_MAX_PIECES];
+    uint32 pieceBytes[QUEUE_MAX_PIECES];
+    int pieces = 0;
+    int ret = 0;
+    int i;
+
+    assert(bytes > 0);
+
+    while (bytes > 0) {
+        uint32 n = MIN(bytes, bufq.size - offset);
+
+        assert(pieces < QUEUE_MAX_PIECES);
+        address[pieces] = bufq.address + offset;
+        n = MIN(n, SERIAL_RAM_SIZE - address[pieces] % SERIAL_RAM_SIZE);
+        pieceBytes[pieces++] = n;
+        offset = (offset + n) % bufq.size;
+        bytes -= n;
+    }
+
+    if (pieces > 1 && SpiXferQueueFree(flags) < pieces) return -ENOMEM;
+
+    for (i = 0; i < pieces; i++) {
+        int last = i == pieces - 1;
+        ret = xfer(buf, address[i], pieceBytes[i],
+            last ? doneCallback : NULL, last ? doneArg : NULL, flags);
+        if (ret != 0 && ret != -EAGAIN) {
+            // Only the first piece can fail, as there was room for all
+            assert(i == 0);
+            return ret;
+        }
+        buf += pieceBytes[i];
+    }
+    return ret;
+}
+
+//
+// Add a pending transfer of /bytes/ to the end of /list/.  Must be called in
+// a critical section.
+//
+// @return the pending transfer, or NULL if /list/ is full
+//
+static struct QUEUE_PENDING * PendingAdd(
+    struct QUEUE_PENDING_LIST * list,
+    uint32 bytes,
+    int * pDone
+    )
+{
+    struct QUEUE_PENDING * xfer;
+
+    if (list->num == QUEUE_MAX_PENDING) return NULL;
+
+    xfer = &list->xfers[(list->first + list->num) % QUEUE_MAX_PENDING];
+    xfer->bytes = bytes;
+    xfer->pDone = pDone;
+    xfer->done = 0;
+    list->num++;
+    list->end = (list->end + bytes) % bufq.size;
+
+    if (pDone != NULL) {
+        *pDone = 0;
+    }
+    return xfer;
+}
+
+//
+// Take back the newest pending transfer of /list/, which didn't get queued on
+// the SPI bus.  Must be called in a critical section.
+//
+static void PendingCancel(
+    struct QUEUE_PENDING_LIST * list
+    )
+{
+    struct QUEUE_PENDING * xfer;
+
+    assert(list->num > 0);
+    list->num--;
+    xfer = &list->xfers[(list->first + list->num) % QUEUE_MAX_PENDING];
+    list->end = (list->end + bufq.size - xfer->bytes) % bufq.size;
+}
+
+//
+// Mark pending transfer /xfer/ of /list/ done, and retire all done transfers
+// from the start of /list/, in order.
+//
+// @return bytes retired
+//
+static uint32 PendingDone(
+    struct QUEUE_PENDING_LIST * list,
+    struct QUEUE_PENDING * xfer
+    )
+{
+    uint32 bytes = 0;
+
+    xfer->done = 1;
+    while (list->num > 0 && list->xfers[list->first].done) {
+        xfer = &list->xfers[list->first];
+        bytes += xfer->bytes;
+        if (xfer->pDone) {
+            *xfer->pDone = 1;
+        }
+        list->first = (list->first + 1) % QUEUE_MAX_PENDING;
+        list->num--;
+    }
+    return bytes;
+}
+
 //
 // Completion routine for EnqueueBytes
 //
 static void EnqueueBytesDone(
-    void * pDone
+    void * xfer
     )
 {
-    bufq.tail = bufq.pendingTail;
-    bufq.used += bufq.pendingTailBytes;
-    bufq.pendingTailBytes = 0;
+    uint8 interruptState;
+    uint32 bytes;
 
-    if (pDone) {
-        *((int *) pDone) = 1;
-    }
+    // May be interrupted by an enqueue from the I2S ISR
+    interruptState = CyEnterCriticalSection();
+    bytes = PendingDone(&bufq.enq, xfer);
+    bufq.tail = (bufq.tail + bytes) % bufq.size;
+    bufq.used += bytes;
+    CyExitCriticalSection(interruptState);
 }
 
 //
 // Enqueue given buffer to SPI Serial RAM via DMA
 //
 // The buffer is added to the queue tail, but the tail will only be updated
-// once the DMA completes.
+// once the DMA completes (and once all earlier enqueues complete).
 //
-// @param buf       buffer to be enqueued to Serial RAM, mus have been created
-//                  with SerialRamGetBuf()
+// @param buf       buffer to be enqueued to Serial RAM
 // @param bytes     size in bytes of /buf/
 // @param pDone     flag that will be set when DMA completes
 //
 // @return 0 on success, or negative value on error.  -EAGAIN indicates call has
-// been queued, will be recalled when running DMA is complete.
+// been queued, will be recalled when running DMA is complete.  -EBUSY means
+// QUEUE_MAX_PENDING enqueues are already pending (or, from an ISR, that one
+// is being issued).
 //
 int EnqueueBytes(
     uint8 * buf,
@@ -98,32 +277,46 @@ int EnqueueBytes(
     )
 {
     uint8 interruptState;
+    struct QUEUE_PENDING * xfer;
     uint32 tail;
     int ret = 0;
 
     interruptState = CyEnterCriticalSection();
-
-    if (bufq.free < bytes) ret = -ENOSPC;
-
+    if (bufq.enq.issuing) {
+        ret = -EBUSY;
+    } else if (bufq.free < bytes) {
+        ret = -ENOSPC;
+    } else {
+        tail = bufq.enq.end;
+        xfer = PendingAdd(&bufq.enq, bytes, pDone);
+        if (!xfer) ret = -EBUSY;
+    }
     if (!ret) {
-        assert(bufq.free >= bytes);
-        assert(bufq.tail == bufq.pendingTail);
-        tail = bufq.tail;
-        bufq.pendingTail = (bufq.tail + bytes) % QUEUE_SIZE;
-        assert(bufq.free >= bytes);
         bufq.free -= bytes;
-        bufq.pendingTailBytes = bytes;
-
-        if (pDone != NULL) {
-            *pDone = 0;
-        }
+        bufq.enq.issuing = 1;
     }
-
     CyExitCriticalSection(interruptState);
 
     if (ret) return ret;
 
-    return SerialRamWrite(buf, tail, bytes, EnqueueBytesDone, pDone);
+    //
+    // Enqueued bytes are (currently) always audio, which takes priority
+    // over all other SPI traffic.
+    //
+    ret = QueueXfer(SerialRamWrite,
+        buf, tail, bytes, EnqueueBytesDone, xfer, SPI_CLASS(SPI_CLASS_AUDIO)
+        );
+
+    interruptState = CyEnterCriticalSection();
+    if (ret != 0 && ret != -EAGAIN) {
+        // Nothing was queued, so nothing is pending
+        PendingCancel(&bufq.enq);
+        bufq.free += bytes;
+    }
+    bufq.enq.issuing = 0;
+    CyExitCriticalSection(interruptState);
+
+    return ret;
 }
 
 //
@@ -147,31 +340,33 @@ int EnqueueBytesBlocking(
 // Completion routine for DequeueBytes
 //
 static void DequeueBytesDone(
-    void * pDone
+    void * xfer
     )
 {
-    bufq.head = bufq.pendingHead;
-    bufq.free += bufq.pendingHeadBytes;
-    bufq.pendingHeadBytes = 0;
+    uint8 interruptState;
+    uint32 bytes;
 
-    if (pDone) {
-        *((int *) pDone) = 1;
-    }
+    interruptState = CyEnterCriticalSection();
+    bytes = PendingDone(&bufq.deq, xfer);
+    bufq.head = (bufq.head + bytes) % bufq.size;
+    bufq.free += bytes;
+    CyExitCriticalSection(interruptState);
 }
 
 //
 // Dequeue given buffer from SPI Serial RAM via DMA
 //
 // The buffer is removed from the queue head, but the head will only be updated
-// once the DMA completes.
+// once the DMA completes (and once all earlier dequeues complete).
 //
-// @param buf       buffer to be dequeued to Serial RAM, mus have been created
-//                  with SerialRamGetBuf()
+// @param buf       buffer to be dequeued from Serial RAM
 // @param bytes     size in bytes of /buf/
 // @param pDone     flag that will be set when DMA completes
 //
 // @return 0 on success, or negative value on error.  -EAGAIN indicates call has
-// been queued, will be recalled when running DMA is complete.
+// been queued, will be recalled when running DMA is complete.  -EBUSY means
+// QUEUE_MAX_PENDING dequeues are already pending (or, from an ISR, that one
+// is being issued).
 //
 int DequeueBytes(
     uint8 * buf,
@@ -180,27 +375,40 @@ int DequeueBytes(
     )
 {
     uint8 interruptState;
+    struct QUEUE_PENDING * xfer;
     uint32 head;
-
-    if (bufq.used < bytes) return -ENODATA;
+    int ret = 0;
 
     interruptState = CyEnterCriticalSection();
+    if (bufq.deq.issuing) {
+        ret = -EBUSY;
+    } else if (bufq.used < bytes) {
+        ret = -ENODATA;
+    } else {
+        head = bufq.deq.end;
+        xfer = PendingAdd(&bufq.deq, bytes, pDone);
+        if (!xfer) ret = -EBUSY;
+    }
+    if (!ret) {
+        bufq.used -= bytes;
+        bufq.deq.issuing = 1;
+    }
+    CyExitCriticalSection(interruptState);
 
-    assert(bufq.used >= bytes);
-    assert(bufq.head == bufq.pendingHead);
-    head = bufq.head;
-    bufq.pendingHead = (bufq.head + bytes) % QUEUE_SIZE;
-    assert(bufq.used >= bytes);
-    bufq.used -= bytes;
-    bufq.pendingHeadBytes = bytes;
+    if (ret) return ret;
 
-    if (pDone != NULL) {
-        *pDone = 0;
-    }
+    ret = QueueXfer(SerialRamRead, buf, head, bytes, DequeueBytesDone, xfer, 0);
 
+    interruptState = CyEnterCriticalSection();
+    if (ret != 0 && ret != -EAGAIN) {
+        // Nothing was queued, so nothing is pending
+        PendingCancel(&bufq.deq);
+        bufq.used += bytes;
+    }
+    bufq.deq.issuing = 0;
     CyExitCriticalSection(interruptState);
 
-    return SerialRamRead(buf, head, bytes, DequeueBytesDone, pDone);
+    return ret;
 }
 
 //
@@ -220,3 +428,35 @@ int DequeueBytesBlocking(
     return 0;
 }
 
+//
+// Dequeue straight into a packet (e.g. a BLE notification), after the first
+// QUEUE_PACKET_HEADER_BYTES, which are left for the caller's header.  As much
+// of the queue as fits is dequeued, so the packet can be sent as is, with no
+// copy.
+//
+// @param packet        packet buffer, word aligned
+// @param packetBytes   size in bytes of /packet/, including the header
+// @param pPayloadBytes set to the bytes dequeued after the header
+// @param pDone         flag that will be set when DMA completes
+//
+// @return same as DequeueBytes()
+//
+int DequeuePacket(
+    uint8 * packet,
+    uint32 packetBytes,
+    uint32 * pPayloadBytes,
+    int * pDone
+    )
+{
+    uint32 bytes;
+    int ret;
+
+    assert(packetBytes > QUEUE_PACKET_HEADER_BYTES);
+
+    bytes = MIN(packetBytes - QUEUE_PACKET_HEADER_BYTES, bufq.used);
+    if (bytes == 0) return -ENODATA;
+
+    ret = DequeueBytes(&packet[QUEUE_PACKET_HEADER_BYTES], bytes, pDone);
+    *pPayloadBytes = (ret == 0 || ret == -EAGAIN) ? bytes : 0;
+    return ret;
+}
@@ -4,10 +4,20 @@
 #include <project.h>
 #include "serialram.h"
 
-#define QUEUE_SIZE (SERIAL_RAM_SIZE)
+//
+// Most enqueues (and, separately, dequeues) that can be in flight at once
+//
+#define QUEUE_MAX_PENDING 4
+
+//
+// Bytes at the start of each DequeuePacket() packet, left for its header
+//
+#define QUEUE_PACKET_HEADER_BYTES 4
 
 void BufQueueInit();
 
+uint32 BufQueueSize();
+
 int BufQueueFree();
 
 int BufQueueUsed();
@@ -34,4 +44,11 @@ int DequeueBytesBlocking(
     uint32 bytes
     );
 
+int DequeuePacket(
+    uint8 * packet,
+    uint32 packetBytes,
+    uint32 * pPayloadBytes,
+    int * pDone
+    );
+
 #endif
@@ -10,4 +10,9 @@ typedef struct {
     int height;
 } RECT;
 
+typedef struct {
+    int x;
+    int y;
+} POINT;
+
 #endif
@@ -15,13 +15,14 @@
 #include <string.h>
 #include "printf.h"
 #include "assert.h"
+#include "util.h"
 #include "spi.h"
 #include "serialram.h"
 
 #define SERIAL_RAM_WRITE_CMD 0x02
 #define SERIAL_RAM_READ_CMD 0x03
 
-#define COMMAND_HEADER_LEN (offsetof(struct SerialRamPdu, buf))
+#define COMMAND_HEADER_LEN 4
 
 //
 // Memory availability bitmask
@@ -29,28 +30,35 @@
 #define MEM_BITMASK(index) (1 << index)
 int availableRamBitmask = -1;
 
-struct SerialRamPdu {
-    uint8 command[4];
-    uint8 buf[SERIAL_RAM_BUFSIZE];
-} serialRamBufArray[SERIAL_RAM_NUM_BUFS];
+uint8 serialRamBufArray[SERIAL_RAM_NUM_BUFS][SERIAL_RAM_BUFSIZE];
 
-static struct SerialRamPdu * SetCommand(
-    uint8 * buf,
+//
+// Serial RAM regions (see SerialRamRegionAlloc()).  Regions other than audio
+// are allocated down from the top of serial RAM, and audio gets everything
+// below them.
+//
+static struct {
+    uint32 address;
+    uint32 size;
+} regions[SERIAL_RAM_MAX_REGIONS];
+static uint32 regionsBottom = 0;
+
+//
+// Fill in the command header (command byte and 24-bit address) that is sent
+// ahead of the payload.  See SpiXferWithHeader().
+//
+static void SetCommand(
+    uint8 header[COMMAND_HEADER_LEN],
     uint32 address,
     uint8 command
     )
 {
-    struct SerialRamPdu * pcmdbuf;
-
     assert((address & 0xFF000000) == 0);
 
-    pcmdbuf = (struct SerialRamPdu *) (buf - COMMAND_HEADER_LEN);
-    pcmdbuf->command[0] = command;
-    pcmdbuf->command[1] = (address >> 16) & 0xFF;
-    pcmdbuf->command[2] = (address >>  8) & 0xFF;
-    pcmdbuf->command[3] = (address >>  0) & 0xFF;
-
-    return pcmdbuf;
+    header[0] = command;
+    header[1] = (address >> 16) & 0xFF;
+    header[2] = (address >>  8) & 0xFF;
+    header[3] = (address >>  0) & 0xFF;
 }
 
 //
@@ -83,10 +91,9 @@ static uint32 AddressToSlaveSelect(
 //  
 // Serial RAM Read
 //
-// For efficiency, we use the same buffer for both send and receive.  This
-// means that garbage goes out on the wire, which is okay because only the
-// command portion is used by the part (the incoming data to the serial RAM is
-// ignored for the read command).
+// The command is sent as the SPI transaction header, so the payload goes
+// straight into /buf/ (dummy bytes go out on the wire during the payload,
+// which the part ignores for the read command).
 //
 static int Read(
     uint8 * buf,
@@ -98,11 +105,14 @@ static int Read(
     )
 {
     uint32 ss = AddressToSlaveSelect(address);
-    struct SerialRamPdu * pcmdbuf = SetCommand(buf, address, SERIAL_RAM_READ_CMD);
-    return SpiXfer(
-        (uint8 *) pcmdbuf,
-        (uint8 *) pcmdbuf,
-        bytes + COMMAND_HEADER_LEN,
+    uint8 header[COMMAND_HEADER_LEN];
+    SetCommand(header, address, SERIAL_RAM_READ_CMD);
+    return SpiXferWithHeader(
+        header,
+        COMMAND_HEADER_LEN,
+        NULL,
+        buf,
+        bytes,
         ss,
         doneCallback,
         doneArg,
@@ -123,11 +133,14 @@ static int Write(
     )
 {
     uint32 ss = AddressToSlaveSelect(address);
-    struct SerialRamPdu * pcmdbuf = SetCommand(buf, address, SERIAL_RAM_WRITE_CMD);
-    return SpiXfer(
-        (uint8 *) pcmdbuf,
+    uint8 header[COMMAND_HEADER_LEN];
+    SetCommand(header, address, SERIAL_RAM_WRITE_CMD);
+    return SpiXferWithHeader(
+        header,
+        COMMAND_HEADER_LEN,
+        buf,
         NULL,
-        bytes + COMMAND_HEADER_LEN,
+        bytes,
         ss,
         doneCallback,
         doneArg,
@@ -135,6 +148,12 @@ static int Write(
         );
 }
 
+//
+// Blocking read or write.  Unlike a single transfer, which wraps around
+// within one serial RAM, this continues into the second serial RAM, so it
+// works across regions that span both.  It is also split into transfers of
+// at most MAX_SPI_BUS_HOGGING_BYTES, so any size can be passed.
+//
 static int BlockingReadWrite(
     int (*call)(uint8 *, uint32, uint32, void (*)(void *), void *, uint32),
     uint8 * buf,
@@ -143,15 +162,26 @@ static int BlockingReadWrite(
     )
 {
     int ret, done;
-    ret = call(buf, address, bytes, NULL, &done, SPI_DONE_CALLBACK);
-    if (ret != 0 && ret != -EAGAIN) return ret;
-    while (!done);
+
+    while (bytes > 0) {
+        uint32 n = MIN(bytes, SERIAL_RAM_SIZE - address % SERIAL_RAM_SIZE);
+        n = MIN(n, MAX_SPI_BUS_HOGGING_BYTES);
+
+        ret = call(buf, address, n, NULL, &done, SPI_DONE_CALLBACK);
+        if (ret != 0 && ret != -EAGAIN) return ret;
+        while (!done);
+
+        buf += n;
+        address += n;
+        bytes -= n;
+    }
     return 0;
 }
 
 //
 // Fill buf with a randomish mix of numbers.  Write it then read back from
-// memory and verify
+// memory and verify.  What was in memory is put back afterwards, so that
+// detecting memory doesn't corrupt it.
 //
 // @param address   where to read/wrtie mem
 // @param skipVal   amount to skip when generating randomish numbers.  Any old
@@ -168,13 +198,16 @@ static int memExists(
     uint8 x;
     uint8 * pbuf1 = SerialRamGetBuf(0);
     uint8 * pbuf2 = SerialRamGetBuf(1);
+    uint8 * saved = SerialRamGetBuf(2);
 
     for (i = 0, x = 0; i < SERIAL_RAM_BUFSIZE; i++, x += skipVal) {
         pbuf1[i] = x;
     }
     memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
+    BlockingReadWrite(Read, saved, address, SERIAL_RAM_BUFSIZE);
     BlockingReadWrite(Write, pbuf1, address, SERIAL_RAM_BUFSIZE);
     BlockingReadWrite(Read, pbuf2, address, SERIAL_RAM_BUFSIZE);
+    BlockingReadWrite(Write, saved, address, SERIAL_RAM_BUFSIZE);
     for (i = 0, x = 0; i < SERIAL_RAM_BUFSIZE; i++, x += skipVal) {
         if (pbuf2[i] != x) break;
     }
@@ -210,17 +243,80 @@ uint32 SerialRamTotalSize()
 
 //
 // Determine serial RAM address size by detecting if we have 0, 1, or 2 serial
-// RAMs.
+// RAMs.  All of it starts out as the audio region.
 //
 void SerialRamInit()
 {
     int mem0;
     int mem1;
 
+    // Probe both RAMs, even if an earlier probe found only one
+    availableRamBitmask = -1;
     mem0 = memExists(0, 0x33) ? MEM_BITMASK(0) : 0;
     mem1 = memExists(SERIAL_RAM_SIZE, 0x55) ? MEM_BITMASK(1) : 0;
 
     availableRamBitmask = mem0 | mem1;
+
+    memset(regions, 0, sizeof(regions));
+    regionsBottom = SerialRamTotalSize();
+    regions[SERIAL_RAM_REGION_AUDIO].size = regionsBottom;
+}
+
+//
+// Allocate a serial RAM region, from the audio region.  The audio region is
+// never made smaller than SERIAL_RAM_AUDIO_MIN_SIZE.  Regions are addressed
+// like the rest of serial RAM, and may span both serial RAMs.  Requires
+// SerialRamInit() was run.
+//
+// @param region    SERIAL_RAM_REGION_*, other than audio
+// @param size      bytes
+//
+// @return 0 on success (including if /region/ was already allocated at
+// /size/), -EBUSY if /region/ was already allocated at another size, or
+// -ENOMEM if there's not enough serial RAM to spare.
+//
+int SerialRamRegionAlloc(
+    int region,
+    uint32 size
+    )
+{
+    assert(availableRamBitmask >= 0);
+    assert(region > SERIAL_RAM_REGION_AUDIO && region < SERIAL_RAM_MAX_REGIONS);
+
+    if (regions[region].size) {
+        return regions[region].size == size ? 0 : -EBUSY;
+    }
+    if (size == 0 || regionsBottom < SERIAL_RAM_AUDIO_MIN_SIZE + size) {
+        return -ENOMEM;
+    }
+
+    regionsBottom -= size;
+    regions[region].address = regionsBottom;
+    regions[region].size = size;
+    regions[SERIAL_RAM_REGION_AUDIO].size = regionsBottom;
+    return 0;
+}
+
+//
+// @return serial RAM address of /region/
+//
+uint32 SerialRamRegionAddress(
+    int region
+    )
+{
+    assert(region >= 0 && region < SERIAL_RAM_MAX_REGIONS);
+    return regions[region].address;
+}
+
+//
+// @return size of /region/ in bytes, or 0 if it's not allocated
+//
+uint32 SerialRamRegionSize(
+    int region
+    )
+{
+    assert(region >= 0 && region < SERIAL_RAM_MAX_REGIONS);
+    return regions[region].size;
 }
 
 //
@@ -228,40 +324,48 @@ void SerialRamInit()
 //
 // @param   index   Index of buf to get.  SERIAL_RAM_NUM_BUFS bufs are available.
 //
-// @return  Buffer that can be used to read/write to/from serial RAM.  Size of buf is
-// SERIAL_RAM_BUFSIZE.
+// @return  General purpose SERIAL_RAM_BUFSIZE buffer.
 //
-// Bufs are limited and have specific purposes - so you have to keep track of
-// who is using each buf.
+// Serial RAM reads/writes can use any buffer - these are just handy shared
+// scratch bufs.  Bufs are limited and have specific purposes - so you have to
+// keep track of who is using each buf.
 //
 uint8 * SerialRamGetBuf(
     int index
     )
 {
     assert(index < SERIAL_RAM_NUM_BUFS);
-    return serialRamBufArray[index].buf;
+    return serialRamBufArray[index];
 }
   
 //
 // Write given buf to serial RAM.  Nonblocking.
 //
-// @param buf           Buffer to write, from calling SerialRamGetBuf()
+// A transfer stays in one serial RAM: past the end of it, it wraps around to
+// the start of the same serial RAM.
+//
+// @param buf           Buffer to write (any buffer)
 // @param address       Address to write to.
-// @param bytes         Number of bytes of buf to write
+// @param bytes         Number of bytes of buf to write, at most
+//                      MAX_SPI_BUS_HOGGING_BYTES (or while audio is idle,
+//                      MAX_SPI_IDLE_HOGGING_BYTES, see SpiXfer())
 // @param doneCallback  Function to call after transaction completes
 // @param doneArg       Arg to pass to doneCallback
+// @param flags         SpiXfer() flags, typically just the SPI_CLASS()
 //
-// @return 0 or -EAGAIN on success, else negative error.  See SpiXfer() return values.
+// @return 0 or -EAGAIN on success, else negative error (-EINVAL if /bytes/ is
+// too big).  See SpiXfer() return values.
 //
 int SerialRamWrite(
     uint8 * buf,
     uint32 address,
     uint32 bytes,
     void (*doneCallback)(void *),
-    void * doneArg
+    void * doneArg,
+    uint32 flags
     )
 {
-    return Write(buf, address, bytes, doneCallback, doneArg, 0);
+    return Write(buf, address, bytes, doneCallback, doneArg, flags);
 }
 
 //
@@ -288,10 +392,11 @@ int SerialRamRead(
     uint32 address,
     uint32 bytes,
     void (*doneCallback)(void *),
-    void * doneArg
+    void * doneArg,
+    uint32 flags
     )
 {
-    return Read(buf, address, bytes, doneCallback, doneArg, 0);
+    return Read(buf, address, bytes, doneCallback, doneArg, flags);
 }
 
 //
@@ -307,19 +412,25 @@ int SerialRamReadBlocking(
 }
 
 //
-// Fill all of RAM with one byte value
+// Fill a region of RAM with one byte value
+//
+// @param region    SERIAL_RAM_REGION_* to fill
+// @param val       value to fill with
 //
 int SerialRamFillBlocking(
+    int region,
     uint8 val
     )
 {
     uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint32 address = SerialRamRegionAddress(region);
+    uint32 size = SerialRamRegionSize(region);
     int ret;
-    int i;
+    uint32 i;
 
     memset(pbuf1, val, SERIAL_RAM_BUFSIZE);
-    for (i = 0; i < SERIAL_RAM_SIZE; i += SERIAL_RAM_BUFSIZE) {
-        ret = SerialRamWriteBlocking(pbuf1, i, SERIAL_RAM_BUFSIZE);
+    for (i = 0; i < size; i += SERIAL_RAM_BUFSIZE) {
+        ret = SerialRamWriteBlocking(pbuf1, address + i, MIN(size - i, SERIAL_RAM_BUFSIZE));
         if (ret) return ret;
     }
     return 0;
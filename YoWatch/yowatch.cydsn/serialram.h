@@ -2,13 +2,35 @@
 #define _SERIALRAM_H_
 
 #include <project.h>
+#include "spi.h"
 
-#define SERIAL_RAM_BUFSIZE 256
+#define SERIAL_RAM_BUFSIZE AUDIO_BLOCK_BYTES
 
 #define SERIAL_RAM_SIZE (128 * 1024)
 
 #define SERIAL_RAM_NUM_BUFS 3
 
+//
+// Serial RAM is shared out as regions.  Audio gets whatever the other
+// regions don't use, but at least SERIAL_RAM_AUDIO_MIN_SIZE.
+//
+enum {
+    SERIAL_RAM_REGION_AUDIO,
+    SERIAL_RAM_REGION_FRAMEBUF,
+    SERIAL_RAM_REGION_MSG_STORE,
+    SERIAL_RAM_MAX_REGIONS
+};
+
+//
+// Audio is queued in serial RAM while it waits to go out over BLE, so the
+// audio region must hold as much audio as BLE can fall behind by before
+// blocks are dropped: AUDIO_QUEUE_LATENCY_MSECS.  At 32000 bytes, this still
+// leaves room on one serial RAM for the framebuffer and message store.
+//
+#define AUDIO_QUEUE_LATENCY_MSECS 1000
+#define SERIAL_RAM_AUDIO_MIN_SIZE \
+    (AUDIO_BYTES_PER_SEC * AUDIO_QUEUE_LATENCY_MSECS / 1000)
+
 uint32 SerialRamMemExists(
     uint32 memIndex
     );
@@ -17,11 +39,26 @@ uint32 SerialRamTotalSize();
 
 void SerialRamInit();
 
+int SerialRamRegionAlloc(
+    int region,
+    uint32 size
+    );
+
+uint32 SerialRamRegionAddress(
+    int region
+    );
+
+uint32 SerialRamRegionSize(
+    int region
+    );
+
 //
 // SerialRamGetBuf()
 //
 // @param   index   Index of buf to get.  SERIAL_RAM_NUM_BUFS bufs are available.
 //
+// Scratch bufs only - serial RAM reads/writes can use any buffer.
+//
 
 uint8 * SerialRamGetBuf(
     int index
@@ -32,7 +69,8 @@ int SerialRamWrite(
     uint32 address, 
     uint32 bytes, 
     void (*doneCallback)(void *),
-    void * doneArg
+    void * doneArg,
+    uint32 flags
     );
 
 int SerialRamWriteBlocking(
@@ -46,7 +84,8 @@ int SerialRamRead(
     uint32 address, 
     uint32 bytes, 
     void (*doneCallback)(void *),
-    void * doneArg
+    void * doneArg,
+    uint32 flags
     );
 
 int SerialRamReadBlocking(
@@ -56,6 +95,7 @@ int SerialRamReadBlocking(
     );
 
 int SerialRamFillBlocking(
+    int region,
     uint8 val
     );
 
@@ -15,6 +15,7 @@
 #include <string.h>
 #include "printf.h"
 #include "assert.h"
+#include "util.h"
 #include "spi.h"
 
 //
@@ -22,20 +23,38 @@
 // (unless the user is sure no one else is using it).
 //
 // When a SPI DMA transaction can not be completed because the bus is locked,
-// the transaction is queued, and performed immediately after the current
-// transaction finishes.
+// the transaction is queued (by class), and performed after the current
+// transaction finishes.  Higher priority classes are always run first.
 //
 // The bus must not be overutilized for a period greater than the queue allows.
 //
 int spiBusLocked = 0;
 int spiRxIsrCalls = 0;
 int spiTxIsrCalls = 0;
+int spiPioXfers = 0;
 
 //
-// Circular buffer of queue descriptors.  To simplify queueing, one dummy
-// descriptor is between head and tail.  head == tail means empty,
-// (tail + 1 % NUM) == head means full.
+// Bytes sent on the bus (headers and payloads, by DMA or PIO), for measuring
+// what a drawing path costs the bus shared with audio.
+//
+uint32 spiBusBytes = 0;
+
+//
+// PIO threshold, see SPI_PIO_MAX_BYTES.
+//
+uint32 spiPioMaxBytes = SPI_PIO_MAX_BYTES;
+
+//
+// Internal flag: the transaction is a bus grant (see SpiAcquireBus()), that
+// transfers nothing, and just hands the locked bus over to the CPU.
 //
+#define SPI_BUS_GRANT (1 << 4)
+
+//
+// Set while the audio stream is running.  See SpiBurstBytes().
+//
+int spiAudioActive = 0;
+
 struct QUEUED_DESCRIPTOR {
     uint8 * sendBuf;
     uint8 * recvBuf;
@@ -44,13 +63,101 @@ struct QUEUED_DESCRIPTOR {
     void (*doneCallback)(void *);
     void * doneArg;
     uint32 flags;
+    uint32 seq;
+    uint8 header[MAX_SPI_HEADER_BYTES];
+    uint32 headerBytes;
 };
 
+//
+// Per class circular buffer of queue descriptors.  To simplify queueing, one
+// dummy descriptor is between head and tail.  head == tail means empty,
+// (tail + 1 % NUM) == head means full.
+//
+// A splittable transaction that was preempted between chunks by a higher
+// priority class is parked in /preempted/, and resumes before anything else
+// in its class.
+//
 struct QUEUED_DESCRIPTORS {
     struct QUEUED_DESCRIPTOR queue[NUM_SPI_QDS];
     uint32 head;
     uint32 tail;
-} queuedDescriptors;
+    struct QUEUED_DESCRIPTOR preempted;
+    int isPreempted;
+} queuedDescriptors[NUM_SPI_CLASSES];
+
+//
+// Order in which class queues are serviced.
+//
+static const uint8 classPriorityOrder[NUM_SPI_CLASSES] = {
+    SPI_CLASS_AUDIO,
+    SPI_CLASS_NORMAL,
+    SPI_CLASS_DISPLAY,
+};
+
+//
+// Currently running transaction.  /bytes/ is the number of bytes left to run
+// (including the running chunk of /runningChunkBytes/ bytes).
+//
+static struct QUEUED_DESCRIPTOR running;
+static uint32 runningChunkBytes;
+
+//
+// The TX and RX DMAs each have two descriptors, which are ping-ponged: the
+// running chunk uses descriptor /runningDescr/, and while it runs, the chunk
+// that will run next is programmed and validated in the other descriptor (it
+// is "staged").  When the running chunk completes, starting the staged one
+// only needs a slave select switch and a channel enable - no descriptor
+// reprogramming in the completion ISR.
+//
+// The staged chunk is identified by its transaction sequence number and the
+// bytes left in the transaction, so that if the scheduling decision changes
+// (for example, audio gets queued after staging), the stale staged
+// descriptor is just reprogrammed.
+//
+static int runningDescr = 0;
+static struct {
+    int valid;
+    uint32 seq;
+    uint32 bytes;
+    uint32 chunk;
+} staged;
+static uint32 spiXferSeq = 0;
+
+//
+// Set up both descriptors of each SPI DMA channel, as they are ping-ponged.
+// TopDesign only configures descriptor 0, so the rest of the setup is done
+// here, the same for both: byte elements, one per FIFO level trigger, and the
+// descriptor is invalidated when done.  Only the RX DMA interrupts.  The
+// per-chunk settings (addresses, counts, and the TX source increment) are
+// programmed by ProgramDescriptors().
+//
+// Call once, after the DMA channels are initialized.
+//
+void SpiInit()
+{
+    int descr;
+
+    for (descr = 0; descr < 2; descr++) {
+        SpiTxDma_SetDataElementSize(descr, CYDMA_BYTE);
+        SpiTxDma_SetSrcDstTransferWidth(descr, CYDMA_ELEMENT_WORD);
+        SpiTxDma_SetTransferMode(descr, CYDMA_SINGLE_DATA_ELEMENT);
+        SpiTxDma_SetTriggerType(descr, CYDMA_LEVEL_FOUR);
+        SpiTxDma_SetAddressIncrement(descr, CYDMA_INC_SRC_ADDR);
+        SpiTxDma_SetPostCompletionActions(descr, CYDMA_INVALIDATE);
+
+        SpiRxDma_SetDataElementSize(descr, CYDMA_BYTE);
+        SpiRxDma_SetSrcDstTransferWidth(descr, CYDMA_WORD_ELEMENT);
+        SpiRxDma_SetTransferMode(descr, CYDMA_SINGLE_DATA_ELEMENT);
+        SpiRxDma_SetTriggerType(descr, CYDMA_LEVEL_FOUR);
+        SpiRxDma_SetAddressIncrement(descr, CYDMA_INC_DST_ADDR);
+        SpiRxDma_SetPostCompletionActions(descr, CYDMA_INVALIDATE | CYDMA_GENERATE_IRQ);
+    }
+}
+
+//
+// Sent out repeatedly for receive transactions that have nothing to send.
+//
+static uint8 spiDummyByte = 0xFF;
 
 void SpiDoneCallback(
     void * pDone
@@ -61,11 +168,254 @@ void SpiDoneCallback(
     }
 }
 
+//
+// Mark the audio stream as active or idle.
+//
+// While audio is idle, splittable transactions run unbroken (up to
+// MAX_SPI_XFER_BYTES).  While active, they are chunked so that audio
+// transactions never wait longer than MAX_SPI_BUS_HOGGING_BYTES of bus time.
+//
+void SpiSetAudioActive(
+    int active
+    )
+{
+    spiAudioActive = active;
+}
+
+//
+// @return number of audio class bytes waiting for the bus.  Must be called in
+// a critical section.
+//
+static uint32 AudioBytesQueued()
+{
+    struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[SPI_CLASS_AUDIO];
+    uint32 bytes = 0;
+    uint32 i;
+
+    for (i = q->head; i != q->tail; i = (i + 1) % NUM_SPI_QDS) {
+        bytes += q->queue[i].bytes;
+    }
+    return bytes;
+}
+
+//
+// @return the largest chunk that a splittable transaction of /class/ may run
+// as, right now.
+//
+// The audio slack is the part of the MAX_SPI_BUS_HOGGING_BYTES budget not
+// already taken by audio transactions that are waiting for the bus.  A chunk
+// started now must fit in the slack, so that audio transactions queued behind
+// it still meet their deadline.
+//
+static uint32 SpiBurstBytes(
+    uint32 class
+    )
+{
+    uint32 queued;
+
+    if (!spiAudioActive || class == SPI_CLASS_AUDIO) {
+        return MAX_SPI_XFER_BYTES;
+    }
+
+    queued = AudioBytesQueued();
+    if (queued + MIN_SPI_BURST_BYTES >= MAX_SPI_BUS_HOGGING_BYTES) {
+        return MIN_SPI_BURST_BYTES;
+    }
+    return MAX_SPI_BUS_HOGGING_BYTES - queued;
+}
+
+//
+// Dequeue the next transaction to run, in class priority order.  Must be
+// called in a critical section.
+//
+// @return 1 if a transaction was dequeued into /qd/, 0 if all queues are
+// empty.
+//
+static int DequeueNext(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    int i;
+
+    for (i = 0; i < NUM_SPI_CLASSES; i++) {
+        struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[classPriorityOrder[i]];
+        if (q->isPreempted) {
+            *qd = q->preempted;
+            q->isPreempted = 0;
+            return 1;
+        }
+        if (q->head != q->tail) {
+            *qd = q->queue[q->head];
+            q->head = (q->head + 1) % NUM_SPI_QDS;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// @return bytes to run in the next chunk of /qd/.  Splittable transactions
+// are run in chunks sized by SpiBurstBytes(), all other transactions are run
+// in one go (their size was checked by XferSizeValid()).
+//
+static uint32 ChunkBytes(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    if (qd->flags & SPI_SPLITTABLE) {
+        return MIN(qd->bytes, SpiBurstBytes(SPI_GET_CLASS(qd->flags)));
+    }
+    return qd->bytes;
+}
+
+//
+// @return 1 if a locked transaction of /bytes/ with /flags/ can be run: at
+// most MAX_SPI_XFER_BYTES, and, unless SPI_SPLITTABLE, as it can't be broken
+// up to let audio through, at most MAX_SPI_BUS_HOGGING_BYTES while audio is
+// active (MAX_SPI_IDLE_HOGGING_BYTES while idle).
+//
+static int XferSizeValid(
+    uint32 bytes,
+    uint32 flags
+    )
+{
+    uint32 maxUnsplit = spiAudioActive ? MAX_SPI_BUS_HOGGING_BYTES : MAX_SPI_IDLE_HOGGING_BYTES;
+
+    if (bytes > MAX_SPI_XFER_BYTES) return 0;
+    if (!(flags & SPI_SPLITTABLE) && bytes > maxUnsplit) return 0;
+    return 1;
+}
+
+//
+// Advance /qd/ past a completed chunk of /bytes/ bytes.
+//
+static void AdvanceDescriptor(
+    struct QUEUED_DESCRIPTOR * qd,
+    uint32 bytes
+    )
+{
+    qd->bytes -= bytes;
+    if (!(qd->flags & SPI_TX_BYTE_REPEATED)) {
+        qd->sendBuf += bytes;
+    }
+    if (qd->recvBuf) {
+        qd->recvBuf += bytes;
+    }
+}
+
+//
+// Predict what DequeueNext() will return when the running chunk completes,
+// without dequeueing anything.  The rest of the running transaction (if any)
+// competes as if it were already preempted.  Must be called in a critical
+// section.
+//
+// @return 1 if there is a next transaction (copied to /qd/), else 0.
+//
+static int PeekNext(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    int i;
+    int runningClass = SPI_GET_CLASS(running.flags);
+    int runningHasMore = running.bytes > runningChunkBytes;
+
+    for (i = 0; i < NUM_SPI_CLASSES; i++) {
+        int class = classPriorityOrder[i];
+        struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[class];
+        if (runningHasMore && class == runningClass) {
+            *qd = running;
+            AdvanceDescriptor(qd, runningChunkBytes);
+            return 1;
+        }
+        if (q->isPreempted) {
+            *qd = q->preempted;
+            return 1;
+        }
+        if (q->head != q->tail) {
+            *qd = q->queue[q->head];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// @return number of payload bytes of /qd/ that are written to the TX FIFO by
+// the CPU (along with the header) before the DMAs start.  See
+// SpiStartWithHeader().
+//
+static uint32 TxPrefillBytes(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    if (qd->headerBytes == 0 || !qd->recvBuf) return 0;
+    return MIN(qd->bytes, SPI_1_SPI_UART_FIFO_SIZE - qd->headerBytes);
+}
+
+//
+// Program (and validate) DMA descriptor /descr/ for a chunk of /chunk/ bytes
+// of /qd/.
+//
+static void ProgramDescriptors(
+    int descr,
+    struct QUEUED_DESCRIPTOR * qd,
+    uint32 chunk
+    )
+{
+    int repeated = qd->flags & SPI_TX_BYTE_REPEATED;
+    uint32 prefill = TxPrefillBytes(qd);
+
+    if (chunk > prefill) {
+        SpiTxDma_SetAddressIncrement(descr, repeated ? CYDMA_INC_NONE : CYDMA_INC_SRC_ADDR);
+        SpiTxDma_SetSrcAddress(descr, qd->sendBuf + (repeated ? 0 : prefill));
+        SpiTxDma_SetDstAddress(descr, (void *) SPI_1_TX_FIFO_WR_PTR);
+        SpiTxDma_SetNumDataElements(descr, chunk - prefill);
+        SpiTxDma_ValidateDescriptor(descr);
+    }
+
+    if (qd->recvBuf) {
+        SpiRxDma_SetSrcAddress(descr, (void *) SPI_1_RX_FIFO_RD_PTR);
+        SpiRxDma_SetDstAddress(descr, qd->recvBuf);
+        SpiRxDma_SetNumDataElements(descr, chunk);
+        SpiRxDma_ValidateDescriptor(descr);
+    }
+}
+
+//
+// Stage the chunk that will run after the running one, in the idle
+// descriptor.  Nothing is done if it is already staged.  Must be called in a
+// critical section, while the bus is locked.
+//
+static void StageNext()
+{
+    struct QUEUED_DESCRIPTOR qd;
+    uint32 chunk;
+
+    if (!PeekNext(&qd) || (qd.flags & SPI_BUS_GRANT)) {
+        staged.valid = 0;
+        return;
+    }
+
+    chunk = ChunkBytes(&qd);
+    if (staged.valid && staged.seq == qd.seq && staged.bytes == qd.bytes
+        && staged.chunk == chunk)
+    {
+        return;
+    }
+
+    ProgramDescriptors(!runningDescr, &qd, chunk);
+    staged.valid = 1;
+    staged.seq = qd.seq;
+    staged.bytes = qd.bytes;
+    staged.chunk = chunk;
+}
+
 //
 // Lock the SPI bus to perform an atomic SPI DMA transaction.
 //
-// If lock is unavailable, transaction /qd/ is queued, and will performed (in
-// FIFO order) once the current SPI DMA transaction completes.
+// If lock is unavailable, transaction /qd/ is queued on its class queue, and
+// will be performed once the current SPI DMA transaction (or chunk of it)
+// completes and no higher class transactions are waiting.
 //
 // /qd/ must be valid.
 //
@@ -77,6 +427,7 @@ int LockSpiBus(struct QUEUED_DESCRIPTOR * qd)
     int wasLocked;
     int full = 0;
     uint8 interruptState;
+    struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[SPI_GET_CLASS(qd->flags)];
 
     interruptState = CyEnterCriticalSection();
 
@@ -86,10 +437,11 @@ int LockSpiBus(struct QUEUED_DESCRIPTOR * qd)
 
     // Queue descriptor if DMA was locked
     if (wasLocked) {
-        full = ((queuedDescriptors.tail + 1) % NUM_SPI_QDS) == queuedDescriptors.head;
+        full = ((q->tail + 1) % NUM_SPI_QDS) == q->head;
         if (!full) {
-            queuedDescriptors.queue[queuedDescriptors.tail] = *qd;
-            queuedDescriptors.tail = (queuedDescriptors.tail + 1) % NUM_SPI_QDS;
+            q->queue[q->tail] = *qd;
+            q->tail = (q->tail + 1) % NUM_SPI_QDS;
+            StageNext();
         }
     }
 
@@ -98,11 +450,18 @@ int LockSpiBus(struct QUEUED_DESCRIPTOR * qd)
     return full ? -ENOMEM : wasLocked;
 }
 
+static void SpiXferStart(
+    struct QUEUED_DESCRIPTOR * qd
+    );
+static void SpiChunkStart();
+
 //
 // Unlocks SPI bus from a previous LockSpiBus() call.
 //
-// If previous transactions were queued, causes next transaction to be started
-// (and keeps bus locked).
+// If the running transaction still has chunks left, it is parked as
+// preempted, so that any higher class transactions get to run first.  Then,
+// if transactions are queued, causes next transaction to be started (and
+// keeps bus locked).
 //
 // Intended to be called from SPI completion interrupt.
 //
@@ -110,50 +469,59 @@ void UnlockSpiBus()
 {
     uint8 interruptState;
     struct QUEUED_DESCRIPTOR qd;
-    struct QUEUED_DESCRIPTOR * pqd = NULL;
+    int dequeued = 0;
+    int resume = 0;
 
     interruptState = CyEnterCriticalSection();
 
-    // If queue is not empty, dequeue descriptor
-    if (spiBusLocked && queuedDescriptors.head != queuedDescriptors.tail) {
-        qd = queuedDescriptors.queue[queuedDescriptors.head];
-        pqd = &qd;
-        queuedDescriptors.head = (queuedDescriptors.head + 1) % NUM_SPI_QDS;
-        // DMA stays locked
+    if (spiBusLocked) {
+        if (running.bytes > 0) {
+            struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[SPI_GET_CLASS(running.flags)];
+            assert(!q->isPreempted);
+            q->preempted = running;
+            q->isPreempted = 1;
+        }
+        dequeued = DequeueNext(&qd);
+        if (!dequeued) {
+            spiBusLocked = 0;
+        }
+        // DMA stays locked if dequeued
     } else {
-        pqd = NULL;
-        spiBusLocked = 0;
+        // Unlocked xfer (see SpiXferUnlocked()) just runs to completion
+        resume = running.bytes > 0;
     }
 
     CyExitCriticalSection(interruptState);
 
     // If descriptor was dequeued, run it
-    if (pqd) {
-        SpiXferUnlocked(
-            pqd->sendBuf, 
-            pqd->recvBuf, 
-            pqd->bytes, 
-            pqd->ss, 
-            pqd->doneCallback, 
-            pqd->doneArg, 
-            pqd->flags
-            );
+    if (dequeued) {
+        SpiXferStart(&qd);
+    } else if (resume) {
+        SpiChunkStart();
     }
 }
 
+//
+// A chunk of the running transaction has completed.  Advance past it, and
+// call the done callback if the whole transaction is done.
+//
+static void SpiChunkDone()
+{
+    AdvanceDescriptor(&running, runningChunkBytes);
+    if (running.bytes == 0 && running.doneCallback) {
+        running.doneCallback(running.doneArg);
+    }
+    UnlockSpiBus();
+}
+
 //
 // SPI TX ISR - data sent completion interrupt
 //
-void ((*spiDoneCallback)(void *));
-void * spiDoneArg;
 CY_ISR(SpiTxIsr)
 {
     SPI_1_ClearMasterInterruptSource(SPI_1_GetMasterInterruptSourceMasked());
     spiTxIsrCalls++;
-    if (spiDoneCallback) {
-        spiDoneCallback(spiDoneArg);
-    }
-    UnlockSpiBus();
+    SpiChunkDone();
 }
 
 //
@@ -162,27 +530,294 @@ CY_ISR(SpiTxIsr)
 void SpiRxDmaIsr(void)
 {
     spiRxIsrCalls++;
-    if (spiDoneCallback) {
-        spiDoneCallback(spiDoneArg);
+    SpiChunkDone();
+}
+
+//
+// Start the running transaction, which has a header.
+//
+// The header is not part of the DMA'd payload - instead, the CPU writes it
+// directly to the TX FIFO, followed by the DMA'd payload.  The slave select
+// stays asserted as long as the FIFO doesn't run dry, so the device sees one
+// continuous transaction.
+//
+// For receive transactions, the bytes received during the header must be
+// thrown away before the RX DMA starts.  To keep the FIFO from running dry
+// while that happens, the start of the payload is also written by the CPU
+// (see TxPrefillBytes()).  This is all done in a critical section, as an
+// interrupt here could let the FIFO run dry.
+//
+static void SpiStartWithHeader()
+{
+    uint8 interruptState;
+    uint32 prefill = TxPrefillBytes(&running);
+    int repeated = running.flags & SPI_TX_BYTE_REPEATED;
+    uint32 i;
+
+    interruptState = CyEnterCriticalSection();
+
+    SPI_1_SpiUartPutArray(running.header, running.headerBytes);
+
+    if (running.recvBuf) {
+        SpiTxIsr_Disable();
+        for (i = 0; i < prefill; i++) {
+            SPI_1_SpiUartWriteTxData(running.sendBuf[repeated ? 0 : i]);
+        }
+        while (SPI_1_SpiUartGetRxBufferSize() < running.headerBytes);
+        for (i = 0; i < running.headerBytes; i++) {
+            (void) SPI_1_SpiUartReadRxData();
+        }
+        SpiRxDma_ChEnable();
+        if (running.bytes > prefill) {
+            SpiTxDma_ChEnable();
+        }
+    } else {
+        SpiTxIsr_Enable();
+        SpiTxDma_ChEnable();
     }
-    UnlockSpiBus();
+
+    CyExitCriticalSection(interruptState);
+}
+
+//
+// Start the next chunk of the running transaction.
+//
+// If the chunk was staged, its descriptors are already valid, otherwise they
+// are programmed now.  Either way, the chunk after this one is then staged.
+//
+static void SpiChunkStart()
+{
+    uint8 interruptState;
+    uint32 chunk;
+    int descr;
+
+    //
+    // This may run from the caller of SpiXfer*(), so the descriptor swap is
+    // done in a critical section: otherwise an interrupt that queues a
+    // transaction could StageNext() into the descriptor about to be started,
+    // or see a half updated /running/.  Once /runningDescr/ is switched,
+    // StageNext() only touches the other, idle, descriptor.
+    //
+    interruptState = CyEnterCriticalSection();
+
+    chunk = ChunkBytes(&running);
+    runningChunkBytes = chunk;
+    // Only unsplittable transactions have a header, so it's in their one chunk
+    spiBusBytes += running.headerBytes + chunk;
+
+    SpiRxDma_ChDisable();
+    SpiTxDma_ChDisable();
+
+    descr = !runningDescr;
+    if (!(staged.valid && staged.seq == running.seq && staged.bytes == running.bytes
+        && staged.chunk == chunk))
+    {
+        ProgramDescriptors(descr, &running, chunk);
+    }
+    staged.valid = 0;
+    runningDescr = descr;
+
+    SpiTxDma_SetNextDescriptor(descr);
+    if (running.recvBuf) {
+        SpiRxDma_SetInterruptCallback(&SpiRxDmaIsr);
+        SpiRxDma_SetNextDescriptor(descr);
+    }
+
+    CyExitCriticalSection(interruptState);
+
+    SPI_1_SpiSetActiveSlaveSelect(running.ss);
+
+    SPI_1_SpiUartClearRxBuffer();
+    SPI_1_SpiUartClearTxBuffer();
+
+    //
+    // Start DMAs.  
+    //
+    // For receiving, use both TX and RX DMA, and the previously setup SPI RX
+    // DMA ISR.  
+    //
+    // For sending, Use on the TX DMA, and setup the SPI TX FIFO completion ISR
+    // (which requires clearing pending ISRs first).
+    //
+    // Transactions with a header are started by SpiStartWithHeader().
+    //
+    if (running.recvBuf) {
+        if (running.headerBytes) {
+            SpiStartWithHeader();
+        } else {
+            SpiTxIsr_Disable();
+            SpiRxDma_ChEnable();
+            SpiTxDma_ChEnable();
+        }
+    } else {
+        SPI_1_ClearMasterInterruptSource(SPI_1_GetMasterInterruptSourceMasked());
+        SpiTxIsr_ClearPending();
+        if (running.headerBytes) {
+            SpiStartWithHeader();
+        } else {
+            SpiTxIsr_Enable();
+            SpiTxDma_ChEnable();
+        }
+    }
+
+    //
+    // While this chunk runs, get the next one ready.  Unlocked xfers (see
+    // SpiXferUnlocked()) own the bus outright, and don't stage anything.
+    //
+    interruptState = CyEnterCriticalSection();
+    if (spiBusLocked) {
+        StageNext();
+    }
+    CyExitCriticalSection(interruptState);
+}
+
+//
+// Make /qd/ the running transaction, with no chunk started yet.  In a critical
+// section, as PeekNext() reads /running/ from interrupts.
+//
+static void SetRunning(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    uint8 interruptState;
+
+    interruptState = CyEnterCriticalSection();
+    running = *qd;
+    runningChunkBytes = 0;
+    CyExitCriticalSection(interruptState);
+}
+
+//
+// Write /bytes/ of /sendBuf/ by PIO, and wait for them to go out on the bus.
+//
+// The SPI done interrupt is disabled, as the CPU waits for the bus to go idle
+// itself - the next TX DMA transaction clears the interrupt before
+// re-enabling it.
+//
+static void PioWrite(
+    uint8 * sendBuf,
+    uint32 bytes,
+    uint32 ss,
+    int repeated
+    )
+{
+    uint32 i;
+
+    SpiTxIsr_Disable();
+    SPI_1_SpiSetActiveSlaveSelect(ss);
+
+    for (i = 0; i < bytes; i++) {
+        SPI_1_SpiUartWriteTxData(sendBuf[repeated ? 0 : i]);
+    }
+    while (SPI_1_SpiUartGetTxBufferSize() > 0);
+    while (SPI_1_SpiIsBusBusy());
+    SPI_1_SpiUartClearRxBuffer();
+
+    spiPioXfers++;
+    spiBusBytes += bytes;
+}
+
+//
+// Run the running transaction by PIO (see SPI_PIO_MAX_BYTES), to completion.
+//
+static void SpiPioStart()
+{
+    uint8 interruptState;
+
+    interruptState = CyEnterCriticalSection();
+    runningChunkBytes = running.bytes;
+    CyExitCriticalSection(interruptState);
+
+    PioWrite(running.sendBuf, running.bytes, running.ss,
+        running.flags & SPI_TX_BYTE_REPEATED);
+    SpiChunkDone();
+}
+
+//
+// Start /qd/ from the caller of SpiXfer*(), on a bus that was idle.
+//
+// Tiny transmit-only transactions are run by PIO, right here.  Everything
+// else (and anything started from the queue, see UnlockSpiBus()) goes by DMA,
+// so that the CPU never busy-waits on a contended bus.
+//
+static void SpiXferStartIdle(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    if (!qd->recvBuf && !qd->headerBytes && qd->bytes <= spiPioMaxBytes) {
+        SetRunning(qd);
+        SpiPioStart();
+    } else {
+        SpiXferStart(qd);
+    }
+}
+
+//
+// Make /qd/ the running transaction, and start its first chunk.
+//
+static void SpiXferStart(
+    struct QUEUED_DESCRIPTOR * qd
+    )
+{
+    SetRunning(qd);
+    if (running.flags & SPI_BUS_GRANT) {
+        // Bus stays locked until SpiReleaseBus()
+        running.doneCallback(running.doneArg);
+        return;
+    }
+    SpiChunkStart();
+}
+
+//
+// Fill in a queue descriptor from SpiXfer*() args.
+//
+static void FillDescriptor(
+    struct QUEUED_DESCRIPTOR * qd,
+    uint8 * sendBuf,
+    uint8 * recvBuf,
+    uint32 bytes,
+    uint32 ss,
+    void (*doneCallback)(void *),
+    void * doneArg,
+    uint32 flags
+    )
+{
+    if (flags & SPI_DONE_CALLBACK) {
+        doneCallback = SpiDoneCallback;
+        assert(doneArg != NULL);
+        *((int *) doneArg) = 0;
+    }
+
+    qd->sendBuf = sendBuf;
+    qd->recvBuf = recvBuf;
+    qd->bytes = bytes;
+    qd->ss = ss;
+    qd->doneCallback = doneCallback;
+    qd->doneArg = doneArg;
+    qd->flags = flags & ~SPI_DONE_CALLBACK;
+    qd->seq = spiXferSeq++;
+    qd->headerBytes = 0;
 }
 
 //
 // Send/recv a SPI tranaction without locking the SPI bus.
 //
 // The SPI transaction sends and optionally receives data, in both cases via
-// DMA.  The transmitted data has fully completed once the last byte heads out
-// of the SPI TX FIFO.  OTOH, the received data is done when the DMA has
-// finished writing the last byte into memory.  Therefore, the completion ISR
-// is different for each (for TX, it's SPI done, for RX is DMA done).
+// DMA (except tiny transmit-only transactions, see SPI_PIO_MAX_BYTES, which
+// are sent by the CPU and complete before this returns).  The transmitted data
+// has fully completed once the last byte heads out of the SPI TX FIFO.  OTOH,
+// the received data is done when the DMA has finished writing the last byte
+// into memory.  Therefore, the completion ISR is different for each (for TX,
+// it's SPI done, for RX is DMA done).
 //
 // @param sendBuf       Buffer of bytes to send.  Must be present.
 // @param recvBuf       Buffer of bytes to receive.  If present, this is a
 //                      receive transaction.  If NULL, this is a transmit
 //                      transaction.
 // @param bytes         Number of bytes to send/recv.  Must be <=
-//                      MAX_SPI_BUS_HOGGING_BYTES
+//                      MAX_SPI_XFER_BYTES.  As the bus is not shared, the
+//                      MAX_SPI_BUS_HOGGING_BYTES limit of SpiXfer() doesn't
+//                      apply.
 // @param ss            Slave select number.  One of:
 //                      SPI_SS_MEM_0
 //                      SPI_SS_MEM_1
@@ -195,6 +830,12 @@ void SpiRxDmaIsr(void)
 //                      then doneCallback is unused.
 //                      SPI_TX_BYTE_REPEATED: Only the first byte of sendBuf is
 //                      used, and it is sent out repeatedly for /bytes/ bytes.
+//                      SPI_SPLITTABLE: The device does not care if the
+//                      transaction is broken up into multiple slave select
+//                      frames (true for OLED data, not for serial RAM), so
+//                      it may be run in chunks, letting higher class
+//                      transactions run in between.
+//                      SPI_CLASS(c): Transaction class, see spi.h.
 //
 void SpiXferUnlocked(
     uint8 * sendBuf,
@@ -206,67 +847,12 @@ void SpiXferUnlocked(
     uint32 flags
     )
 {
-    assert(bytes <= MAX_SPI_BUS_HOGGING_BYTES);
-
-    if (flags & SPI_SHORT_AND_SWEET) {
-        SPI_1_SpiUartPutArray(sendBuf, bytes);
-        while (SPI_1_SpiUartGetTxBufferSize() > 0);
-        UnlockSpiBus();
-        return;
-    }
-
-    if (flags & SPI_DONE_CALLBACK) {
-        doneCallback = SpiDoneCallback;
-        assert(doneArg != NULL);
-        *((int *) doneArg) = 0;
-    }
-
-    spiDoneCallback = doneCallback;
-    spiDoneArg = doneArg;
-
-    SpiRxDma_ChDisable();
-    SpiTxDma_ChDisable();
-
-    SpiTxDma_SetAddressIncrement(
-        0, flags & SPI_TX_BYTE_REPEATED ? CYDMA_INC_NONE : CYDMA_INC_SRC_ADDR
-        );
-    SpiTxDma_SetSrcAddress(0, sendBuf);
-    SpiTxDma_SetDstAddress(0, (void *) SPI_1_TX_FIFO_WR_PTR);
-    SpiTxDma_SetNumDataElements(0, bytes);
-    SpiTxDma_ValidateDescriptor(0);
-
-    if (recvBuf) {
-        SpiRxDma_SetInterruptCallback(&SpiRxDmaIsr);
-        SpiRxDma_SetSrcAddress(0, (void *) SPI_1_RX_FIFO_RD_PTR);
-        SpiRxDma_SetDstAddress(0, recvBuf);
-        SpiRxDma_SetNumDataElements(0, bytes);
-        SpiRxDma_ValidateDescriptor(0);
-    }
-
-    SPI_1_SpiSetActiveSlaveSelect(ss);
+    struct QUEUED_DESCRIPTOR qd;
 
-    SPI_1_SpiUartClearRxBuffer();
-    SPI_1_SpiUartClearTxBuffer();
+    assert(bytes <= MAX_SPI_XFER_BYTES);
 
-    //
-    // Start DMAs.  
-    //
-    // For receiving, use both TX and RX DMA, and the previously setup SPI RX
-    // DMA ISR.  
-    //
-    // For sending, Use on the TX DMA, and setup the SPI TX FIFO completion ISR
-    // (which requires clearing pending ISRs first).
-    //
-    if (recvBuf) {
-        SpiTxIsr_Disable();
-        SpiRxDma_ChEnable();
-        SpiTxDma_ChEnable();
-    } else {
-        SPI_1_ClearMasterInterruptSource(SPI_1_GetMasterInterruptSourceMasked());
-        SpiTxIsr_ClearPending();
-        SpiTxIsr_Enable();
-        SpiTxDma_ChEnable();
-    }
+    FillDescriptor(&qd, sendBuf, recvBuf, bytes, ss, doneCallback, doneArg, flags);
+    SpiXferStartIdle(&qd);
 }
 
 //
@@ -274,10 +860,14 @@ void SpiXferUnlocked(
 //
 // If the bus was already locked, transaction gets queued for later.
 //
+// /bytes/ must be <= MAX_SPI_BUS_HOGGING_BYTES while audio is active
+// (MAX_SPI_IDLE_HOGGING_BYTES while idle), unless SPI_SPLITTABLE, in which case
+// it must be <= MAX_SPI_XFER_BYTES.
+//
 // @return 0 if the bus was successfully locked and the transaction was
 // immediately started, -EAGAIN if the transaction was queued for later because
-// the bus was already locked, or -ENOMEM of the bus was locked and there's no
-// space to queue it.
+// the bus was already locked, -ENOMEM of the bus was locked and there's no
+// space to queue it, or -EINVAL if /bytes/ is too big.
 //
 int SpiXfer(
     uint8 * sendBuf,
@@ -292,23 +882,142 @@ int SpiXfer(
     struct QUEUED_DESCRIPTOR qd;
     int wasLocked;
 
-    if (flags & SPI_DONE_CALLBACK) {
-        doneCallback = SpiDoneCallback;
-        assert(doneArg != NULL);
-        *((int *) doneArg) = 0;
+    if (!XferSizeValid(bytes, flags)) return -EINVAL;
+
+    FillDescriptor(&qd, sendBuf, recvBuf, bytes, ss, doneCallback, doneArg, flags);
+    wasLocked = LockSpiBus(&qd);
+    if (wasLocked < 0) return wasLocked;
+    if (wasLocked) return -EAGAIN;
+
+    SpiXferStartIdle(&qd);
+    return 0;
+}
+
+//
+// SpiXfer(), with a separate header sent before the payload, in the same
+// transaction (under the same slave select).
+//
+// This allows commands (like a serial RAM read/write command and address) to
+// be prepended to arbitrary payload buffers, without copying them and without
+// the buffers needing headroom.  The header is copied, so /header/ need not
+// remain valid after the call.
+//
+// @param header        Header bytes to send first.
+// @param headerBytes   Size of header.  Must be <= MAX_SPI_HEADER_BYTES.
+// @param sendBuf       Payload to send.  For receive transactions, may be NULL,
+//                      in which case dummy bytes are sent.
+// @param recvBuf       Buffer to receive payload.  Only the bytes received
+//                      after the header are stored.
+//
+// All other params and the return value are the same as SpiXfer().  Header
+// transactions can not be SPI_SPLITTABLE.
+//
+int SpiXferWithHeader(
+    uint8 * header,
+    uint32 headerBytes,
+    uint8 * sendBuf,
+    uint8 * recvBuf,
+    uint32 bytes,
+    uint32 ss,
+    void (*doneCallback)(void *),
+    void * doneArg,
+    uint32 flags
+    )
+{
+    struct QUEUED_DESCRIPTOR qd;
+    int wasLocked;
+
+    assert(headerBytes <= MAX_SPI_HEADER_BYTES);
+    assert(bytes > 0);
+    assert(!(flags & SPI_SPLITTABLE));
+    if (!XferSizeValid(bytes, flags)) return -EINVAL;
+
+    if (!sendBuf) {
+        assert(recvBuf != NULL);
+        sendBuf = &spiDummyByte;
+        flags |= SPI_TX_BYTE_REPEATED;
     }
 
-    qd.sendBuf = sendBuf;
-    qd.recvBuf = recvBuf;
-    qd.bytes = bytes;
-    qd.ss = ss;
-    qd.doneCallback = doneCallback;
-    qd.doneArg = doneArg;
-    qd.flags = flags;
+    FillDescriptor(&qd, sendBuf, recvBuf, bytes, ss, doneCallback, doneArg, flags);
+    memcpy(qd.header, header, headerBytes);
+    qd.headerBytes = headerBytes;
+
     wasLocked = LockSpiBus(&qd);
     if (wasLocked < 0) return wasLocked;
     if (wasLocked) return -EAGAIN;
 
-    SpiXferUnlocked(sendBuf, recvBuf, bytes, ss, doneCallback, doneArg, flags);
+    SpiXferStart(&qd);
     return 0;
 }
+
+//
+// @return how many more transactions of the class in /flags/ can be queued
+// before SpiXfer*() returns -ENOMEM.  Call in a critical section, to be sure
+// of queueing that many.
+//
+int SpiXferQueueFree(
+    uint32 flags
+    )
+{
+    struct QUEUED_DESCRIPTORS * q = &queuedDescriptors[SPI_GET_CLASS(flags)];
+
+    return NUM_SPI_QDS - 1 - (q->tail + NUM_SPI_QDS - q->head) % NUM_SPI_QDS;
+}
+
+//
+// Acquire the SPI bus for the CPU, waiting behind any running and higher (or
+// same) class queued transactions.
+//
+// This is for short sequences that need the CPU between bytes (for example,
+// toggling the OLED data/command line), which can not be expressed as a
+// single transaction.  Once acquired, use SpiWritePio() and then
+// SpiReleaseBus() - and keep it short, as the bus is hogged meanwhile.
+//
+// @param flags     SPI_CLASS() to wait in.
+//
+// @return 0 on success, or -ENOMEM if there's no space to wait in the queue.
+//
+int SpiAcquireBus(
+    uint32 flags
+    )
+{
+    struct QUEUED_DESCRIPTOR qd;
+    // Set from the ISR that grants the bus
+    volatile int granted;
+    int wasLocked;
+
+    FillDescriptor(&qd, NULL, NULL, 0, 0, NULL, (void *) &granted,
+        flags | SPI_DONE_CALLBACK | SPI_BUS_GRANT);
+    wasLocked = LockSpiBus(&qd);
+    if (wasLocked < 0) return wasLocked;
+    if (wasLocked) {
+        while (!granted);
+    } else {
+        SetRunning(&qd);
+    }
+    return 0;
+}
+
+//
+// Release the SPI bus acquired by SpiAcquireBus(), starting any queued
+// transactions.
+//
+void SpiReleaseBus()
+{
+    UnlockSpiBus();
+}
+
+//
+// Send /bytes/ of /sendBuf/ by PIO, returning once they are out on the bus.
+// Bus must have been acquired with SpiAcquireBus().
+//
+void SpiWritePio(
+    uint8 * sendBuf,
+    uint32 bytes,
+    uint32 ss
+    )
+{
+    assert(spiBusLocked);
+    assert(running.flags & SPI_BUS_GRANT);
+    PioWrite(sendBuf, bytes, ss, 0);
+}
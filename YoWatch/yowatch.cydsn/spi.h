@@ -10,19 +10,93 @@
 //
 #define SPI_DONE_CALLBACK       (1 << 0)
 #define SPI_TX_BYTE_REPEATED    (1 << 1)
-#define SPI_SHORT_AND_SWEET     (1 << 2)
+#define SPI_SPLITTABLE          (1 << 3)
+// (1 << 4) is reserved for internal use by spi.c
 
 //
-// There are only 2 ping-ponged audio buffers, before heading to Serial RAM.
-// Therefore the SPI bus can not be hogged for too long, or audio packes would
-// be dropped.
+// Transaction classes, ORed into flags via SPI_CLASS().  Each class has its
+// own queue, and when the bus frees up, queued transactions are run in class
+// priority order (audio first, then normal, then display), FIFO within a
+// class.  Flags of 0 selects SPI_CLASS_NORMAL.
 //
-// Audio, at 16-bit 16kHz, needs to write a 512 bytes packet every (512 bytes /
-// (2 bytes * 16kHz)) = 16msecs.  To be safe, we restrict continuous bus usage
-// to roughly half of that - at 8Mbps, that is (8Mbps * 8msec = 64kbits =
-// 8kbytes).
+enum {
+    SPI_CLASS_NORMAL,
+    SPI_CLASS_DISPLAY,
+    SPI_CLASS_AUDIO,
+    NUM_SPI_CLASSES
+};
+
+#define SPI_CLASS_SHIFT         8
+#define SPI_CLASS_MASK          (0x3 << SPI_CLASS_SHIFT)
+#define SPI_CLASS(c)            ((c) << SPI_CLASS_SHIFT)
+#define SPI_GET_CLASS(flags)    (((flags) & SPI_CLASS_MASK) >> SPI_CLASS_SHIFT)
+
+//
+// Audio stream blocks (AUDIO_BLOCK_BYTES bytes of 16-bit 16kHz samples, see
+// i2s.h) are enqueued to Serial RAM as they fill, so the SPI bus can not be
+// hogged for too long, or audio blocks would be dropped.  Serial RAM bufs are
+// the same size (see serialram.h).
+//
+// A block fills every (256 bytes / (2 bytes * 16kHz)) = 8msecs.  At 8Mbps,
+// that is (8Mbps * 8msec = 64kbits = 8kbytes) of bus time between audio
+// blocks - SPI_BYTES_PER_AUDIO_BLOCK.
+//
+#define SPI_BUS_BYTES_PER_SEC       (8000000 / 8)
+#define AUDIO_BYTES_PER_SEC         (16000 * 2)
+#define AUDIO_BLOCK_BYTES           256
+#define SPI_BYTES_PER_AUDIO_BLOCK \
+    (AUDIO_BLOCK_BYTES * SPI_BUS_BYTES_PER_SEC / AUDIO_BYTES_PER_SEC)
+
+//
+// While audio is active, this is the budget that a queued audio transaction
+// may wait behind other traffic.  Non-splittable transactions larger than this
+// are rejected (-EINVAL) while audio is active.  Splittable (SPI_SPLITTABLE)
+// transactions are broken into chunks that fit in whatever is left of the
+// budget (see SpiBurstBytes()).
+//
+// It is only half of SPI_BYTES_PER_AUDIO_BLOCK (4000 bytes), as the rest of
+// the period isn't free: the audio enqueue itself, the command header and
+// slave select turnaround of each transaction, and the DMA/ISR latency
+// between chunks all take bus time too.  The nominal 8Mbps is also the best
+// case.  So a whole period's worth leaves no margin, and a slightly late
+// enqueue would drop a block.
+//
+#define MAX_SPI_BUS_HOGGING_BYTES (SPI_BYTES_PER_AUDIO_BLOCK / 2)
+
+//
+// While audio is idle, non-splittable transactions may be up to a whole audio
+// block period of bus time (8000 bytes).  So one accepted just before audio
+// starts holds the first audio block up by at most one period.
+//
+#define MAX_SPI_IDLE_HOGGING_BYTES SPI_BYTES_PER_AUDIO_BLOCK
+
+//
+// Smallest chunk a splittable transaction is broken into, to bound the
+// per-chunk overhead when the audio queue is backed up.
+//
+#define MIN_SPI_BURST_BYTES 512
+
+//
+// Largest single transaction (and chunk, when audio is not active).  Big
+// enough for a full screen of RGB565 pixels.
+//
+#define MAX_SPI_XFER_BYTES (32 * 1024)
+
+//
+// Largest header of a SpiXferWithHeader() transaction.  The header, plus the
+// start of the payload, must fit in the SPI TX FIFO.
+//
+#define MAX_SPI_HEADER_BYTES 4
+
+//
+// Transmit-only transactions of at most spiPioMaxBytes, started on an idle bus,
+// are written to the TX FIFO by the CPU (PIO) instead of by DMA.  For tiny
+// transactions, like OLED commands, the DMA setup and completion interrupt
+// cost more than the transfer itself.  The default, the FIFO size, means the
+// CPU never waits for FIFO space, only for the bytes to drain.  Set
+// spiPioMaxBytes to 0 to always use DMA.
 //
-#define MAX_SPI_BUS_HOGGING_BYTES 8000
+#define SPI_PIO_MAX_BYTES SPI_1_SPI_UART_FIFO_SIZE
 
 //
 // Slave selects
@@ -33,6 +107,15 @@
 
 extern int spiRxIsrCalls;
 extern int spiTxIsrCalls;
+extern int spiPioXfers;
+extern uint32 spiBusBytes;
+extern uint32 spiPioMaxBytes;
+
+void SpiInit();
+
+void SpiSetAudioActive(
+    int active
+    );
 
 void SpiXferUnlocked(
     uint8 * sendBuf,
@@ -54,6 +137,34 @@ int SpiXfer(
     uint32 flags
     );
 
+int SpiXferWithHeader(
+    uint8 * header,
+    uint32 headerBytes,
+    uint8 * sendBuf,
+    uint8 * recvBuf,
+    uint32 bytes,
+    uint32 ss,
+    void (*doneCallback)(void *),
+    void * doneArg,
+    uint32 flags
+    );
+
+int SpiXferQueueFree(
+    uint32 flags
+    );
+
+int SpiAcquireBus(
+    uint32 flags
+    );
+
+void SpiReleaseBus();
+
+void SpiWritePio(
+    uint8 * sendBuf,
+    uint32 bytes,
+    uint32 ss
+    );
+
 CY_ISR_PROTO(SpiTxIsr);
 
 #endif
@@ -11,18 +11,26 @@
  */
 #include <project.h>
 #include <errno.h>
+#include <string.h>
 #include "printf.h"
 #include "assert.h"
 #include "spi.h"
 #include "serialram.h"
 #include "queue.h"
 #include "i2s.h"
+#include "adpcm.h"
 #include "oled.h"
 #include "fonts.h"
 #include "colors.h"
 #include "timeit.h"
 #include "util.h"
 #include "draw.h"
+#include "framebuf.h"
+#include "watchface.h"
+#include "textlayout.h"
+#include "images.h"
+#include "listview.h"
+#include "msgstore.h"
 
 #define TEST_VERBOSE 0
 
@@ -213,15 +221,156 @@ int TestSpiXferTooMany()
     TEST_RETURN;
 }
 
+//
+// Transactions too big to run are rejected, before anything is queued.  The
+// limit for non-splittable transactions is lower while audio is active.
+//
+int TestSpiXferTooBig()
+{
+    TEST_INIT;
+
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint32 ss = SPI_SS_MEM_0;
+
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, MAX_SPI_IDLE_HOGGING_BYTES + 1, ss, NULL, NULL, SPI_TX_BYTE_REPEATED),
+        -EINVAL);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, MAX_SPI_XFER_BYTES + 1, ss, NULL, NULL,
+            SPI_TX_BYTE_REPEATED | SPI_SPLITTABLE),
+        -EINVAL);
+
+    SpiSetAudioActive(1);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, MAX_SPI_BUS_HOGGING_BYTES + 1, ss, NULL, NULL, SPI_TX_BYTE_REPEATED),
+        -EINVAL);
+    TEST_ASSERT_INT_EQ(SerialRamWrite(pbuf1, 0, MAX_SPI_BUS_HOGGING_BYTES + 1, NULL, NULL, 0),
+        -EINVAL);
+    TEST_ASSERT_INT_EQ(SerialRamRead(pbuf1, 0, MAX_SPI_BUS_HOGGING_BYTES + 1, NULL, NULL, 0),
+        -EINVAL);
+    SpiSetAudioActive(0);
+
+    TEST_RETURN;
+}
+
+//
+// Verify queued transactions run in class priority order (audio, normal,
+// display), FIFO within a class.
+//
+int xferOrder[8];
+int xferOrderLen;
+void XferOrderCallback(
+    void * id
+    )
+{
+    xferOrder[xferOrderLen++] = (int) id;
+}
+
+int TestSpiXferPriority()
+{
+    TEST_INIT;
+
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint32 ss = SPI_SS_MEM_0;
+    const uint32 display = SPI_CLASS(SPI_CLASS_DISPLAY);
+    const uint32 audio = SPI_CLASS(SPI_CLASS_AUDIO);
+
+    xferOrderLen = 0;
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, SERIAL_RAM_BUFSIZE, ss, XferOrderCallback, (void *) 0, 0), 0);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, SERIAL_RAM_BUFSIZE, ss, XferOrderCallback, (void *) 1, display),
+        -EAGAIN);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, SERIAL_RAM_BUFSIZE, ss, XferOrderCallback, (void *) 2, 0), -EAGAIN);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, SERIAL_RAM_BUFSIZE, ss, XferOrderCallback, (void *) 3, audio),
+        -EAGAIN);
+    TEST_ASSERT_INT_EQ(
+        SpiXfer(pbuf1, NULL, SERIAL_RAM_BUFSIZE, ss, XferOrderCallback, (void *) 4, audio),
+        -EAGAIN);
+    while (xferOrderLen < 5);
+
+    TEST_ASSERT_INT_EQ(xferOrder[0], 0);
+    TEST_ASSERT_INT_EQ(xferOrder[1], 3);
+    TEST_ASSERT_INT_EQ(xferOrder[2], 4);
+    TEST_ASSERT_INT_EQ(xferOrder[3], 2);
+    TEST_ASSERT_INT_EQ(xferOrder[4], 1);
+
+    TEST_RETURN;
+}
+
+//
+// Tiny TX transactions on an idle bus are done by PIO, and complete before
+// SpiXfer() returns, without a completion interrupt.  Unless PIO is disabled.
+//
+int TestSpiXferPio()
+{
+    TEST_INIT;
+
+    int done;
+    uint8 buf[3] = { 0xFF, 0xFF, 0xFF }; // RSTIO cmd, harmless to serial RAM
+    uint32 ss = SPI_SS_MEM_0;
+    uint32 oldPioMaxBytes = spiPioMaxBytes;
+
+    spiTxIsrCalls = spiPioXfers = 0;
+    done = 0;
+    TEST_ASSERT_INT_EQ(SpiXfer(buf, NULL, sizeof(buf), ss, DoneCallback, &done, 0), 0);
+    TEST_ASSERT_INT_EQ(done, 1);
+    TEST_ASSERT_INT_EQ(spiPioXfers, 1);
+    TEST_ASSERT_INT_EQ(spiTxIsrCalls, 0);
+
+    spiPioMaxBytes = 0;
+    done = 0;
+    TEST_ASSERT_INT_EQ(SpiXfer(buf, NULL, sizeof(buf), ss, DoneCallback, &done, 0), 0);
+    while (!done);
+    spiPioMaxBytes = oldPioMaxBytes;
+    TEST_ASSERT_INT_EQ(spiPioXfers, 1);
+    TEST_ASSERT_INT_EQ(spiTxIsrCalls, 1);
+
+    TEST_RETURN;
+}
+
+//
+// Tiny transactions are dominated by the DMA setup and completion interrupt,
+// which PIO skips.  Compare with PIO disabled.
+//
+void SpiXferTiny()
+{
+    int i;
+    int done;
+    uint8 buf[3] = { 0xFF, 0xFF, 0xFF }; // RSTIO cmd, harmless to serial RAM
+
+    for (i = 0; i < 16; i++) {
+        done = 0;
+        SpiXfer(buf, NULL, sizeof(buf), SPI_SS_MEM_0, DoneCallback, &done, 0);
+        while (!done);
+    }
+}
+int TestSpiXferPioSpeed()
+{
+    TEST_INIT;
+    int usecsDma, usecsPio;
+    uint32 oldPioMaxBytes = spiPioMaxBytes;
+
+    spiPioMaxBytes = 0;
+    usecsDma = TimeIt(SpiXferTiny, 100);
+    spiPioMaxBytes = oldPioMaxBytes;
+    usecsPio = TimeIt(SpiXferTiny, 100);
+    TEST_ASSERT_PRINT(usecsPio < usecsDma, "usecs PIO = %d, DMA = %d", usecsPio, usecsDma);
+
+    TEST_RETURN;
+}
+
 int TestSerialRamFuncs()
 {
     TEST_INIT;
 
     uint8 * pbuf1 = SerialRamGetBuf(0);
 
-    TEST_ASSERT(SerialRamRead(pbuf1, 0x0000000, SERIAL_RAM_BUFSIZE, NULL, NULL) == 0);
+    TEST_ASSERT(SerialRamRead(pbuf1, 0x0000000, SERIAL_RAM_BUFSIZE, NULL, NULL, 0) == 0);
     CyDelay(10);
-    TEST_ASSERT(SerialRamWrite(pbuf1, 0x0000000, SERIAL_RAM_BUFSIZE, NULL, NULL) == 0);
+    TEST_ASSERT(SerialRamWrite(pbuf1, 0x0000000, SERIAL_RAM_BUFSIZE, NULL, NULL, 0) == 0);
     CyDelay(10);
 
     TEST_RETURN;
@@ -258,6 +407,46 @@ int TestSerialRamWriteRead()
     TEST_RETURN;
 }
 
+//
+// Read/write serial RAM from arbitrary (non SerialRamGetBuf()) buffers, at odd
+// offsets and sizes, including a read that is shorter than the TX FIFO.
+//
+int TestSerialRamAnyBuf()
+{
+    TEST_INIT;
+
+    static uint8 wbuf[SERIAL_RAM_BUFSIZE + 1];
+    uint8 rbuf[37 + 1];
+    const uint32 ramAddress = 0x00003456; // Arbitrary address
+    uint32 sizes[] = { 1, 3, 37, SERIAL_RAM_BUFSIZE };
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZEOF(sizes); i++) {
+        uint32 bytes = sizes[i];
+        uint8 * pw = &wbuf[1]; // Deliberately unaligned
+
+        for (j = 0; j < bytes; j++) {
+            pw[j] = i + j*7;
+        }
+        TEST_ASSERT(SerialRamWriteBlocking(pw, ramAddress, bytes) == 0);
+
+        memset(wbuf, 0, sizeof(wbuf));
+        if (bytes <= sizeof(rbuf) - 1) {
+            TEST_ASSERT(SerialRamReadBlocking(&rbuf[1], ramAddress, bytes) == 0);
+            for (j = 0; j < bytes; j++) {
+                TEST_ASSERT_INT_EQ(rbuf[1 + j], (uint8) (i + j*7));
+            }
+        } else {
+            TEST_ASSERT(SerialRamReadBlocking(pw, ramAddress, bytes) == 0);
+            for (j = 0; j < bytes; j++) {
+                TEST_ASSERT_INT_EQ(pw[j], (uint8) (i + j*7));
+            }
+        }
+    }
+
+    TEST_RETURN;
+}
+
 //
 // Fill serial ram with arbitrary value and test reading arbitrary location,
 // then refill and retest with another value and location.
@@ -274,12 +463,12 @@ int TestSerialRamFillMem()
     const uint32 arbitraryAddr2 = 0xABCD;
     int i;
 
-    TEST_ASSERT(SerialRamFillBlocking(arbitraryVal1) == 0);
+    TEST_ASSERT(SerialRamFillBlocking(SERIAL_RAM_REGION_AUDIO, arbitraryVal1) == 0);
     TEST_ASSERT(SerialRamReadBlocking(pbuf1, arbitraryAddr1, SERIAL_RAM_BUFSIZE) == 0);
     for (i = 0; i < SERIAL_RAM_BUFSIZE; i++) {
         TEST_ASSERT_INT_EQ(arbitraryVal1, pbuf1[i]);
     }
-    TEST_ASSERT(SerialRamFillBlocking(arbitraryVal2) == 0);
+    TEST_ASSERT(SerialRamFillBlocking(SERIAL_RAM_REGION_AUDIO, arbitraryVal2) == 0);
     TEST_ASSERT(SerialRamReadBlocking(pbuf2, arbitraryAddr2, SERIAL_RAM_BUFSIZE) == 0);
     for (i = 0; i < SERIAL_RAM_BUFSIZE; i++) {
         TEST_ASSERT_INT_EQ(arbitraryVal2, pbuf2[i]);
@@ -288,6 +477,73 @@ int TestSerialRamFillMem()
     TEST_RETURN;
 }
 
+//
+// Regions are allocated down from the top of serial RAM, leaving audio the
+// rest (and at least SERIAL_RAM_AUDIO_MIN_SIZE).  Blocking transfers, and so
+// regions, can span both serial RAMs.
+//
+// Resets the regions, so like the other tests of serial RAM users, this only
+// runs at boot, before the regions are set up for use (see SmOff()).
+//
+int TestSerialRamRegions()
+{
+    TEST_INIT;
+
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint8 * pbuf2 = SerialRamGetBuf(1);
+    uint32 total;
+    uint32 address;
+    int i;
+
+    SerialRamInit();
+    total = SerialRamTotalSize();
+    TEST_ASSERT_INT_EQ(SerialRamRegionAddress(SERIAL_RAM_REGION_AUDIO), 0);
+    TEST_ASSERT_INT_EQ(SerialRamRegionSize(SERIAL_RAM_REGION_AUDIO), total);
+    TEST_ASSERT_INT_EQ(SerialRamRegionSize(SERIAL_RAM_REGION_FRAMEBUF), 0);
+
+    if (total < SERIAL_RAM_AUDIO_MIN_SIZE + 1000) {
+        TEST_ASSERT_INT_EQ(SerialRamRegionAlloc(SERIAL_RAM_REGION_FRAMEBUF, 1000), -ENOMEM);
+    } else {
+        TEST_ASSERT_INT_EQ(SerialRamRegionAlloc(SERIAL_RAM_REGION_FRAMEBUF, 1000), 0);
+        TEST_ASSERT_INT_EQ(SerialRamRegionAlloc(SERIAL_RAM_REGION_FRAMEBUF, 1000), 0);
+        TEST_ASSERT_INT_EQ(SerialRamRegionAlloc(SERIAL_RAM_REGION_FRAMEBUF, 2000), -EBUSY);
+        TEST_ASSERT_INT_EQ(SerialRamRegionAlloc(SERIAL_RAM_REGION_MSG_STORE,
+            total - SERIAL_RAM_AUDIO_MIN_SIZE), -ENOMEM);
+        TEST_ASSERT_INT_EQ(SerialRamRegionAddress(SERIAL_RAM_REGION_FRAMEBUF), total - 1000);
+        TEST_ASSERT_INT_EQ(SerialRamRegionSize(SERIAL_RAM_REGION_AUDIO), total - 1000);
+
+        // Filling a region stops at its edges
+        address = SerialRamRegionAddress(SERIAL_RAM_REGION_FRAMEBUF);
+        memset(pbuf1, 0x11, SERIAL_RAM_BUFSIZE);
+        TEST_ASSERT(SerialRamWriteBlocking(pbuf1, address - SERIAL_RAM_BUFSIZE,
+            SERIAL_RAM_BUFSIZE) == 0);
+        TEST_ASSERT(SerialRamFillBlocking(SERIAL_RAM_REGION_FRAMEBUF, 0x22) == 0);
+        TEST_ASSERT(SerialRamReadBlocking(pbuf2, address - 2, 4) == 0);
+        TEST_ASSERT_INT_EQ(pbuf2[1], 0x11);
+        TEST_ASSERT_INT_EQ(pbuf2[2], 0x22);
+    }
+
+    // Across the end of the first serial RAM into the second
+    if (SerialRamMemExists(0) && SerialRamMemExists(1)) {
+        for (i = 0; i < SERIAL_RAM_BUFSIZE; i++) {
+            pbuf1[i] = i;
+        }
+        TEST_ASSERT(SerialRamWriteBlocking(pbuf1, SERIAL_RAM_SIZE - 100, SERIAL_RAM_BUFSIZE) == 0);
+        memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
+        TEST_ASSERT(SerialRamReadBlocking(pbuf2, SERIAL_RAM_SIZE, 10) == 0);
+        TEST_ASSERT_INT_EQ(pbuf2[0], 100);
+        TEST_ASSERT(SerialRamReadBlocking(pbuf2, SERIAL_RAM_SIZE - 100, SERIAL_RAM_BUFSIZE) == 0);
+        TEST_ASSERT(memcmp(pbuf1, pbuf2, SERIAL_RAM_BUFSIZE) == 0);
+    }
+
+    // Back to regions like those set up at startup, for the tests that follow
+    SerialRamInit();
+    FramebufInit();
+    MsgStoreInit();
+
+    TEST_RETURN;
+}
+
 //
 // Write two buffers, that overlap in both time and location.  Transactions
 // should be serialized.  Data should be partially overwritten from overlap.
@@ -317,7 +573,7 @@ int TestSerialRamXfersOverlapping()
     // Second buffer overlaps half of first, so total written length is 1.5
     // buffer sizes.
     //
-    ret = SerialRamWrite(pbuf1, ramAddress, SERIAL_RAM_BUFSIZE, NULL, NULL);
+    ret = SerialRamWrite(pbuf1, ramAddress, SERIAL_RAM_BUFSIZE, NULL, NULL, 0);
     TEST_ASSERT(ret == 0);
     ret = SerialRamWriteBlocking(pbuf2, ramAddress + HALF_BUFSIZE, SERIAL_RAM_BUFSIZE);
     TEST_ASSERT(ret == 0);
@@ -328,7 +584,7 @@ int TestSerialRamXfersOverlapping()
     //
     memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
     memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
-    ret = SerialRamRead(pbuf1, ramAddress, SERIAL_RAM_BUFSIZE, NULL, NULL);
+    ret = SerialRamRead(pbuf1, ramAddress, SERIAL_RAM_BUFSIZE, NULL, NULL, 0);
     TEST_ASSERT(ret == 0);
     ret = SerialRamReadBlocking(pbuf2, ramAddress + SERIAL_RAM_BUFSIZE, SERIAL_RAM_BUFSIZE);
     TEST_ASSERT(ret == 0);
@@ -345,6 +601,58 @@ int TestSerialRamXfersOverlapping()
     TEST_RETURN;
 }
 
+//
+// Transactions queued back to back run from alternate DMA descriptors (the
+// next is staged while one runs), so each payload must arrive intact whichever
+// descriptor it lands on.  The bus is held while queueing, so that they all
+// run back to back when released.
+//
+#define TEST_STAGED_XFERS 3
+int TestSpiXferStaged()
+{
+    TEST_INIT;
+
+    static uint8 wbufs[TEST_STAGED_XFERS][SERIAL_RAM_BUFSIZE];
+    static uint8 rbufs[TEST_STAGED_XFERS][SERIAL_RAM_BUFSIZE];
+    uint32 ramAddress = 0x00010000; // Arbitrary address
+    int done[TEST_STAGED_XFERS];
+    int i, j;
+
+    for (i = 0; i < TEST_STAGED_XFERS; i++) {
+        for (j = 0; j < SERIAL_RAM_BUFSIZE; j++) {
+            wbufs[i][j] = i * 0x55 + j * 3;
+        }
+    }
+
+    TEST_ASSERT(SpiAcquireBus(0) == 0);
+    for (i = 0; i < TEST_STAGED_XFERS; i++) {
+        done[i] = 0;
+        TEST_ASSERT(SerialRamWrite(wbufs[i], ramAddress + i * SERIAL_RAM_BUFSIZE,
+            SERIAL_RAM_BUFSIZE, DoneCallback, &done[i], 0) == -EAGAIN);
+    }
+    SpiReleaseBus();
+    while (!done[TEST_STAGED_XFERS - 1]);
+
+    memset(rbufs, 0, sizeof(rbufs));
+    TEST_ASSERT(SpiAcquireBus(0) == 0);
+    for (i = 0; i < TEST_STAGED_XFERS; i++) {
+        done[i] = 0;
+        TEST_ASSERT(SerialRamRead(rbufs[i], ramAddress + i * SERIAL_RAM_BUFSIZE,
+            SERIAL_RAM_BUFSIZE, DoneCallback, &done[i], 0) == -EAGAIN);
+    }
+    SpiReleaseBus();
+    while (!done[TEST_STAGED_XFERS - 1]);
+
+    for (i = 0; i < TEST_STAGED_XFERS; i++) {
+        for (j = 0; j < SERIAL_RAM_BUFSIZE; j++) {
+            TEST_ASSERT_PRINT(rbufs[i][j] == wbufs[i][j], "xfer %d, byte %d", i, j);
+            if (rbufs[i][j] != wbufs[i][j]) break;
+        }
+    }
+
+    TEST_RETURN;
+}
+
 //
 // For DEBUG_MEMTEST_CONCURRENCY testing, periodic enqueuing of bytes
 //
@@ -389,7 +697,7 @@ int TestQueueEnqueueOneDequeueOne()
     memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
     memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
 
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
     TEST_ASSERT(BufQueueUsed() == 0);
     for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
         ((uint32 *) pbuf1)[i] = i;
@@ -400,7 +708,7 @@ int TestQueueEnqueueOneDequeueOne()
     for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
         TEST_ASSERT_INT_EQ(((uint32 *) pbuf2)[i], i);
     }
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
     TEST_ASSERT(BufQueueUsed() == 0);
 
     TEST_RETURN;
@@ -420,7 +728,7 @@ int TestQueueEnqueueDequeueVariableSizes()
     memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
     memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
 
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
     TEST_ASSERT(BufQueueUsed() == 0);
 
     //
@@ -440,7 +748,7 @@ int TestQueueEnqueueDequeueVariableSizes()
         memcpy(&copyBuf[x], pbuf2, i);
         x += i;
     }
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
     TEST_ASSERT(BufQueueUsed() == 0);
 
     //
@@ -456,141 +764,1211 @@ int TestQueueEnqueueDequeueVariableSizes()
     TEST_RETURN;
 }
 
-int TestQueueFillThenEmpty()
+int TestQueueFillThenEmpty()
+{
+    TEST_INIT;
+
+    int deqCount;
+    int enqCount;
+    int ret;
+    int i;
+
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint8 * pbuf2 = SerialRamGetBuf(1);
+
+    BufQueueInit();
+    memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
+    memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
+    enqCount = 0;
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
+    TEST_ASSERT(BufQueueUsed() == 0);
+
+    //
+    // Enqueue until full
+    //
+    while (BufQueueFree() >= SERIAL_RAM_BUFSIZE) {
+        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
+            ((uint32 *) pbuf1)[i] = enqCount++;
+        }
+        TEST_ASSERT(EnqueueBytesBlocking(pbuf1, SERIAL_RAM_BUFSIZE) == 0);
+    }
+    TEST_ASSERT(BufQueueFree() < SERIAL_RAM_BUFSIZE);
+    TEST_ASSERT(BufQueueUsed() == BufQueueSize() - BufQueueFree());
+
+    // Test overfilling
+    ret = EnqueueBytes(pbuf1, SERIAL_RAM_BUFSIZE, NULL);
+    TEST_ASSERT(ret == -ENOSPC);
+    deqCount = 0;
+
+    //
+    // Dequeue until empty
+    //
+    while (BufQueueUsed() > 0) {
+        TEST_ASSERT(DequeueBytesBlocking(pbuf2, SERIAL_RAM_BUFSIZE) == 0);
+        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
+            TEST_ASSERT_INT_EQ(((uint32 *) pbuf2)[i], deqCount);
+            deqCount++;
+        }
+    }
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
+    TEST_ASSERT(BufQueueUsed() == 0);
+
+    // Test over-dequeueing
+    ret = DequeueBytes(pbuf2, SERIAL_RAM_BUFSIZE, NULL);
+    TEST_ASSERT(ret == -ENODATA);
+
+    TEST_RETURN;
+}
+
+//
+// Blocks of a size that doesn't divide the queue size wrap around the end of
+// the queue mid-block, and cross from the first serial RAM to the second.
+// The queue is kept half full, so a block written to the wrong place
+// overwrites one that's still queued.
+//
+static void QueueTestBlock(
+    uint8 * buf,
+    uint32 bytes,
+    uint32 block
+    )
+{
+    for (int i = 0; i < bytes; i++) {
+        buf[i] = block + i * 7;
+    }
+}
+
+int TestQueueWrapAround()
+{
+    TEST_INIT;
+
+    static uint8 wbuf[1000];
+    static uint8 rbuf[sizeof(wbuf)];
+    static uint8 expected[sizeof(wbuf)];
+    uint32 enqBlocks = 0;
+    uint32 deqBlocks = 0;
+
+    BufQueueInit();
+    TEST_ASSERT_INT_EQ(BufQueueSize(), SerialRamRegionSize(SERIAL_RAM_REGION_AUDIO));
+
+    // Start at an odd offset
+    TEST_ASSERT(EnqueueBytesBlocking(wbuf, 123) == 0);
+    TEST_ASSERT(DequeueBytesBlocking(rbuf, 123) == 0);
+
+    while (enqBlocks * sizeof(wbuf) < 2 * BufQueueSize()) {
+        QueueTestBlock(wbuf, sizeof(wbuf), enqBlocks++);
+        TEST_ASSERT(EnqueueBytesBlocking(wbuf, sizeof(wbuf)) == 0);
+        if (BufQueueUsed() < BufQueueSize() / 2) continue;
+
+        TEST_ASSERT(DequeueBytesBlocking(rbuf, sizeof(rbuf)) == 0);
+        QueueTestBlock(expected, sizeof(expected), deqBlocks);
+        TEST_ASSERT_PRINT(memcmp(rbuf, expected, sizeof(rbuf)) == 0, "block %d", (int) deqBlocks);
+        deqBlocks++;
+    }
+    while (BufQueueUsed() > 0) {
+        TEST_ASSERT(DequeueBytesBlocking(rbuf, sizeof(rbuf)) == 0);
+        deqBlocks++;
+    }
+    TEST_ASSERT_INT_EQ(deqBlocks, enqBlocks);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
+
+    TEST_RETURN;
+}
+
+//
+// Several enqueues, then several dequeues, in flight at once.  The bus is held
+// so that they all wait in the SPI queue, and none complete until released.
+//
+int TestQueuePipelined()
+{
+    TEST_INIT;
+
+    static uint8 wbufs[QUEUE_MAX_PENDING][256];
+    static uint8 rbufs[QUEUE_MAX_PENDING][256];
+    static uint8 expected[256];
+    int enqDone[QUEUE_MAX_PENDING];
+    int deqDone[QUEUE_MAX_PENDING];
+    int i;
+
+    BufQueueInit();
+
+    TEST_ASSERT(SpiAcquireBus(0) == 0);
+    for (i = 0; i < QUEUE_MAX_PENDING; i++) {
+        QueueTestBlock(wbufs[i], sizeof(wbufs[i]), i);
+        TEST_ASSERT(EnqueueBytes(wbufs[i], sizeof(wbufs[i]), &enqDone[i]) == -EAGAIN);
+    }
+    TEST_ASSERT(EnqueueBytes(wbufs[0], sizeof(wbufs[0]), NULL) == -EBUSY);
+    TEST_ASSERT(!enqDone[0]);
+    TEST_ASSERT_INT_EQ(BufQueueUsed(), 0);
+    TEST_ASSERT_INT_EQ(BufQueueFree(), BufQueueSize() - sizeof(wbufs));
+    SpiReleaseBus();
+
+    while (!enqDone[QUEUE_MAX_PENDING - 1]);
+    for (i = 0; i < QUEUE_MAX_PENDING; i++) {
+        TEST_ASSERT(enqDone[i]);
+    }
+    TEST_ASSERT_INT_EQ(BufQueueUsed(), sizeof(wbufs));
+
+    TEST_ASSERT(SpiAcquireBus(0) == 0);
+    for (i = 0; i < QUEUE_MAX_PENDING; i++) {
+        TEST_ASSERT(DequeueBytes(rbufs[i], sizeof(rbufs[i]), &deqDone[i]) == -EAGAIN);
+    }
+    TEST_ASSERT(DequeueBytes(rbufs[0], 1, NULL) == -ENODATA);
+    TEST_ASSERT(!deqDone[0]);
+    TEST_ASSERT_INT_EQ(BufQueueUsed(), 0);
+    TEST_ASSERT_INT_EQ(BufQueueFree(), BufQueueSize() - sizeof(wbufs));
+    SpiReleaseBus();
+
+    while (!deqDone[QUEUE_MAX_PENDING - 1]);
+    for (i = 0; i < QUEUE_MAX_PENDING; i++) {
+        QueueTestBlock(expected, sizeof(expected), i);
+        TEST_ASSERT_PRINT(memcmp(rbufs[i], expected, sizeof(expected)) == 0, "block %d", i);
+    }
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
+
+    TEST_RETURN;
+}
+
+//
+// DequeuePacket() leaves the header alone, and dequeues as much as fits after
+// it.
+//
+int TestQueuePacket()
+{
+    TEST_INIT;
+
+    static uint32 packetWords[(100 + QUEUE_PACKET_HEADER_BYTES) / sizeof(uint32)];
+    uint8 * packet = (uint8 *) packetWords;
+    static uint8 wbuf[150];
+    uint32 payloadBytes;
+    int done;
+    int ret;
+
+    BufQueueInit();
+    QueueTestBlock(wbuf, sizeof(wbuf), 0);
+    TEST_ASSERT(EnqueueBytesBlocking(wbuf, sizeof(wbuf)) == 0);
+
+    memset(packet, 0xAA, sizeof(packetWords));
+    ret = DequeuePacket(packet, sizeof(packetWords), &payloadBytes, &done);
+    TEST_ASSERT(ret == 0 || ret == -EAGAIN);
+    while (!done);
+    TEST_ASSERT_INT_EQ(payloadBytes, 100);
+    TEST_ASSERT_INT_EQ(packet[QUEUE_PACKET_HEADER_BYTES - 1], 0xAA);
+    TEST_ASSERT(memcmp(&packet[QUEUE_PACKET_HEADER_BYTES], wbuf, 100) == 0);
+
+    // Short packet, of what's left
+    ret = DequeuePacket(packet, sizeof(packetWords), &payloadBytes, &done);
+    TEST_ASSERT(ret == 0 || ret == -EAGAIN);
+    while (!done);
+    TEST_ASSERT_INT_EQ(payloadBytes, 50);
+    TEST_ASSERT(memcmp(&packet[QUEUE_PACKET_HEADER_BYTES], &wbuf[100], 50) == 0);
+
+    TEST_ASSERT(DequeuePacket(packet, sizeof(packetWords), &payloadBytes, &done) == -ENODATA);
+    TEST_ASSERT(BufQueueFree() == BufQueueSize());
+
+    TEST_RETURN;
+}
+
+int TestQueueConcurrency()
+{
+    TEST_INIT;
+
+    int deqCount;
+    int i;
+
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint8 * pbuf2 = SerialRamGetBuf(1);
+
+    BufQueueInit();
+    enqCount = 0;
+    deqCount = 0;
+
+    //
+    // Fill queue until half full.
+    //
+    while (BufQueueUsed() < BufQueueSize()/2) {
+        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
+            ((uint32 *) pbuf1)[i] = enqCount++;
+        }
+        TEST_ASSERT(EnqueueBytesBlocking(pbuf1, SERIAL_RAM_BUFSIZE) == 0);
+    }
+
+    //
+    // Concurrent fill and empty at same time, with verify.
+    // Fill via timer interrupt, to test concurrency.
+    //
+    prevFree = BufQueueFree();
+    Timer_Programmable_SetOneShot(1);
+    Timer_Programmable_WritePeriod(enqPeriodUs);
+    Timer_Programmable_ISR_StartEx(DebugMemtestIsr);
+    Timer_Programmable_Enable();
+
+    while (deqCount < 30000) {
+        TEST_ASSERT_INT_EQ(DequeueBytesBlocking(pbuf2, SERIAL_RAM_BUFSIZE), 0);
+        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
+            TEST_ASSERT_INT_EQ(((uint32 *) pbuf2)[i], deqCount);
+            deqCount++;
+        }
+    }
+
+    Timer_Programmable_ISR_Stop();
+
+    TEST_RETURN;
+}
+
+//
+// Dump mic samples, with the gaps left by dropped blocks filled with silence,
+// then the stream stats.
+//
+int TestMicDump()
+{
+    int i;
+    int done;
+    uint32 gap;
+    struct I2S_STATS stats;
+    uint8 * pbuf3 = SerialRamGetBuf(2);
+
+    BufQueueInit();
+
+    I2sStartDma(NULL, NULL);
+    while (BufQueueUsed() < 100000);
+    I2sStopDma();
+
+    while (DequeueBytes(pbuf3, SERIAL_RAM_BUFSIZE, &done) != -ENODATA) {
+        while (!done);
+        if (pbuf3[3] != I2S_BLOCK_MAGIC) {
+            xprintf("Bad block header\r\n");
+            break;
+        }
+        gap = pbuf3[0] | (pbuf3[1] << 8) | (pbuf3[2] << 16);
+        while (gap--) {
+            xprintf("0000\r\n");
+        }
+        for (i = I2S_BLOCK_HEADER_BYTES; i < SERIAL_RAM_BUFSIZE; i += 2) {
+            xprintf("%04X\r\n", *((uint16 *) &pbuf3[i]));
+        }
+    }
+
+    I2sGetStats(&stats);
+    xprintf("blocks %d, dropped %d (bufs busy %d, queue full %d, pending full %d, SPI queue full %d), high water %d\r\n",
+        (int) stats.blocks, (int) stats.droppedBlocks, (int) stats.bufsBusy,
+        (int) stats.queueFull, (int) stats.pendingFull, (int) stats.spiQueueFull,
+        (int) stats.queueHighWater);
+
+    return 0;
+}
+
+//
+// Stream the mic with the bus held, so that enqueues stay pending while more
+// blocks are filled.  The stream bufs must not be refilled while pending -
+// blocks are dropped instead.  Then check what was queued: every block intact
+// (no two the same, as they would be if a pending buf were refilled), and the
+// drops marked as gaps.
+//
+#define TEST_MIC_MAX_BLOCKS 32
+int TestMicStreamPending()
+{
+    TEST_INIT;
+
+    static uint32 hashes[TEST_MIC_MAX_BLOCKS];
+    struct I2S_STATS stats;
+    uint8 * pbuf3 = SerialRamGetBuf(2);
+    uint32 gapSamples = 0;
+    uint32 gap;
+    int blocks = 0;
+    int done;
+    int i;
+    int j;
+
+    BufQueueInit();
+
+    TEST_ASSERT(SpiAcquireBus(0) == 0);
+    I2sStartDma(NULL, NULL);
+    do {
+        I2sGetStats(&stats);
+    } while (stats.droppedBlocks < 2);
+    TEST_ASSERT_INT_EQ(stats.blocks, QUEUE_MAX_PENDING);
+    TEST_ASSERT_INT_EQ(stats.bufsBusy, stats.droppedBlocks);
+    TEST_ASSERT_INT_EQ(BufQueueUsed(), 0);
+    SpiReleaseBus();
+
+    do {
+        I2sGetStats(&stats);
+    } while (stats.blocks < QUEUE_MAX_PENDING + 4);
+    I2sStopDma();
+    // Let the last block, and its enqueue, finish
+    CyDelay(20);
+    I2sGetStats(&stats);
+
+    while (DequeueBytes(pbuf3, SERIAL_RAM_BUFSIZE, &done) != -ENODATA) {
+        while (!done);
+        TEST_ASSERT_PRINT(pbuf3[3] == I2S_BLOCK_MAGIC, "block %d", blocks);
+        TEST_ASSERT(blocks < TEST_MIC_MAX_BLOCKS);
+
+        gap = pbuf3[0] | (pbuf3[1] << 8) | (pbuf3[2] << 16);
+        TEST_ASSERT_PRINT(gap % I2S_BLOCK_SAMPLES == 0, "block %d gap %d", blocks, (int) gap);
+        if (blocks == QUEUE_MAX_PENDING) {
+            TEST_ASSERT(gap >= 2 * I2S_BLOCK_SAMPLES);
+        }
+        gapSamples += gap;
+
+        hashes[blocks] = 0;
+        for (i = I2S_BLOCK_HEADER_BYTES; i < SERIAL_RAM_BUFSIZE; i++) {
+            hashes[blocks] = hashes[blocks] * 31 + pbuf3[i];
+        }
+        blocks++;
+    }
+
+    TEST_ASSERT_INT_EQ(blocks, stats.blocks);
+    TEST_ASSERT_INT_EQ(gapSamples, stats.droppedBlocks * I2S_BLOCK_SAMPLES);
+    TEST_ASSERT_INT_EQ(stats.droppedBlocks, stats.bufsBusy);
+    for (i = 0; i < blocks; i++) {
+        for (j = i + 1; j < blocks; j++) {
+            TEST_ASSERT_PRINT(hashes[i] != hashes[j], "blocks %d and %d", i, j);
+        }
+    }
+
+    TEST_RETURN;
+}
+
+//
+// Force the mic stream to drop blocks, by filling the queue so there is only
+// room for one stream block.  The drops must be counted, and the gap marked in
+// the header of the next block that is enqueued once there's room again.
+//
+int TestMicDropGap()
+{
+    TEST_INIT;
+
+    struct I2S_STATS stats;
+    uint8 * pbuf1 = SerialRamGetBuf(0);
+    uint8 * pbuf3 = SerialRamGetBuf(2);
+    uint32 gapSamples = 0;
+    uint32 gap;
+    int fillers = 0;
+    int blocks = 0;
+    int done;
+
+    BufQueueInit();
+    memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
+    while (BufQueueFree() >= 2 * SERIAL_RAM_BUFSIZE) {
+        TEST_ASSERT(EnqueueBytesBlocking(pbuf1, SERIAL_RAM_BUFSIZE) == 0);
+        fillers++;
+    }
+
+    I2sStartDma(NULL, NULL);
+    do {
+        I2sGetStats(&stats);
+    } while (stats.droppedBlocks < 2);
+    TEST_ASSERT_INT_EQ(stats.blocks, 1);
+    TEST_ASSERT_INT_EQ(stats.queueFull, stats.droppedBlocks);
+
+    // Make room
+    while (fillers--) {
+        TEST_ASSERT(DequeueBytesBlocking(pbuf3, SERIAL_RAM_BUFSIZE) == 0);
+        TEST_ASSERT(pbuf3[3] != I2S_BLOCK_MAGIC);
+    }
+
+    do {
+        I2sGetStats(&stats);
+    } while (stats.blocks < 3);
+    I2sStopDma();
+    // Let the last block, and its enqueue, finish
+    CyDelay(20);
+    I2sGetStats(&stats);
+
+    while (DequeueBytes(pbuf3, SERIAL_RAM_BUFSIZE, &done) != -ENODATA) {
+        while (!done);
+        TEST_ASSERT_PRINT(pbuf3[3] == I2S_BLOCK_MAGIC, "block %d", blocks);
+        gap = pbuf3[0] | (pbuf3[1] << 8) | (pbuf3[2] << 16);
+        if (blocks == 0) {
+            TEST_ASSERT_INT_EQ(gap, 0);
+        } else if (blocks == 1) {
+            TEST_ASSERT(gap >= 2 * I2S_BLOCK_SAMPLES);
+        }
+        gapSamples += gap;
+        blocks++;
+    }
+
+    TEST_ASSERT_INT_EQ(blocks, stats.blocks);
+    TEST_ASSERT_INT_EQ(gapSamples, stats.droppedBlocks * I2S_BLOCK_SAMPLES);
+
+    TEST_RETURN;
+}
+
+//
+// Fill an I2S stream block with a triangle wave, continuing from sample /t/.
+//
+static void AdpcmTestBlock(
+    uint8 * block,
+    int t,
+    uint32 gap
+    )
+{
+    block[0] = gap;
+    block[1] = gap >> 8;
+    block[2] = gap >> 16;
+    block[3] = I2S_BLOCK_MAGIC;
+    for (int i = 0; i < I2S_BLOCK_SAMPLES; i++) {
+        int phase = (t + i) % 64;
+        int16 sample = (phase < 32 ? phase : 64 - phase) * 500 - 8000;
+        block[I2S_BLOCK_HEADER_BYTES + 2 * i] = sample;
+        block[I2S_BLOCK_HEADER_BYTES + 2 * i + 1] = sample >> 8;
+    }
+}
+
+static struct ADPCM_STATE adpcmTestState;
+static uint8 adpcmTestIn[SERIAL_RAM_BUFSIZE];
+static uint8 adpcmTestOut[ADPCM_BLOCK_BYTES];
+static void AdpcmTestEncode()
+{
+    AdpcmEncodeBlock(&adpcmTestState, adpcmTestIn, adpcmTestOut);
+}
+
+int TestAdpcm()
+{
+    TEST_INIT;
+
+    int16 samples[I2S_BLOCK_SAMPLES];
+    uint32 gap;
+    int maxErr = 0;
+    int usecs;
+
+    AdpcmInit(&adpcmTestState);
+    for (int block = 0; block < 8; block++) {
+        int t = block * I2S_BLOCK_SAMPLES;
+
+        AdpcmTestBlock(adpcmTestIn, t, block == 5 ? 1234 : 0);
+        TEST_ASSERT_INT_EQ(AdpcmEncodeBlock(&adpcmTestState, adpcmTestIn, adpcmTestOut), ADPCM_BLOCK_BYTES);
+        TEST_ASSERT_INT_EQ(AdpcmDecodeBlock(adpcmTestOut, samples, &gap), I2S_BLOCK_SAMPLES);
+        TEST_ASSERT_INT_EQ(gap, block == 5 ? 1234 : 0);
+
+        // Skip the first block, while the step size adapts
+        for (int i = 0; block > 0 && i < I2S_BLOCK_SAMPLES; i++) {
+            int16 sample = adpcmTestIn[I2S_BLOCK_HEADER_BYTES + 2 * i]
+                | (adpcmTestIn[I2S_BLOCK_HEADER_BYTES + 2 * i + 1] << 8);
+            maxErr = MAX(maxErr, ABS(samples[i] - sample));
+        }
+    }
+    TEST_ASSERT_PRINT(maxErr < 400, "maxErr = %d", maxErr);
+
+    // Bad headers
+    adpcmTestIn[3] = 0;
+    TEST_ASSERT_INT_EQ(AdpcmEncodeBlock(&adpcmTestState, adpcmTestIn, adpcmTestOut), -EINVAL);
+    adpcmTestOut[3] = 0;
+    TEST_ASSERT_INT_EQ(AdpcmDecodeBlock(adpcmTestOut, samples, &gap), -EINVAL);
+
+    //
+    // Must keep up with the mic, with plenty to spare: a block is about 8 ms
+    // of audio.
+    //
+    AdpcmTestBlock(adpcmTestIn, 0, 0);
+    usecs = TimeIt(AdpcmTestEncode, 100);
+    TEST_ASSERT_PRINT(usecs < 1000, "usecs = %d", usecs);
+
+    TEST_RETURN;
+}
+
+//
+// DISPLAY FUNCTIONS
+//
+
+int TestDisplayEraseSpeed()
+{
+    TEST_INIT;
+
+    int usecs = TimeIt(DisplayErase, 30);
+    TEST_ASSERT_PRINT(usecs < 26000, "usecs = %d", usecs);
+
+    TEST_RETURN;
+}
+
+//
+// Small rects are dominated by the OLED command overhead (column/row/write
+// commands).  Compare a new window per rect with all rects in the same window
+// (where the column/row setup is skipped).
+//
+void DisplaySmallRects()
+{
+    int i;
+    for (i = 0; i < 16; i++) {
+        DisplayRect((i * 8) % SCREEN_WIDTH, (i * 5) % SCREEN_HEIGHT, 4, 4, i & 1 ? WHITE : RED);
+    }
+}
+void DisplaySmallRectsSameWindow()
+{
+    int i;
+    for (i = 0; i < 16; i++) {
+        DisplayRect(8, 5, 4, 4, i & 1 ? WHITE : RED);
+    }
+}
+int TestDisplaySmallRectSpeed()
+{
+    TEST_INIT;
+    int usecs, usecsSameWindow;
+
+    usecs = TimeIt(DisplaySmallRects, 100);
+    usecsSameWindow = TimeIt(DisplaySmallRectsSameWindow, 100);
+    TEST_ASSERT_PRINT(usecsSameWindow < usecs,
+        "usecs = %d, same window = %d", usecs, usecsSameWindow);
+
+    TEST_RETURN;
+}
+
+//
+// Window setup and small payloads go out as one command list, sent by PIO,
+// with one PIO write per D/C run.  Column and row setup is skipped when it
+// matches the current window.
+//
+int TestDisplayWindowCache()
+{
+    TEST_INIT;
+
+    int pioXfers;
+
+    DisplayRect(0, 0, 1, 1, BLACK);
+
+    // New column and row: col cmd, col args, row cmd, row args, write cmd, pixels
+    pioXfers = spiPioXfers;
+    DisplayRect(10, 10, 2, 2, RED);
+    TEST_ASSERT_INT_EQ(spiPioXfers - pioXfers, 6);
+
+    // Same window: write cmd, pixels
+    pioXfers = spiPioXfers;
+    DisplayRect(10, 10, 2, 2, BLUE);
+    TEST_ASSERT_INT_EQ(spiPioXfers - pioXfers, 2);
+
+    // Same rows: col cmd, col args, write cmd, pixels
+    pioXfers = spiPioXfers;
+    DisplayRect(20, 10, 2, 2, GREEN);
+    TEST_ASSERT_INT_EQ(spiPioXfers - pioXfers, 4);
+
+    TEST_RETURN;
+}
+
+//
+// DrawTextBox() sends each line, with its padding and the space below it, as
+// one bitmap: just the window setup (by PIO) and the pixels (by DMA).
+//
+int TestTextBoxStrips()
+{
+    TEST_INIT;
+    char * lines[] = { "One", "Two", "Three" };
+    int pioXfers;
+
+    // Three 5x8 lines plus spacing exactly fill the box
+    pioXfers = spiPioXfers;
+    DrawTextBox(lines, ARRAY_SIZEOF(lines), (RECT) {10, 10, 100, 27},
+        0, CENTER_JUSTIFIED, FONT_5X8, WHITE, BLUE);
+
+    // First line: col cmd, col args, row cmd, row args, write cmd.  Others
+    // are in the same columns: row cmd, row args, write cmd.
+    TEST_ASSERT_PRINT(spiPioXfers - pioXfers <= 5 + 3 + 3,
+        "pioXfers = %d", spiPioXfers - pioXfers);
+
+    TEST_RETURN;
+}
+
+//
+// Text is word wrapped, and appending only reflows and redraws from the line
+// before the change.
+//
+int TestTextLayout()
+{
+    TEST_INIT;
+    static char text[64];
+    static struct TEXT_LAYOUT layout;
+    char line[TEXT_LAYOUT_MAX_LINE_CHARS + 1];
+    RECT box = {10, 10, 60, 80};    // 10 'm's per line
+
+    strcpy(text, "the quick brown fox");
+    TextLayoutInit(&layout, text, box, FONT_5X8, WHITE, BLACK);
+    TEST_ASSERT_INT_EQ(layout.numLines, 2);
+    TextLayoutGetLine(&layout, 0, line);
+    TEST_ASSERT(strcmp(line, "the quick") == 0);
+    TextLayoutGetLine(&layout, 1, line);
+    TEST_ASSERT(strcmp(line, "brown fox") == 0);
+
+    // First line is unchanged, second loses its trailing space
+    strcat(text, " jumps over");
+    TEST_ASSERT_INT_EQ(TextLayoutUpdate(&layout, 19), 2);
+    TEST_ASSERT_INT_EQ(layout.numLines, 3);
+
+    // "dog" doesn't fit, so wraps
+    strcat(text, " dog");
+    TEST_ASSERT_INT_EQ(TextLayoutUpdate(&layout, 30), 2);
+    TEST_ASSERT_INT_EQ(layout.numLines, 4);
+    TextLayoutGetLine(&layout, 3, line);
+    TEST_ASSERT(strcmp(line, "dog") == 0);
+
+    // Long words are broken, and UTF-8 is one char per code point
+    strcpy(text, "mmmmmmmmmmmmmm caf\xC3\xA9");
+    TextLayoutInit(&layout, text, box, FONT_5X8, WHITE, BLACK);
+    TEST_ASSERT_INT_EQ(layout.numLines, 2);
+    TEST_ASSERT_INT_EQ(TextLayoutGetLine(&layout, 0, line), 10);
+    TEST_ASSERT_INT_EQ(TextLayoutGetLine(&layout, 1, line), 9);
+    TEST_ASSERT(strcmp(line, "mmmm caf?") == 0);
+
+    TEST_RETURN;
+}
+
+//
+// Text past TEXT_LAYOUT_MAX_LINES is left out, and the last line ends in an
+// ellipsis (making room for it) to show that.
+//
+int TestTextLayoutTruncated()
+{
+    TEST_INIT;
+    static char text[(TEXT_LAYOUT_MAX_LINES + 2) * 11 + 1];
+    static struct TEXT_LAYOUT layout;
+    char line[TEXT_LAYOUT_MAX_LINE_CHARS + 1];
+    RECT box = {10, 10, 60, 80};    // 10 'm's per line
+    int i;
+
+    text[0] = '\0';
+    for (i = 0; i < TEXT_LAYOUT_MAX_LINES; i++) {
+        strcat(text, "mmmmmmmmmm\n");
+    }
+    TextLayoutInit(&layout, text, box, FONT_5X8, WHITE, BLACK);
+    TEST_ASSERT_INT_EQ(layout.numLines, TEXT_LAYOUT_MAX_LINES);
+    TEST_ASSERT(!layout.truncated);
+    TextLayoutGetLine(&layout, TEXT_LAYOUT_MAX_LINES - 1, line);
+    TEST_ASSERT(strcmp(line, "mmmmmmmmmm") == 0);
+
+    // One line too many: the last line is redrawn with the ellipsis
+    strcat(text, "mmmmmmmmmm\n");
+    TEST_ASSERT_INT_EQ(TextLayoutUpdate(&layout, TEXT_LAYOUT_MAX_LINES * 11), 1);
+    TEST_ASSERT_INT_EQ(layout.numLines, TEXT_LAYOUT_MAX_LINES);
+    TEST_ASSERT(layout.truncated);
+    TextLayoutGetLine(&layout, TEXT_LAYOUT_MAX_LINES - 2, line);
+    TEST_ASSERT(strcmp(line, "mmmmmmmmmm") == 0);
+    TextLayoutGetLine(&layout, TEXT_LAYOUT_MAX_LINES - 1, line);
+    TEST_ASSERT_PRINT(strcmp(&line[strlen(line) - 3], "...") == 0, "line = %s", line);
+    TEST_ASSERT(strncmp(line, "mmmmmmmmm", strlen(line) - 3) == 0);
+    TEST_ASSERT(strlen(line) < 10 + 3);
+
+    // More text left out changes nothing on screen
+    strcat(text, "mmmmmmmmmm\n");
+    TEST_ASSERT_INT_EQ(TextLayoutUpdate(&layout, (TEXT_LAYOUT_MAX_LINES + 1) * 11), 0);
+    TEST_ASSERT(layout.truncated);
+
+    TEST_RETURN;
+}
+
+//
+// Text laid out without drawing (as for MSG_VIEW rows) wraps the same, and
+// UTF-8 chars become their ASCII stand-ins, one font char each.
+//
+int TestTextLayoutWrap()
+{
+    TEST_INIT;
+    static char text[] = "Ann\nIt\xE2\x80\x99s mmmmmmmmmm";
+    static struct TEXT_LAYOUT layout;
+    char line[TEXT_LAYOUT_MAX_LINE_CHARS + 1];
+    char chars[8 + 1];
+
+    TEST_ASSERT_INT_EQ(TextLayoutWrap(&layout, text, 60, FONT_5X8), 3);
+    TEST_ASSERT(!layout.truncated);
+    TextLayoutGetLine(&layout, 0, line);
+    TEST_ASSERT(strcmp(line, "Ann") == 0);
+    TextLayoutGetLine(&layout, 1, line);
+    TEST_ASSERT_PRINT(strcmp(line, "It's") == 0, "line = %s", line);
+    TextLayoutGetLine(&layout, 2, line);
+    TEST_ASSERT(strcmp(line, "mmmmmmmmmm") == 0);
+
+    TEST_ASSERT_INT_EQ(Utf8ToFontChars(text, chars, 8), 8);
+    TEST_ASSERT_PRINT(strcmp(chars, "Ann It's") == 0, "chars = %s", chars);
+
+    TEST_RETURN;
+}
+
+//
+// A list view only fetches and draws the rows a scroll step changes, so steps
+// cost the same for a short list as for a long one.
+//
+int listTestCount;
+int ListTestGetCount()
+{
+    return listTestCount;
+}
+void ListTestGetRow(
+    int index,
+    char text[LIST_VIEW_MAX_LINES][LIST_VIEW_MAX_CHARS + 1]
+    )
+{
+    snprintf(text[0], LIST_VIEW_MAX_CHARS + 1, "Message %d", index);
+    snprintf(text[1], LIST_VIEW_MAX_CHARS + 1, "A message preview that is too long to fit");
+}
+const struct LIST_VIEW_SOURCE listTestSource = { ListTestGetCount, ListTestGetRow };
+int TestListView()
+{
+    TEST_INIT;
+    static struct LIST_VIEW view;
+    int fetches;
+
+    for (int i = 0; i < 2; i++) {
+        listTestCount = i == 0 ? 5 : 500;
+
+        // 6 rows fit, so all 5 (or the first 6) are fetched
+        fetches = listViewRowFetches;
+        ListViewInit(&view, &listTestSource, 2, FONT_5X8, FONT_5X5, 1);
+        TEST_ASSERT_INT_EQ(listViewRowFetches - fetches, MIN(listTestCount, 6));
+
+        // Moving the selection on screen redraws the two rows, from SRAM
+        fetches = listViewRowFetches;
+        TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+        TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+        TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+        TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+        TEST_ASSERT_INT_EQ(listViewRowFetches - fetches, 0);
+        TEST_ASSERT_INT_EQ(ListViewGetSelected(&view), 4);
+    }
+
+    // Past the bottom of the screen, each step scrolls in (and fetches) one row
+    TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+    fetches = listViewRowFetches;
+    for (int i = 0; i < 20; i++) {
+        TEST_ASSERT_INT_EQ(ListViewScroll(&view, 1), 2);
+    }
+    TEST_ASSERT_INT_EQ(listViewRowFetches - fetches, 20);
+    TEST_ASSERT_INT_EQ(ListViewGetSelected(&view), 25);
+
+    // Rows are truncated to fit
+    TEST_ASSERT(GetTextWidth(view.rows[0].text[1], FONT_5X5) <= SCREEN_WIDTH);
+    TEST_ASSERT(strlen(view.rows[0].text[1]) < strlen("A message preview that is too long to fit"));
+
+    // Scrolling a list without selection scrolls in one row per step
+    listTestCount = 500;
+    ListViewInit(&view, &listTestSource, 1, FONT_5X8, FONT_5X8, 0);
+    fetches = listViewRowFetches;
+    for (int i = 0; i < 20; i++) {
+        TEST_ASSERT(ListViewScroll(&view, 1) <= 2);
+    }
+    TEST_ASSERT(listViewRowFetches - fetches <= 21);
+
+    // Too far to scroll in hardware, so all 10 rows on screen are redrawn
+    TEST_ASSERT_INT_EQ(ListViewScroll(&view, -1000), 10);
+
+    DisplayErase();
+
+    TEST_RETURN;
+}
+
+//
+// Messages are stored compressed, read back intact, and evicted oldest first
+// when either the index or the log fills up.  Empties the store, so this only
+// runs at boot, before BLE can add any messages (see SmOff()).
+//
+int TestMsgStore()
+{
+    TEST_INIT;
+    static char body[MSG_STORE_MAX_TEXT + 1];
+    static uint8 packed[MSG_STORE_MAX_PACKED];
+    char * text = "Jason\0Are you free for lunch tomorrow? Let me know when works";
+    int textLen = 5 + 1 + strlen(&text[6]);
+    char buf[MSG_STORE_MAX_TEXT];
+    struct MSG_STORE_ENTRY entry;
+    uint32 rand = 1;
+    int n;
+
+    TEST_ASSERT_INT_EQ(MsgStoreInit(), 0);
+    TEST_ASSERT_INT_EQ(MsgStoreGetCount(), 0);
+
+    n = MsgStorePack(text, textLen, packed);
+    TEST_ASSERT_PRINT(n < textLen * 3 / 4, "%d bytes packed to %d", textLen, n);
+
+    TEST_ASSERT_INT_EQ(MsgStoreAdd(10, 1000, "Jason", &text[6]), 0);
+    TEST_ASSERT_INT_EQ(MsgStoreAdd(11, 2000, "Mom", "Call me"), 0);
+    TEST_ASSERT_INT_EQ(MsgStoreAdd(10, 3000, "Jason", "Again"), -EEXIST);
+    TEST_ASSERT_INT_EQ(MsgStoreGetCount(), 2);
+    TEST_ASSERT_INT_EQ(MsgStoreFind(10), 1);
+    TEST_ASSERT_INT_EQ(MsgStoreFind(12), -ENOENT);
+
+    // Newest first
+    TEST_ASSERT_INT_EQ(MsgStoreGetEntry(0, &entry), 0);
+    TEST_ASSERT_INT_EQ(entry.id, 11);
+    TEST_ASSERT_INT_EQ(entry.timestamp, 2000);
+    TEST_ASSERT_INT_EQ(MsgStoreRead(0, buf, sizeof(buf)), 4 + 7);
+    TEST_ASSERT(memcmp(buf, "Mom\0Call me", 4 + 7) == 0);
+    TEST_ASSERT_INT_EQ(MsgStoreRead(1, buf, sizeof(buf)), textLen);
+    TEST_ASSERT(memcmp(buf, text, textLen) == 0);
+    TEST_ASSERT_INT_EQ(MsgStoreRead(1, buf, 8), 8);
+    TEST_ASSERT(memcmp(buf, text, 8) == 0);
+    TEST_ASSERT_INT_EQ(MsgStoreRead(2, buf, sizeof(buf)), -EINVAL);
+
+    TEST_ASSERT_INT_EQ(MsgStoreGetUnread(), 2);
+    TEST_ASSERT_INT_EQ(MsgStoreMarkRead(1), 0);
+    TEST_ASSERT_INT_EQ(MsgStoreGetUnread(), 1);
+    TEST_ASSERT_INT_EQ(MsgStoreGetEntry(1, &entry), 0);
+    TEST_ASSERT(entry.flags & MSG_STORE_FLAG_READ);
+
+    // Index full: the oldest are evicted
+    for (int i = 0; i < MSG_STORE_MAX_MSGS; i++) {
+        snprintf(buf, sizeof(buf), "Message %d", i);
+        TEST_ASSERT_INT_EQ(MsgStoreAdd(100 + i, i, "Sender", buf), 0);
+    }
+    TEST_ASSERT_INT_EQ(MsgStoreGetCount(), MSG_STORE_MAX_MSGS);
+    TEST_ASSERT_INT_EQ(MsgStoreFind(10), -ENOENT);
+    TEST_ASSERT_INT_EQ(MsgStoreFind(11), -ENOENT);
+    TEST_ASSERT_INT_EQ(MsgStoreFind(100), MSG_STORE_MAX_MSGS - 1);
+
+    //
+    // Log full: messages that don't compress fill the log before the index,
+    // and wrap around the end of it.  Bodies are truncated to fit.
+    //
+    for (int i = 0; i < 2 * MSG_STORE_BYTES / MSG_STORE_MAX_PACKED; i++) {
+        for (int j = 0; j < MSG_STORE_MAX_TEXT; j++) {
+            rand = rand * 1103515245 + 12345;
+            body[j] = ' ' + (rand >> 16) % 95;
+        }
+        body[MSG_STORE_MAX_TEXT] = '\0';
+        TEST_ASSERT_INT_EQ(MsgStoreAdd(1000 + i, i, "Noise", body), 0);
+    }
+    n = MsgStoreGetCount();
+    TEST_ASSERT_PRINT(n > 1 && n < MSG_STORE_MAX_MSGS,
+        "%d messages", n);
+    TEST_ASSERT_INT_EQ(MsgStoreRead(0, buf, sizeof(buf)), MSG_STORE_MAX_TEXT);
+    TEST_ASSERT(memcmp(buf, "Noise\0", 6) == 0);
+    TEST_ASSERT(memcmp(&buf[6], body, MSG_STORE_MAX_TEXT - 6) == 0);
+
+    TEST_ASSERT_INT_EQ(MsgStoreInit(), 0);
+
+    TEST_RETURN;
+}
+
+//
+// @return index of /r/ in /rects/, or -1 if not found
+//
+static int FindRect(
+    RECT * rects,
+    int num,
+    RECT r
+    )
+{
+    for (int i = 0; i < num; i++) {
+        if (rects[i].x == r.x && rects[i].y == r.y
+            && rects[i].width == r.width && rects[i].height == r.height)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Framebuffer pixels land column-major in serial RAM, and the dirty rects are
+// tracked (and merged when touching) until flushed.
+//
+int TestFramebuf()
+{
+    TEST_INIT;
+
+    RECT rects[FRAMEBUF_MAX_DIRTY_RECTS];
+    uint16 pixels[2];
+    uint32 address;
+    int n;
+
+    TEST_ASSERT_INT_EQ(FramebufInit(), 0);
+    address = SerialRamRegionAddress(SERIAL_RAM_REGION_FRAMEBUF);
+    n = FramebufGetDirtyRects(rects);
+    TEST_ASSERT_INT_EQ(n, 1);
+    TEST_ASSERT(FindRect(rects, n, SCREEN_BOUNDS) >= 0);
+    FramebufFlush();
+    TEST_ASSERT_INT_EQ(FramebufGetDirtyRects(rects), 0);
+
+    FramebufRect((RECT) {10, 10, 2, 2}, RED);
+    FramebufRect((RECT) {40, 40, 2, 2}, BLUE);
+    TEST_ASSERT_INT_EQ(FramebufGetDirtyRects(rects), 2);
+
+    // Touches the first rect, so merges with it
+    FramebufRect((RECT) {12, 10, 2, 2}, WHITE);
+    n = FramebufGetDirtyRects(rects);
+    TEST_ASSERT_INT_EQ(n, 2);
+    TEST_ASSERT(FindRect(rects, n, (RECT) {10, 10, 4, 2}) >= 0);
+    TEST_ASSERT(FindRect(rects, n, (RECT) {40, 40, 2, 2}) >= 0);
+
+    TEST_ASSERT(SerialRamReadBlocking((uint8 *) pixels,
+        address + (11 * SCREEN_HEIGHT + 10) * sizeof(uint16), sizeof(pixels)) == 0);
+    TEST_ASSERT_INT_EQ(pixels[0], RED);
+    TEST_ASSERT_INT_EQ(pixels[1], RED);
+    TEST_ASSERT(SerialRamReadBlocking((uint8 *) pixels,
+        address + (12 * SCREEN_HEIGHT + 11) * sizeof(uint16), sizeof(pixels)) == 0);
+    TEST_ASSERT_INT_EQ(pixels[0], WHITE);
+    TEST_ASSERT_INT_EQ(pixels[1], BLACK);
+
+    FramebufFlush();
+    TEST_ASSERT_INT_EQ(FramebufGetDirtyRects(rects), 0);
+
+    TEST_RETURN;
+}
+
+//
+// In 8 bit color, colors are reduced to RGB332 (exact for the primaries, black
+// and white), what's in the framebuffer is converted on switching, and
+// drawing an image switches back to 16 bit color.
+//
+void FlushFullScreen()
+{
+    FramebufMarkDirty(SCREEN_BOUNDS);
+    FramebufFlush();
+}
+int TestFramebufDepth()
+{
+    TEST_INIT;
+    int usecs, usecs8;
+
+    TEST_ASSERT_INT_EQ(FramebufInit(), 0);
+    TEST_ASSERT_INT_EQ(FramebufSetDepth(12), -EINVAL);
+    FramebufRect((RECT) {0, 0, 2, 2}, RED);
+    FramebufRect((RECT) {SCREEN_WIDTH - 2, 0, 2, 2}, GOLD);
+    usecs = TimeIt(FlushFullScreen, 3);
+
+    TEST_ASSERT_INT_EQ(FramebufSetDepth(8), 0);
+    TEST_ASSERT_INT_EQ(FramebufGetDepth(), 8);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(1, 1), RED);
+    TEST_ASSERT(FramebufGetPixel(SCREEN_WIDTH - 1, 1) != GOLD);
+    FramebufRect((RECT) {0, 2, 2, 2}, BLUE);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(1, 3), BLUE);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(2, 3), BLACK);
+    usecs8 = TimeIt(FlushFullScreen, 3);
+    TEST_ASSERT_PRINT(usecs8 < usecs, "usecs = %d, 8 bit = %d", usecs, usecs8);
+
+    DrawToFramebuf(1);
+    DrawImage(IMAGE_BELL, 50, 10);
+    DrawToFramebuf(0);
+    TEST_ASSERT_INT_EQ(FramebufGetDepth(), 16);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(1, 1), RED);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(1, 3), BLUE);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(57, 11), GOLD);
+    FramebufFlush();
+
+    TEST_RETURN;
+}
+
+//
+// SPI bus bytes of a full screen fill: 2 per pixel straight to the OLED, and
+// through the framebuffer, 6 in 16 bit color and 4 in 8 bit color (written to
+// and read back from serial RAM, then sent to the OLED as RGB565).  Besides
+// the pixels, there are only commands and serial RAM headers.
+//
+static uint32 FillBusBytes(
+    int toFramebuf
+    )
+{
+    uint32 bytes = spiBusBytes;
+
+    if (toFramebuf) {
+        FramebufRect(SCREEN_BOUNDS, RED);
+        FramebufFlush();
+    } else {
+        DisplayRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, RED);
+    }
+    return spiBusBytes - bytes;
+}
+int TestFramebufBusBytes()
+{
+    TEST_INIT;
+    const uint32 pixels = SCREEN_WIDTH * SCREEN_HEIGHT;
+    const uint32 overhead = pixels / 16;
+    uint32 direct, bytes16, bytes8;
+
+    TEST_ASSERT_INT_EQ(FramebufInit(), 0);
+    FramebufFlush();
+
+    direct = FillBusBytes(0);
+    bytes16 = FillBusBytes(1);
+    TEST_ASSERT_INT_EQ(FramebufSetDepth(8), 0);
+    bytes8 = FillBusBytes(1);
+    TEST_ASSERT_INT_EQ(FramebufSetDepth(16), 0);
+
+    xprintf("Full screen fill bus bytes: direct %d, framebuf 16 bit %d, 8 bit %d\r\n",
+        (int) direct, (int) bytes16, (int) bytes8);
+    TEST_ASSERT_PRINT(direct >= 2 * pixels && direct < 2 * pixels + overhead,
+        "direct = %d", (int) direct);
+    TEST_ASSERT_PRINT(bytes16 >= 6 * pixels && bytes16 < 6 * pixels + overhead,
+        "16 bit = %d", (int) bytes16);
+    TEST_ASSERT_PRINT(bytes8 >= 4 * pixels && bytes8 < 4 * pixels + overhead,
+        "8 bit = %d", (int) bytes8);
+
+    DisplayErase();
+
+    TEST_RETURN;
+}
+
+//
+// The display list sends one transfer per tile (band of rows) that the list's
+// bounding box touches.
+//
+int TestDrawListTiles()
 {
     TEST_INIT;
 
-    int deqCount;
-    int enqCount;
-    int ret;
-    int i;
-
-    uint8 * pbuf1 = SerialRamGetBuf(0);
-    uint8 * pbuf2 = SerialRamGetBuf(1);
-
-    BufQueueInit();
-    memset(pbuf1, 0, SERIAL_RAM_BUFSIZE);
-    memset(pbuf2, 0, SERIAL_RAM_BUFSIZE);
-    enqCount = 0;
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
-    TEST_ASSERT(BufQueueUsed() == 0);
+    DrawListBegin(BLACK);
+    TEST_ASSERT_INT_EQ(DrawListEnd(), 0);
 
-    //
-    // Enqueue until full
-    //
-    while (BufQueueFree() >= SERIAL_RAM_BUFSIZE) {
-        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
-            ((uint32 *) pbuf1)[i] = enqCount++;
-        }
-        TEST_ASSERT(EnqueueBytesBlocking(pbuf1, SERIAL_RAM_BUFSIZE) == 0);
-    }
-    TEST_ASSERT(BufQueueFree() == 0);
-    TEST_ASSERT(BufQueueUsed() == QUEUE_SIZE);
+    // Full screen, with overlapping draws
+    DrawListBegin(BLACK);
+    DrawRect(SCREEN_BOUNDS, BLUE);
+    DrawText("Tiles", 10, 10, FONT_5X8, WHITE, BLACK);
+    DrawLine(0, 0, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1, RED);
+    TEST_ASSERT_INT_EQ(DrawListEnd(), SCREEN_HEIGHT / 16);
 
-    // Test overfilling
-    ret = EnqueueBytes(pbuf1, SERIAL_RAM_BUFSIZE, NULL);
-    TEST_ASSERT(ret == -ENOSPC);
-    deqCount = 0;
+    // Within the first tile
+    DrawListBegin(BLACK);
+    DrawRect((RECT) {10, 2, 20, 10}, GREEN);
+    TEST_ASSERT_INT_EQ(DrawListEnd(), 1);
 
-    //
-    // Dequeue until empty
-    //
-    while (BufQueueUsed() > 0) {
-        TEST_ASSERT(DequeueBytesBlocking(pbuf2, SERIAL_RAM_BUFSIZE) == 0);
-        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
-            TEST_ASSERT_INT_EQ(((uint32 *) pbuf2)[i], deqCount);
-            deqCount++;
-        }
-    }
-    TEST_ASSERT(BufQueueFree() == QUEUE_SIZE);
-    TEST_ASSERT(BufQueueUsed() == 0);
+    // Straddles the first two tiles
+    DrawListBegin(BLACK);
+    DrawRect((RECT) {10, 10, 20, 10}, GREEN);
+    TEST_ASSERT_INT_EQ(DrawListEnd(), 2);
 
-    // Test over-dequeueing
-    ret = DequeueBytes(pbuf2, SERIAL_RAM_BUFSIZE, NULL);
-    TEST_ASSERT(ret == -ENODATA);
+    // Off screen
+    DrawListBegin(BLACK);
+    DrawRect((RECT) {-20, 10, 10, 10}, GREEN);
+    TEST_ASSERT_INT_EQ(DrawListEnd(), 0);
 
     TEST_RETURN;
 }
 
-int TestQueueConcurrency()
+//
+// Images decode to the same pixels drawn directly (clipped by the screen) or
+// from a display list.  The bell icon is GOLD, with a DARK_ORANGE clapper at
+// its column 7, row 14, on BLACK.
+//
+int TestImageDecode()
 {
     TEST_INIT;
+    const struct IMAGE * bell = &images[IMAGE_BELL];
 
-    int deqCount;
-    int i;
-
-    uint8 * pbuf1 = SerialRamGetBuf(0);
-    uint8 * pbuf2 = SerialRamGetBuf(1);
-
-    BufQueueInit();
-    enqCount = 0;
-    deqCount = 0;
+    TEST_ASSERT(bell->size * 2 < bell->width * bell->height * sizeof(uint16));
 
-    //
-    // Fill queue until half full.
-    //
-    while (BufQueueUsed() < QUEUE_SIZE/2) {
-        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
-            ((uint32 *) pbuf1)[i] = enqCount++;
-        }
-        TEST_ASSERT(EnqueueBytesBlocking(pbuf1, SERIAL_RAM_BUFSIZE) == 0);
-    }
+    TEST_ASSERT_INT_EQ(FramebufInit(), 0);
+    DrawToFramebuf(1);
 
-    //
-    // Concurrent fill and empty at same time, with verify.
-    // Fill via timer interrupt, to test concurrency.
-    //
-    prevFree = BufQueueFree();
-    Timer_Programmable_SetOneShot(1);
-    Timer_Programmable_WritePeriod(enqPeriodUs);
-    Timer_Programmable_ISR_StartEx(DebugMemtestIsr);
-    Timer_Programmable_Enable();
+    DrawImage(IMAGE_BELL, -4, SCREEN_HEIGHT - 10);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(0, SCREEN_HEIGHT - 10), BLACK);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(3, SCREEN_HEIGHT - 9), GOLD);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(11, SCREEN_HEIGHT - 1), BLACK);
 
-    while (deqCount < 30000) {
-        TEST_ASSERT_INT_EQ(DequeueBytesBlocking(pbuf2, SERIAL_RAM_BUFSIZE), 0);
-        for (i = 0; i < SERIAL_RAM_BUFSIZE/sizeof(uint32); i++) {
-            TEST_ASSERT_INT_EQ(((uint32 *) pbuf2)[i], deqCount);
-            deqCount++;
-        }
-    }
+    DrawListBegin(RED);
+    DrawImage(IMAGE_BELL, 50, 10);
+    DrawListEnd();
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(50, 10), BLACK);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(57, 11), GOLD);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(57, 24), DARK_ORANGE);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(58, 24), DARK_ORANGE);
+    TEST_ASSERT_INT_EQ(FramebufGetPixel(59, 24), BLACK);
 
-    Timer_Programmable_ISR_Stop();
+    DrawToFramebuf(0);
+    FramebufFlush();
 
     TEST_RETURN;
 }
 
-int TestMicDump()
+//
+// Glyphs are 1bpp, expanded to RGB565 a word at a time for any colors, so
+// colored text should cost the same as WHITE on BLACK.
+//
+void DrawTextWhiteOnBlack() { DrawText("The quick brown fox", 0, 0, FONT_5X8, WHITE, BLACK); }
+void DrawTextColored() { DrawText("The quick brown fox", 0, 0, FONT_5X8, YELLOW, BLUE); }
+int TestDrawTextSpeed()
 {
-    int i;
-    int done;
-    uint8 * pbuf3 = SerialRamGetBuf(2);
+    TEST_INIT;
+    int usecs, usecsColored;
 
-    BufQueueInit();
+    usecs = TimeIt(DrawTextWhiteOnBlack, 100);
+    usecsColored = TimeIt(DrawTextColored, 100);
+    TEST_ASSERT_PRINT(usecsColored <= usecs * 11 / 10,
+        "usecs = %d, colored = %d", usecs, usecsColored);
 
-    I2sStartDma(NULL, NULL);
-    while (BufQueueUsed() < 100000);
-    I2sStopDma();
+    TEST_RETURN;
+}
 
-    while (DequeueBytes(pbuf3, SERIAL_RAM_BUFSIZE, &done) != -ENODATA) {
-        while (!done);
-        for (i = 0; i < SERIAL_RAM_BUFSIZE; i += 2) {
-            xprintf("%04X\r\n", *((uint16 *) &pbuf3[i]));
-        }
+//
+// Whole chars are colored once, then copied from the glyph cache, with the
+// least recently used glyph evicted.
+//
+int TestGlyphCache()
+{
+    TEST_INIT;
+    int hits, misses;
+    int fg = RGB565(1 << 3, 2 << 2, 3 << 3);
+    char s[] = "?";
+
+    hits = glyphCacheHits;
+    misses = glyphCacheMisses;
+    DrawText("Q", 0, 0, FONT_5X8, fg, BLACK);
+    TEST_ASSERT_INT_EQ(glyphCacheMisses - misses, 1);
+    DrawText("QQQ", 0, 0, FONT_5X8, fg, BLACK);
+    TEST_ASSERT_INT_EQ(glyphCacheHits - hits, 3);
+    TEST_ASSERT_INT_EQ(glyphCacheMisses - misses, 1);
+
+    // Different colors or font is a different glyph
+    DrawText("Q", 0, 0, FONT_5X8, fg, BLUE);
+    DrawText("Q", 0, 0, FONT_5X5, fg, BLACK);
+    TEST_ASSERT_INT_EQ(glyphCacheMisses - misses, 3);
+
+    // Clipped chars aren't cached
+    DrawTextBounded("Q", 0, 0, FONT_5X8, fg, BLACK, (RECT) {0, 0, 3, 3});
+    TEST_ASSERT_INT_EQ(glyphCacheMisses - misses, 3);
+    TEST_ASSERT_INT_EQ(glyphCacheHits - hits, 3);
+
+    // Fill the cache with other glyphs, evicting the first Q
+    for (int i = 0; i < GLYPH_CACHE_SLOTS; i++) {
+        s[0] = 'a' + i;
+        DrawText(s, 0, 0, FONT_5X8, fg, BLACK);
     }
+    misses = glyphCacheMisses;
+    DrawText("Q", 0, 0, FONT_5X8, fg, BLACK);
+    TEST_ASSERT_INT_EQ(glyphCacheMisses - misses, 1);
 
-    return 0;
+    TEST_RETURN;
 }
 
 //
-// DISPLAY FUNCTIONS
+// The watch face draws only what changed: one run of chars for a seconds
+// tick, and icons only when their state changes.
 //
-
-int TestDisplayEraseSpeed()
+int TestWatchFace()
 {
     TEST_INIT;
+    struct WATCH_FACE face = {12, 59, 58, 0, 0, 0};
 
-    int usecs = TimeIt(DisplayErase, 30);
-    TEST_ASSERT_PRINT(usecs < 26000, "usecs = %d", usecs);
+    DisplayErase();
+    WatchFaceInvalidate();
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 3);
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 0);
+
+    face.seconds = 59;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 1);
+
+    // "12:59:59" -> "13:00:00" is three runs: "3", "00", "00"
+    face.hours = 13;
+    face.minutes = 0;
+    face.seconds = 0;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 3);
+
+    face.bleConnected = 1;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 1);
+
+    face.month = 7;
+    face.day = 4;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 1);
+
+    //
+    // Digits are in fixed cells, so a '1' coming or going (it's narrower
+    // than other digits) only redraws its own cells, not the whole field:
+    // "13:00:00" -> "13:19:59" -> "13:20:00" -> "13:20:01" is two runs, two
+    // runs, then one.
+    //
+    face.minutes = 19;
+    face.seconds = 59;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 2);
+    face.minutes = 20;
+    face.seconds = 0;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 2);
+    face.seconds = 1;
+    TEST_ASSERT_INT_EQ(WatchFaceDraw(&face), 1);
 
     TEST_RETURN;
 }
@@ -654,6 +2032,7 @@ int TestDoRectsIntersect()
     // Invalid height width
     TEST_ASSERT(! DoRectsIntersect((RECT) {0, 0, -1, -1}, (RECT) {0, 0, -1, -1}));
     TEST_ASSERT(! DoRectsIntersect((RECT) {0, 0, -1, -1}, (RECT) {10, 10, -1, -1}));
+    TEST_ASSERT(! DoRectsIntersect((RECT) {10, 95, 10, -88}, (RECT) {0, 0, 128, 96}));
 
     // 10x10 Corners just missing
     TEST_ASSERT(! DoRectsIntersect((RECT) {0, 0, 10, 10}, (RECT) {10, 10, 10, 10}));
@@ -852,6 +2231,56 @@ void TestDrawLineHorzVert()
     CyDelay(MTEST_DELAY);
 }
 
+//
+// Overlapping primitives composed in the display list, then sent per tile.
+//
+void TestDrawList()
+{
+    char * lines[] = {
+        "Display list",
+        "composed per",
+        "4KB tile",
+    };
+
+    DisplayErase();
+
+    DrawListBegin(BLACK);
+    CenteredText("DrawList", 0, -1);
+    DrawRect((RECT) {10, 15, 60, 60}, BLUE);
+    DrawRect((RECT) {40, 35, 60, 50}, RED);
+    DrawTextBox(lines, ARRAY_SIZEOF(lines), (RECT) {20, 40, 90, 30},
+        0, CENTER_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+    for (int i = 0; i < SCREEN_WIDTH; i += 16) {
+        DrawLine(i, 10, SCREEN_WIDTH - 1 - i, SCREEN_HEIGHT - 1, GREEN);
+    }
+    DrawPoint(5, 90, WHITE);
+    DrawListEnd();
+
+    CyDelay(MTEST_DELAY);
+}
+
+//
+// Diagonal lines are rasterized into runs, and the runs batched into command
+// lists.  TestDrawLineSpeed() times them against plotting the same pixels
+// one at a time.
+//
+void DrawDiagLines()
+{
+    int i;
+    for (i = 0; i < SCREEN_WIDTH; i += 16) {
+        DrawLine(i, 0, SCREEN_WIDTH - 1 - i, SCREEN_HEIGHT - 1, i & 16 ? WHITE : RED);
+    }
+}
+void DrawDiagLinesByPoint()
+{
+    int i, y;
+    for (i = 0; i < SCREEN_WIDTH; i += 16) {
+        int dx = SCREEN_WIDTH - 1 - 2 * i;
+        for (y = 0; y < SCREEN_HEIGHT; y++) {
+            DrawPoint(i + dx * y / (SCREEN_HEIGHT - 1), y, i & 16 ? WHITE : RED);
+        }
+    }
+}
 void TestDrawLineDiag()
 {
     DisplayErase();
@@ -886,6 +2315,42 @@ void TestDrawLineDiag()
     CyDelay(MTEST_DELAY);
 }
 
+int TestDrawLineSpeed()
+{
+    TEST_INIT;
+    int usecs, usecsByPoint;
+
+    usecs = TimeIt(DrawDiagLines, 10);
+    usecsByPoint = TimeIt(DrawDiagLinesByPoint, 10);
+    TEST_ASSERT_PRINT(usecs < usecsByPoint,
+        "usecs = %d, by point = %d", usecs, usecsByPoint);
+
+    TEST_RETURN;
+}
+
+//
+// Filled shapes: an analog watch face from circles, arcs, a polygon and thick
+// lines.  Arc angles are clockwise degrees from 12 o'clock.
+//
+void TestDrawShapes()
+{
+    POINT triangle[] = { {100, 70}, {124, 92}, {90, 92} };
+    int cx = 48, cy = 48;
+
+    DisplayErase();
+
+    DrawCircle(cx, cy, 44, BLUE);
+    DrawCircle(cx, cy, 40, BLACK);
+    DrawArc(cx, cy, 44, 4, 0, 120, RED);
+    DrawArc(cx, cy, 36, 2, 200, 340, GREEN);
+    DrawThickLine(cx, cy, cx + 20, cy - 18, 4, WHITE);
+    DrawThickLine(cx, cy, cx - 6, cy + 30, 2, WHITE);
+    DrawCircle(cx, cy, 3, RED);
+    DrawPolygon(triangle, ARRAY_SIZEOF(triangle), YELLOW);
+
+    CyDelay(MTEST_DELAY);
+}
+
 void TestDrawRect()
 {
     DisplayErase();
@@ -900,16 +2365,196 @@ void TestDrawRect()
 
 void TestDrawImage()
 {
+    DisplayErase();
+
+    CenteredText("DrawImage(), OOB", 0, -1);
+
+    for (int x = 8; x < SCREEN_WIDTH - 16; x += 24) {
+        DrawImage(IMAGE_BELL, x, 30);
+    }
+    DrawImage(IMAGE_BELL, -8, 60);
+    DrawImage(IMAGE_BELL, SCREEN_WIDTH - 8, 60);
+    DrawImage(IMAGE_BELL, 56, SCREEN_HEIGHT - 8);
+
     CyDelay(MTEST_DELAY);
 }
 
+char * scrollLines[] = {
+    "00 SCROLL ------------------",
+    "01 AAAAAAAAAAAAAAAAAAAAAAAAA",
+    "02 BBBBBBBBBBBBBBBBBBBBBBBBB",
+    "03 CCCCCCCCCCCCCCCCCCCCCCCCC",
+    "04 DDDDDDDDDDDDDDDDDDDDDDDDD",
+    "05 EEEEEEEEEEEEEEEEEEEEEEEEE",
+    "06 FFFFFFFFFFFFFFFFFFFFFFFFF",
+    "07 GGGGGGGGGGGGGGGGGGGGGGGGG",
+    "08 HARDWARE SCROLLED -------",
+    "09 IIIIIIIIIIIIIIIIIIIIIIIII",
+    "10 JJJJJJJJJJJJJJJJJJJJJJJJJ",
+    "11 KKKKKKKKKKKKKKKKKKKKKKKKK",
+    "12 LLLLLLLLLLLLLLLLLLLLLLLLL",
+    "13 MMMMMMMMMMMMMMMMMMMMMMMMM",
+    "14 NNNNNNNNNNNNNNNNNNNNNNNNN",
+    "15 OOOOOOOOOOOOOOOOOOOOOOOOO",
+    "16 END ---------------------",
+};
+int scrollShiftUp;
+
+//
+// Scrolling one row at a time by moving the OLED start line only draws the
+// one exposed row, so should be much faster than redrawing the text box.
+//
+void ScrollOneRowByRedraw()
+{
+    scrollShiftUp = (scrollShiftUp + 1) % 32;
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        scrollShiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+}
+void ScrollOneRowByStartLine()
+{
+    int from = scrollShiftUp;
+    scrollShiftUp = (scrollShiftUp + 1) % 32;
+    DrawTextBoxScroll(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        from, scrollShiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+}
+int TestDisplayScrollSpeed()
+{
+    TEST_INIT;
+    int usecs, usecsStartLine;
+
+    scrollShiftUp = 0;
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        scrollShiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+    usecs = TimeIt(ScrollOneRowByRedraw, 30);
+    usecsStartLine = TimeIt(ScrollOneRowByStartLine, 30);
+    TEST_ASSERT_PRINT(usecsStartLine * 10 < usecs,
+        "usecs = %d, start line = %d", usecs, usecsStartLine);
+
+    TEST_RETURN;
+}
+
+//
+// Prefix widths give the width of the text at any length, and the longest
+// prefix that fits.
+//
+int TestTextMeasure()
+{
+    TEST_INIT;
+    uint16 widths[8];
+    RECT r;
+
+    // "i" is narrower than "m" in FONT_5X8
+    TEST_ASSERT_INT_EQ(GetTextPrefixWidths("mim", FONT_5X8, widths, 8), 3);
+    TEST_ASSERT_INT_EQ(widths[0], 5);
+    TEST_ASSERT_INT_EQ(widths[1], 5 + 1 + 3);
+    TEST_ASSERT_INT_EQ(widths[2], GetTextWidth("mim", FONT_5X8));
+    GetTextDimensions("mim", FONT_5X8, &r);
+    TEST_ASSERT_INT_EQ(r.width, widths[2]);
+    TEST_ASSERT_INT_EQ(r.height, 8);
+    GetTextDimensions(NULL, FONT_5X5, &r);
+    TEST_ASSERT_INT_EQ(r.width, 0);
+    TEST_ASSERT_INT_EQ(r.height, 5);
+
+    // Only /maxChars/ are measured
+    TEST_ASSERT_INT_EQ(GetTextPrefixWidths("mmmmmmmmmm", FONT_5X8, widths, 8), 8);
+    TEST_ASSERT_INT_EQ(GetTextCharsThatFit(widths, 8, 0), 0);
+    TEST_ASSERT_INT_EQ(GetTextCharsThatFit(widths, 8, 5), 1);
+    TEST_ASSERT_INT_EQ(GetTextCharsThatFit(widths, 8, 10), 1);
+    TEST_ASSERT_INT_EQ(GetTextCharsThatFit(widths, 8, 11), 2);
+    TEST_ASSERT_INT_EQ(GetTextCharsThatFit(widths, 8, 1000), 8);
+
+    TEST_RETURN;
+}
+
+//
+// Measuring is table lookups only, so justified text boxes should cost about
+// the same as left justified, and truncating by binary search over prefix
+// widths should beat measuring each shorter string.
+//
+void DrawScrollLinesLeft()
+{
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        0, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+}
+void DrawScrollLinesCentered()
+{
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        0, CENTER_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+}
+void TruncateByShortening()
+{
+    char s[32];
+    for (int i = 0; i < ARRAY_SIZEOF(scrollLines); i++) {
+        strcpy(s, scrollLines[i]);
+        for (int n = strlen(s); n > 0 && GetTextWidth(s, FONT_5X8) > SCREEN_WIDTH / 2; n--) {
+            s[n - 1] = '\0';
+        }
+    }
+}
+void TruncateByPrefixWidths()
+{
+    uint16 widths[32];
+    for (int i = 0; i < ARRAY_SIZEOF(scrollLines); i++) {
+        int n = GetTextPrefixWidths(scrollLines[i], FONT_5X8, widths, 32);
+        GetTextCharsThatFit(widths, n, SCREEN_WIDTH / 2);
+    }
+}
+int TestTextMeasureSpeed()
+{
+    TEST_INIT;
+    int usecs, usecsCentered;
+    int usecsShortening, usecsPrefixWidths;
+
+    usecs = TimeIt(DrawScrollLinesLeft, 10);
+    usecsCentered = TimeIt(DrawScrollLinesCentered, 10);
+    TEST_ASSERT_PRINT(usecsCentered <= usecs * 105 / 100,
+        "usecs = %d, centered = %d", usecs, usecsCentered);
+
+    usecsShortening = TimeIt(TruncateByShortening, 10);
+    usecsPrefixWidths = TimeIt(TruncateByPrefixWidths, 10);
+    TEST_ASSERT_PRINT(usecsPrefixWidths * 4 < usecsShortening,
+        "shortening usecs = %d, prefix widths = %d", usecsShortening, usecsPrefixWidths);
+
+    TEST_RETURN;
+}
+
 void TestDisplayScrollUp()
 {
+    int shiftUp = 0;
+
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        shiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+    CyDelay(MTEST_DELAY_FAST);
+
+    // One row at a time, then a line at a time
+    for (; shiftUp < 27; shiftUp++) {
+        DrawTextBoxScroll(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+            shiftUp, shiftUp + 1, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+        CyDelay(30);
+    }
+    for (; shiftUp < 27 + 5 * 9; shiftUp += 9) {
+        DrawTextBoxScroll(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+            shiftUp, shiftUp + 9, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+        CyDelay(200);
+    }
+
     CyDelay(MTEST_DELAY);
 }
 
 void TestDisplayScrollDown()
 {
+    int shiftUp = 27 + 5 * 9;
+
+    DrawTextBox(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+        shiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+    CyDelay(MTEST_DELAY_FAST);
+
+    for (; shiftUp > 0; shiftUp--) {
+        DrawTextBoxScroll(scrollLines, ARRAY_SIZEOF(scrollLines), SCREEN_BOUNDS,
+            shiftUp, shiftUp - 1, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK);
+        CyDelay(30);
+    }
+
     CyDelay(MTEST_DELAY);
 }
 
@@ -1008,6 +2653,42 @@ void TestTextBox()
     CyDelay(MTEST_DELAY);
 }
 
+//
+// Same as TestTextBoxScrolling(), but composed in the framebuffer, with only
+// changes flushed to the OLED.
+//
+void TestTextBoxScrollingFramebuf()
+{
+    char * lines[] = {
+        "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA",
+        "BBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBBB",
+        "CCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCCC",
+        "44444 ----------444444444444444444444444",
+        "55555 FRAMEBUF  555555555555555555555555",
+        "66666 NO        666666666666666666666666",
+        "77777 FLICKER   777777777777777777777777",
+        "99999 ----------999999999999999999999999",
+        "KKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKKK",
+        "LLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLL",
+        "MMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMMM",
+        "NNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNNN",
+        "OOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOO",
+    };
+
+    DisplayErase();
+    FramebufInit();
+    DrawToFramebuf(1);
+    for (int shiftUp = 0; shiftUp < SCREEN_HEIGHT; shiftUp++) {
+        DrawTextBox(
+            lines, ARRAY_SIZEOF(lines), SCREEN_BOUNDS,
+            shiftUp, LEFT_JUSTIFIED, FONT_5X8, WHITE, BLACK
+            );
+        FramebufFlush();
+        CyDelay(10);
+    }
+    DrawToFramebuf(0);
+}
+
 void TestTextBoxScrolling()
 {
     // Full screen scrolling, full text
@@ -1286,19 +2967,32 @@ void TestSuite()
     TEST(TestSpiXferInterrupts(TEST_SPI_XFER_TX, 1));
 
     TEST(TestSpiXferTooMany());
+    TEST(TestSpiXferTooBig());
+    TEST(TestSpiXferPriority());
+    TEST(TestSpiXferPio());
+    TEST(TestSpiXferPioSpeed());
 
     TEST(TestSpiXferWriteReadMem(TEST_SPI_XFER_UNLOCKED));
     TEST(TestSpiXferWriteReadMem(TEST_SPI_XFER_LOCKED));
 
     TEST(TestSerialRamFuncs());
     TEST(TestSerialRamWriteRead());
+    TEST(TestSerialRamAnyBuf());
     TEST(TestSerialRamFillMem());
+    TEST(TestSerialRamRegions());
     TEST(TestSerialRamXfersOverlapping());
+    TEST(TestSpiXferStaged());
 
     TEST(TestQueueEnqueueOneDequeueOne());
     TEST(TestQueueEnqueueDequeueVariableSizes());
     TEST(TestQueueFillThenEmpty());
+    TEST(TestQueueWrapAround());
+    TEST(TestQueuePipelined());
+    TEST(TestQueuePacket());
     TEST(TestQueueConcurrency());
+    TEST(TestMicStreamPending());
+    TEST(TestMicDropGap());
+    TEST(TestAdpcm());
 
     TEST(TestDisplayRgbColors());
     TEST(TestDoRectsIntersect());
@@ -1307,6 +3001,26 @@ void TestSuite()
 
     TEST(TestDisplayEraseSpeed());
     TEST(TestDisplayFillSpeed());
+    TEST(TestDisplaySmallRectSpeed());
+    TEST(TestDisplayWindowCache());
+    TEST(TestTextBoxStrips());
+    TEST(TestTextLayout());
+    TEST(TestTextLayoutTruncated());
+    TEST(TestTextLayoutWrap());
+    TEST(TestListView());
+    TEST(TestMsgStore());
+    TEST(TestFramebuf());
+    TEST(TestFramebufDepth());
+    TEST(TestFramebufBusBytes());
+    TEST(TestDrawListTiles());
+    TEST(TestImageDecode());
+    TEST(TestDrawLineSpeed());
+    TEST(TestDrawTextSpeed());
+    TEST(TestGlyphCache());
+    TEST(TestWatchFace());
+    TEST(TestDisplayScrollSpeed());
+    TEST(TestTextMeasure());
+    TEST(TestTextMeasureSpeed());
 
     MTEST(TestDisplayUpperLeftCorner());
     MTEST(TestDisplayFill("RED", RED));
@@ -1320,12 +3034,17 @@ void TestSuite()
     MTEST(TestFont("FONT_5X5", FONT_5X5));
     MTEST(TestFont("FONT_5X8", FONT_5X8));
     MTEST(TestTextBoxScrolling());
+    MTEST(TestTextBoxScrollingFramebuf());
+    MTEST(TestDisplayScrollUp());
+    MTEST(TestDisplayScrollDown());
     MTEST(TestTextBox());
     MTEST(TestDrawLineHorzVert());
     MTEST(TestDrawLineDiag());
+    MTEST(TestDrawList());
+    MTEST(TestDrawShapes());
     MTEST(TestDrawRect());
-#if 0
     MTEST(TestDrawImage());
+#if 0
     MTEST(TestDrawStatusBar());
 #endif
 
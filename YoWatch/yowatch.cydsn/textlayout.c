@@ -0,0 +1,426 @@
+/*
+ * textlayout.c
+ *
+ * Word wrapping text layout, with incremental reflow
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <string.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "fonts.h"
+#include "draw.h"
+#include "textlayout.h"
+
+//
+// Text (like speech-to-text results from YoPhone) arrives in pieces, with
+// each piece appended to (or revising the end of) the text so far.  Only the
+// lines from the change on are reflowed, and only lines that changed are
+// redrawn, so each piece costs time in proportion to the new text, not to the
+// whole string.
+//
+// Lines are greedily wrapped at spaces, or mid-word for words longer than the
+// box, and at '\n'.  When there are more lines than fit in the box, the last
+// lines are shown.  Past TEXT_LAYOUT_MAX_LINES, the text is truncated, and the
+// last line ends in an ellipsis.
+//
+
+//
+// Non-ASCII chars that have an obvious ASCII stand-in.  All others are shown
+// as '?'.
+//
+static const struct {
+    uint16 codepoint;
+    char c;
+} utf8Substitutes[] = {
+    { 0x00A0, ' ' },    // no-break space
+    { 0x00B2, '2' },    // superscript two (as in "mi²")
+    { 0x2013, '-' },    // en dash
+    { 0x2014, '-' },    // em dash
+    { 0x2018, '\'' },   // single quotes
+    { 0x2019, '\'' },
+    { 0x201C, '"' },    // double quotes
+    { 0x201D, '"' },
+};
+
+//
+// Decode the UTF-8 char at /s/ to a font char.
+//
+// @param s     text, which must not be at the terminating NUL
+// @param c     output: font char to draw
+//
+// @return number of bytes in the char
+//
+static int Utf8Next(
+    const char * s,
+    char * c
+    )
+{
+    const uint8 * u = (const uint8 *) s;
+    uint32 codepoint;
+    int bytes, i;
+
+    if (u[0] < 0x80) {
+        *c = u[0];
+        return 1;
+    }
+
+    if ((u[0] & 0xE0) == 0xC0) {
+        bytes = 2;
+        codepoint = u[0] & 0x1F;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        bytes = 3;
+        codepoint = u[0] & 0x0F;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        bytes = 4;
+        codepoint = u[0] & 0x07;
+    } else {
+        // Stray continuation byte, or invalid
+        *c = '?';
+        return 1;
+    }
+
+    for (i = 1; i < bytes; i++) {
+        if ((u[i] & 0xC0) != 0x80) {
+            // Truncated sequence (this also stops at NUL)
+            *c = '?';
+            return i;
+        }
+        codepoint = (codepoint << 6) | (u[i] & 0x3F);
+    }
+
+    *c = '?';
+    for (i = 0; i < ARRAY_SIZEOF(utf8Substitutes); i++) {
+        if (utf8Substitutes[i].codepoint == codepoint) {
+            *c = utf8Substitutes[i].c;
+            break;
+        }
+    }
+    return bytes;
+}
+
+//
+// Get the font chars of UTF-8 /text/, as a layout draws them, with '\n' as a
+// space.  For text shown outside a layout, like list rows.
+//
+// @param text      UTF-8 text, NUL terminated
+// @param buf       output: font chars, NUL terminated
+// @param maxChars  size of buf, less the NUL
+//
+// @return number of chars
+//
+int Utf8ToFontChars(
+    const char * text,
+    char * buf,
+    int maxChars
+    )
+{
+    int n = 0;
+
+    while (*text != '\0' && n < maxChars) {
+        text += Utf8Next(text, &buf[n]);
+        if (buf[n] == '\n') buf[n] = ' ';
+        n++;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static int LineHeight(
+    struct TEXT_LAYOUT * layout
+    )
+{
+    return FONT_HEIGHT(layout->font) + INTER_LINE_SPACING;
+}
+
+static int SkipSpaces(
+    const char * text,
+    int p
+    )
+{
+    while (text[p] == ' ') p++;
+    return p;
+}
+
+//
+// Wrap one line.
+//
+// @param p     byte offset of start of line
+//
+// @return byte offset of start of next line
+//
+static int WrapLine(
+    struct TEXT_LAYOUT * layout,
+    int p
+    )
+{
+    const char * text = layout->text;
+    int width = -INTER_CHAR_SPACING;
+    int lastSpace = -1;
+    int q = p;
+
+    while (text[q] != '\0') {
+        char c;
+        int bytes = Utf8Next(&text[q], &c);
+
+        if (c == '\n') return q + bytes;
+        if (c == ' ') lastSpace = q;
+
+        width += CHAR_ADVANCE(layout->font, c);
+        if (width > layout->box.width && q > p) {
+            if (c == ' ') return SkipSpaces(text, q);
+            if (lastSpace > p) return SkipSpaces(text, lastSpace);
+            return q;
+        }
+        q += bytes;
+    }
+    return q;
+}
+
+//
+// Wrap the lines from /first/ to the end of the text.
+//
+static void Reflow(
+    struct TEXT_LAYOUT * layout,
+    int first
+    )
+{
+    int p = layout->lineStart[first];
+    int line;
+
+    for (line = first; layout->text[p] != '\0' && line < TEXT_LAYOUT_MAX_LINES; line++) {
+        layout->lineStart[line] = p;
+        p = WrapLine(layout, p);
+    }
+    layout->lineStart[line] = p;
+    layout->numLines = line;
+    layout->truncated = layout->text[p] != '\0';
+}
+
+//
+// End the chars of a line with "...", dropping chars from the end to make
+// room for it in the box.
+//
+// @return number of chars
+//
+static int AddEllipsis(
+    struct TEXT_LAYOUT * layout,
+    char buf[TEXT_LAYOUT_MAX_LINE_CHARS + 1],
+    int n
+    )
+{
+    int width = 3 * CHAR_ADVANCE(layout->font, '.') - INTER_CHAR_SPACING;
+    int i;
+
+    n = MIN(n, TEXT_LAYOUT_MAX_LINE_CHARS - 3);
+    for (i = 0; i < n; i++) {
+        width += CHAR_ADVANCE(layout->font, buf[i]);
+    }
+    while (n > 0 && width > layout->box.width) {
+        n--;
+        width -= CHAR_ADVANCE(layout->font, buf[n]);
+    }
+    strcpy(&buf[n], "...");
+    return n + 3;
+}
+
+//
+// Get the font chars of /line/ (without trailing spaces or newline).  If the
+// text is truncated, the last line ends in "...".
+//
+// @return number of chars
+//
+int TextLayoutGetLine(
+    struct TEXT_LAYOUT * layout,
+    int line,
+    char buf[TEXT_LAYOUT_MAX_LINE_CHARS + 1]
+    )
+{
+    int p = layout->lineStart[line];
+    int end = layout->lineStart[line + 1];
+    int n = 0;
+
+    assert(line >= 0 && line < layout->numLines);
+
+    while (p < end && n < TEXT_LAYOUT_MAX_LINE_CHARS) {
+        p += Utf8Next(&layout->text[p], &buf[n]);
+        n++;
+    }
+    while (n > 0 && (buf[n - 1] == ' ' || buf[n - 1] == '\n')) n--;
+    buf[n] = '\0';
+
+    if (layout->truncated && line == layout->numLines - 1) {
+        n = AddEllipsis(layout, buf, n);
+    }
+    return n;
+}
+
+//
+// Draw /line/ in its row of the box, as one strip (see DrawTextBox()).
+//
+static void DrawLayoutLine(
+    struct TEXT_LAYOUT * layout,
+    int line
+    )
+{
+    char buf[TEXT_LAYOUT_MAX_LINE_CHARS + 1];
+    char * lines[] = { buf };
+    int lineHeight = LineHeight(layout);
+    RECT strip = {
+        layout->box.x,
+        layout->box.y + (line - layout->topLine) * lineHeight,
+        layout->box.width,
+        lineHeight
+        };
+
+    TextLayoutGetLine(layout, line, buf);
+    DrawTextBox(lines, 1, strip, 0, LEFT_JUSTIFIED,
+        layout->font, layout->fgColor, layout->bgColor);
+}
+
+//
+// Lay out /text/ in /box/, and draw it (erasing the rest of the box).
+//
+// @param layout    layout to init
+// @param text      UTF-8 text.  Must stay valid while the layout is used.
+// @param box       box to wrap the text in, and to draw it in
+// @param font      text font
+// @param fgColor   foreground color of text
+// @param bgColor   background color of text
+//
+void TextLayoutInit(
+    struct TEXT_LAYOUT * layout,
+    char * text,
+    RECT box,
+    int font,
+    int fgColor,
+    int bgColor
+    )
+{
+    layout->text = text;
+    layout->box = box;
+    layout->font = font;
+    layout->fgColor = fgColor;
+    layout->bgColor = bgColor;
+    layout->numLines = 0;
+    layout->topLine = 0;
+    layout->truncated = 0;
+    layout->lineStart[0] = 0;
+
+    // Whatever is in the box now must be erased
+    layout->drawnLines = box.height / LineHeight(layout) + 1;
+
+    TextLayoutUpdate(layout, 0);
+}
+
+//
+// Reflow and redraw after the text was changed.
+//
+// @param layout        layout
+// @param changedFrom   byte offset of the first change in the text - for
+//                      appended text, the old length of the text
+//
+// @return number of lines drawn.  Check /truncated/ for text left out.
+//
+int TextLayoutUpdate(
+    struct TEXT_LAYOUT * layout,
+    int changedFrom
+    )
+{
+    uint16 oldStart[TEXT_LAYOUT_MAX_LINES + 1];
+    int oldNumLines = layout->numLines;
+    int oldTopLine = layout->topLine;
+    int oldTruncated = layout->truncated;
+    int lineHeight = LineHeight(layout);
+    int visibleLines = layout->box.height / lineHeight;
+    int first, line, drawn = 0;
+
+    //
+    // Reflow from the line before the change (the first word of the changed
+    // line might now fit on the line before), to the end.
+    //
+    for (first = 0; first + 1 < oldNumLines; first++) {
+        if (layout->lineStart[first + 1] > changedFrom) break;
+    }
+    first = MAX(first - 1, 0);
+
+    memcpy(oldStart, layout->lineStart, (oldNumLines + 1) * sizeof(uint16));
+
+    Reflow(layout, first);
+
+    //
+    // Redraw lines that changed.  If the lines shown moved (the text grew
+    // past the bottom of the box), redraw all of them.
+    //
+    layout->topLine = MAX(layout->numLines - visibleLines, 0);
+    for (line = layout->topLine; line < layout->numLines && line < layout->topLine + visibleLines; line++) {
+        if (layout->topLine == oldTopLine && line < first) continue;
+        if (layout->topLine == oldTopLine && line < oldNumLines
+            && oldStart[line] == layout->lineStart[line]
+            && oldStart[line + 1] == layout->lineStart[line + 1]
+            && layout->lineStart[line + 1] <= changedFrom
+            && !(line == layout->numLines - 1 && layout->truncated != oldTruncated))
+        {
+            continue;
+        }
+        DrawLayoutLine(layout, line);
+        drawn++;
+    }
+
+    //
+    // Erase lines that are no longer there.
+    //
+    line -= layout->topLine;
+    if (line < layout->drawnLines) {
+        RECT r = {
+            layout->box.x,
+            layout->box.y + line * lineHeight,
+            layout->box.width,
+            (layout->drawnLines - line) * lineHeight
+            };
+        DrawRect(RectIntersection(r, layout->box), layout->bgColor);
+    }
+    layout->drawnLines = line;
+
+    return drawn;
+}
+
+//
+// Lay out /text/ in lines /width/ wide, without drawing it - for text shown
+// a line at a time (with TextLayoutGetLine()) by something else, like a list
+// view.
+//
+// @param layout    layout to init
+// @param text      UTF-8 text.  Must stay valid while the layout is used.
+// @param width     line width
+// @param font      text font
+//
+// @return number of lines.  Check /truncated/ for text left out.
+//
+int TextLayoutWrap(
+    struct TEXT_LAYOUT * layout,
+    char * text,
+    int width,
+    int font
+    )
+{
+    RECT box = { 0, 0, width, 0 };
+
+    layout->text = text;
+    layout->box = box;
+    layout->font = font;
+    layout->fgColor = 0;
+    layout->bgColor = 0;
+    layout->topLine = 0;
+    layout->drawnLines = 0;
+    layout->lineStart[0] = 0;
+
+    Reflow(layout, 0);
+    return layout->numLines;
+}
@@ -0,0 +1,64 @@
+#ifndef _TEXTLAYOUT_H_
+#define _TEXTLAYOUT_H_
+
+#include <project.h>
+#include "rect.h"
+
+#define TEXT_LAYOUT_MAX_LINES       64
+#define TEXT_LAYOUT_MAX_LINE_CHARS  64
+
+//
+// Word wrapped text in a box.  The text is owned by the caller, and may be
+// changed (typically, appended to) followed by TextLayoutUpdate().
+//
+// Only the first TEXT_LAYOUT_MAX_LINES lines are laid out.  Any more text is
+// left out, with the last line ending in "..." to show it.
+//
+struct TEXT_LAYOUT {
+    char * text;            // UTF-8, NUL terminated
+    RECT box;
+    int font;
+    int fgColor;
+    int bgColor;
+    int numLines;
+    int topLine;            // first line shown in box
+    int drawnLines;         // lines on screen, from topLine
+    int truncated;          // text is past TEXT_LAYOUT_MAX_LINES
+    // Byte offset in text of each line, and of the end of the text
+    uint16 lineStart[TEXT_LAYOUT_MAX_LINES + 1];
+};
+
+void TextLayoutInit(
+    struct TEXT_LAYOUT * layout,
+    char * text,
+    RECT box,
+    int font,
+    int fgColor,
+    int bgColor
+    );
+
+int TextLayoutUpdate(
+    struct TEXT_LAYOUT * layout,
+    int changedFrom
+    );
+
+int TextLayoutWrap(
+    struct TEXT_LAYOUT * layout,
+    char * text,
+    int width,
+    int font
+    );
+
+int TextLayoutGetLine(
+    struct TEXT_LAYOUT * layout,
+    int line,
+    char buf[TEXT_LAYOUT_MAX_LINE_CHARS + 1]
+    );
+
+int Utf8ToFontChars(
+    const char * text,
+    char * buf,
+    int maxChars
+    );
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * watchface.c
+ *
+ * Watch face (TIME state) rendering
+ *
+ * Copyright (C) 2018 Brian Silverman <bri@readysetstem.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ */
+#include <project.h>
+#include <stdio.h>
+#include <string.h>
+#include "printf.h"
+#include "assert.h"
+#include "util.h"
+#include "colors.h"
+#include "display.h"
+#include "fonts.h"
+#include "draw.h"
+#include "watchface.h"
+
+//
+// The watch face is redrawn every tick, but almost nothing changes from one
+// tick to the next.  So, what was last drawn is kept, and only what differs is
+// drawn: for text, just the runs of changed chars (so a seconds tick is one
+// small bitmap), and icons only when their state changes.
+//
+#define WATCH_FACE_MAX_TEXT 12
+#define WATCH_FACE_BG       BLACK
+
+#define TIME_Y              40
+#define DATE_Y              52
+#define ICON_Y              1
+#define BLE_ICON_X          2
+
+struct FIELD {
+    int y;
+    int font;
+    int fgColor;
+    char text[WATCH_FACE_MAX_TEXT];
+    RECT rect;
+};
+
+static struct FIELD timeField = { TIME_Y, FONT_5X8, WHITE };
+static struct FIELD dateField = { DATE_Y, FONT_5X5, LIGHT_SLATE_GRAY };
+
+static struct {
+    int valid;
+    int bleConnected;
+} drawn;
+
+//
+// Force the next WatchFaceDraw() to draw everything (for example, after the
+// screen was used for something else).  Doesn't erase the screen.
+//
+void WatchFaceInvalidate()
+{
+    drawn.valid = 0;
+}
+
+//
+// Chars are laid out in fixed cells, with every digit in a cell as wide as
+// the widest digit (font digits are proportional: '1' is narrower).  So the
+// text doesn't shift sideways as digits change, and a changed digit only
+// redraws its own cell.
+//
+// @return width of the cell for /c/
+//
+static int CellWidth(
+    int font,
+    char c
+    )
+{
+    int width = 0;
+
+    if (c < '0' || c > '9') return CHAR_ADVANCE(font, c);
+    for (c = '0'; c <= '9'; c++) {
+        width = MAX(width, CHAR_ADVANCE(font, c));
+    }
+    return width;
+}
+
+//
+// @return true if /s1/ and /s2/ have the same cells, so that changed chars
+// can be drawn in place.
+//
+static int SameLayout(
+    int font,
+    char * s1,
+    char * s2
+    )
+{
+    for (; *s1 != '\0' && *s2 != '\0'; s1++, s2++) {
+        if (CellWidth(font, *s1) != CellWidth(font, *s2)) return 0;
+    }
+    return *s1 == *s2;
+}
+
+//
+// Add the cells of chars /start/ to /end/ of /text/ to the display list, each
+// char centered in its cell.
+//
+// @param x     left of the cell of char /start/
+//
+static void DrawCells(
+    struct FIELD * f,
+    char * text,
+    int start,
+    int end,
+    int x
+    )
+{
+    // Text is drawn by reference, at DrawListEnd()
+    static char chars[WATCH_FACE_MAX_TEXT][2];
+    RECT cells = {x, f->y, 0, FONT_HEIGHT(f->font)};
+    int i;
+
+    for (i = start; i < end; i++) {
+        cells.width += CellWidth(f->font, text[i]);
+    }
+    DrawRect(cells, WATCH_FACE_BG);
+
+    for (i = start; i < end; i++) {
+        int width = CellWidth(f->font, text[i]);
+
+        chars[i][0] = text[i];
+        chars[i][1] = '\0';
+        DrawText(chars[i], x + (width - CHAR_ADVANCE(f->font, text[i])) / 2, f->y,
+            f->font, f->fgColor, WATCH_FACE_BG);
+        x += width;
+    }
+}
+
+//
+// Draw /text/ centered in field /f/, drawing only the runs of chars that
+// changed since it was last drawn.  Each run goes out as one bitmap.
+//
+// @return number of runs of text drawn
+//
+static int DrawField(
+    struct FIELD * f,
+    char * text
+    )
+{
+    RECT r = {0, f->y, -INTER_CHAR_SPACING, FONT_HEIGHT(f->font)};
+    int len = strlen(text);
+    int runs = 0;
+    int x, i;
+
+    assert(len < WATCH_FACE_MAX_TEXT);
+
+    for (i = 0; i < len; i++) {
+        r.width += CellWidth(f->font, text[i]);
+    }
+    r.width = MAX(r.width, 0);
+    r.x = (SCREEN_WIDTH - r.width) / 2;
+
+    if (!drawn.valid || !SameLayout(f->font, text, f->text)) {
+        DrawListBegin(WATCH_FACE_BG);
+        if (drawn.valid) {
+            DrawRect(f->rect, WATCH_FACE_BG);
+        }
+        DrawCells(f, text, 0, len, r.x);
+        DrawListEnd();
+        strcpy(f->text, text);
+        f->rect = r;
+        return 1;
+    }
+
+    x = r.x;
+    for (i = 0; i < len; ) {
+        int start = i;
+        int runX = x;
+
+        while (i < len && text[i] != f->text[i]) {
+            x += CellWidth(f->font, text[i]);
+            i++;
+        }
+        if (i > start) {
+            DrawListBegin(WATCH_FACE_BG);
+            DrawCells(f, text, start, i, runX);
+            DrawListEnd();
+            runs++;
+        } else {
+            x += CellWidth(f->font, text[i]);
+            i++;
+        }
+    }
+
+    strcpy(f->text, text);
+    return runs;
+}
+
+//
+// Bluetooth rune, 5x7.  Composed in a display list, so it goes out as one
+// flicker free bitmap.
+//
+static void DrawBleIcon(
+    int connected
+    )
+{
+    int x = BLE_ICON_X;
+    int y = ICON_Y;
+    int color = connected ? BLUE : DIM_GREY;
+
+    DrawListBegin(WATCH_FACE_BG);
+    DrawLine(x + 2, y, x + 2, y + 6, color);
+    DrawLine(x + 2, y, x + 4, y + 2, color);
+    DrawLine(x + 4, y + 2, x, y + 5, color);
+    DrawLine(x, y + 1, x + 4, y + 4, color);
+    DrawLine(x + 4, y + 4, x + 2, y + 6, color);
+    DrawListEnd();
+}
+
+//
+// Draw the watch face, drawing only what changed since the last call.
+//
+// @param face  what to show
+//
+// @return number of parts (text runs or icons) drawn
+//
+int WatchFaceDraw(
+    const struct WATCH_FACE * face
+    )
+{
+    char text[WATCH_FACE_MAX_TEXT];
+    int parts = 0;
+
+    snprintf(text, sizeof(text), "%02d:%02d:%02d", face->hours, face->minutes, face->seconds);
+    parts += DrawField(&timeField, text);
+
+    text[0] = '\0';
+    if (face->month) {
+        snprintf(text, sizeof(text), "%02d/%02d", face->month, face->day);
+    }
+    parts += DrawField(&dateField, text);
+
+    if (!drawn.valid || face->bleConnected != drawn.bleConnected) {
+        DrawBleIcon(face->bleConnected);
+        drawn.bleConnected = face->bleConnected;
+        parts++;
+    }
+
+    drawn.valid = 1;
+    return parts;
+}
@@ -0,0 +1,24 @@
+#ifndef _WATCHFACE_H_
+#define _WATCHFACE_H_
+
+#include <project.h>
+
+//
+// Everything shown on the watch face
+//
+struct WATCH_FACE {
+    uint8 hours;
+    uint8 minutes;
+    uint8 seconds;
+    uint8 month;            // 1 to 12, or 0 if the date isn't known
+    uint8 day;
+    uint8 bleConnected;
+};
+
+void WatchFaceInvalidate();
+
+int WatchFaceDraw(
+    const struct WATCH_FACE * face
+    );
+
+#endif